@@ -0,0 +1,309 @@
+#include <cpu.h>
+#include <chrono>
+#include <cmath>
+#include <layout.h>
+#include <loader.h>
+#include <string.h>
+#include <vector>
+
+#define INSTRUCTIONS        20000000
+#define REPEAT              5
+#define BENCH_SLICE         (1 << 16)
+#define DATA_ADDRESS        0x8000
+#define UNROLL              16
+
+struct Workload
+{
+    std::string name;
+    std::vector<uint8_t> image;
+    bool scripted;
+};
+
+// a run ends early when the guest exits, waits for good or faults
+struct Run
+{
+    double seconds;
+    uint64_t instructions;
+    const char* stop;
+};
+
+struct Result
+{
+    std::string workload;
+    Engine engine;
+    double ns_mean;
+    double ns_stddev;
+    double mips;
+    uint64_t instructions;
+    const char* stop;
+};
+
+uint32_t R(uint8_t func7, uint8_t src2, uint8_t src1, uint8_t func3, uint8_t dest, uint8_t opcode)
+{
+    return func7 << 25 | src2 << 20 | src1 << 15 | func3 << 12 | dest << 7 | opcode;
+}
+
+uint32_t I(int32_t imm, uint8_t src1, uint8_t func3, uint8_t dest, uint8_t opcode)
+{
+    return (imm & 0xfff) << 20 | src1 << 15 | func3 << 12 | dest << 7 | opcode;
+}
+
+uint32_t S(int32_t imm, uint8_t src2, uint8_t src1, uint8_t func3)
+{
+    return ((imm >> 5) & 0x7f) << 25 | src2 << 20 | src1 << 15 | func3 << 12 | (imm & 0x1f) << 7 | OPCODE_STORE;
+}
+
+uint32_t B(int32_t imm, uint8_t src2, uint8_t src1, uint8_t func3)
+{
+    return ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3f) << 25 | src2 << 20 | src1 << 15 | func3 << 12
+        | ((imm >> 1) & 0xf) << 8 | ((imm >> 11) & 1) << 7 | OPCODE_BRANCH;
+}
+
+uint32_t U(uint32_t imm, uint8_t dest, uint8_t opcode)
+{
+    return (imm & 0xfffff000) | dest << 7 | opcode;
+}
+
+uint32_t J(int32_t imm, uint8_t dest)
+{
+    return ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3ff) << 21 | ((imm >> 11) & 1) << 20
+        | ((imm >> 12) & 0xff) << 12 | dest << 7 | OPCODE_JAL;
+}
+
+// lays out setup code followed by an endless loop over the body
+Workload micro(const char* name, std::vector<uint32_t> body)
+{
+    std::vector<uint32_t> code =
+    {
+        U(DATA_ADDRESS, 10, OPCODE_LUI),            // lui a0, DATA_ADDRESS
+        I(3, 0, 0, 6, OPCODE_ALUI),                 // addi t1, zero, 3
+        I(5, 0, 0, 7, OPCODE_ALUI),                 // addi t2, zero, 5
+    };
+
+    uint32_t loop = code.size();
+
+    for (int i = 0; i < UNROLL; i++)
+        code.insert(code.end(), body.begin(), body.end());
+
+    code.push_back(J((int32_t)(loop - code.size()) * 4, 0));
+
+    Workload workload = { name, std::vector<uint8_t>(code.size() * 4), false };
+    memcpy(workload.image.data(), code.data(), workload.image.size());
+
+    return workload;
+}
+
+Workload call_return()
+{
+    std::vector<uint32_t> code =
+    {
+        J(8, 1),                                    // loop: jal ra, func
+        J(-4, 0),                                   // jal zero, loop
+        I(0, 1, 0, 0, OPCODE_JALR),                 // func: jalr zero, 0(ra)
+    };
+
+    Workload workload = { "call-return", std::vector<uint8_t>(code.size() * 4), false };
+    memcpy(workload.image.data(), code.data(), workload.image.size());
+
+    return workload;
+}
+
+std::vector<Workload> micro_benchmarks()
+{
+    return
+    {
+        micro("alu-reg", { R(0, 6, 5, 0b000, 5, OPCODE_ALU), R(0b0100000, 7, 5, 0b000, 5, OPCODE_ALU),
+            R(0, 6, 5, 0b100, 28, OPCODE_ALU), R(0, 6, 7, 0b001, 29, OPCODE_ALU), R(0, 7, 6, 0b010, 30, OPCODE_ALU) }),
+        micro("alu-imm", { I(1, 5, 0b000, 5, OPCODE_ALUI), I(0x55, 5, 0b100, 28, OPCODE_ALUI),
+            I(3, 5, 0b001, 29, OPCODE_ALUI), I(7, 5, 0b010, 30, OPCODE_ALUI), I(0x0f, 5, 0b111, 31, OPCODE_ALUI) }),
+        micro("load-byte", { I(0, 10, 0b000, 5, OPCODE_LOAD), I(1, 10, 0b100, 28, OPCODE_LOAD) }),
+        micro("load-half", { I(0, 10, 0b001, 5, OPCODE_LOAD), I(2, 10, 0b101, 28, OPCODE_LOAD) }),
+        micro("load-word", { I(0, 10, 0b010, 5, OPCODE_LOAD), I(4, 10, 0b010, 28, OPCODE_LOAD) }),
+        micro("store-byte", { S(0, 6, 10, 0b000), S(1, 7, 10, 0b000) }),
+        micro("store-half", { S(0, 6, 10, 0b001), S(2, 7, 10, 0b001) }),
+        micro("store-word", { S(0, 6, 10, 0b010), S(4, 7, 10, 0b010) }),
+        micro("branch-taken", { B(4, 0, 0, 0b000) }),
+        micro("branch-not-taken", { B(8, 0, 0, 0b001) }),
+        call_return(),
+    };
+}
+
+// pretends to be a player holding each direction for a while
+void script_input(uint8_t* memory, uint64_t slice)
+{
+    static const int8_t moves[][2] = { { -1, 0 }, { 0, 0 }, { 1, 0 }, { 0, -1 }, { 0, 0 }, { 0, 1 } };
+
+    memory[KEYBOARD_ADDRESS] = moves[(slice / 8) % 6][0];
+    memory[KEYBOARD_ADDRESS + 1] = moves[(slice / 8) % 6][1];
+    memory[RANDOM_ADDRESS] = rand();
+}
+
+Run run(const Workload& workload, Engine engine, uint64_t count)
+{
+    std::vector<uint8_t> memory(MEMORY_SIZE);
+    std::copy(workload.image.begin(), workload.image.end(), memory.begin());
+
+    CPU cpu(memory.data(), MEMORY_SIZE);
+    cpu.engine = engine;
+    cpu.reset();
+    cpu.pc = 0;
+    cpu.x[2] = STACK_POINTER;
+
+    srand(1);
+
+    const char* stop = "limit";
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t done = 0, slice = 0; done < count; slice++)
+    {
+        if (workload.scripted)
+            script_input(memory.data(), slice);
+
+        uint64_t asked = std::min<uint64_t>(BENCH_SLICE, count - done);
+        uint64_t ran;
+
+        try
+        {
+            ran = cpu.run(asked);
+        }
+        catch (const Fault&)
+        {
+            stop = "fault";
+            break;
+        }
+
+        done += ran;
+
+        // the guest exited or waits for something no time brings
+        if (ran < asked)
+        {
+            stop = cpu.exited() ? "exit" : cpu.waiting ? "wfi" : "halt";
+            break;
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    return { std::chrono::duration<double>(end - start).count(), cpu.instret, stop };
+}
+
+Result measure(const Workload& workload, Engine engine, uint64_t count, int repeat)
+{
+    std::vector<double> ns(repeat);
+    Run last = {};
+
+    // every repeat retires the same instructions, the guest and its input
+    // being the same
+    for (int i = 0; i < repeat; i++)
+    {
+        last = run(workload, engine, count);
+        ns[i] = last.instructions != 0 ? last.seconds * 1e9 / last.instructions : 0;
+    }
+
+    double mean = 0;
+    double variance = 0;
+
+    for (double value : ns)
+        mean += value / repeat;
+
+    for (double value : ns)
+        variance += (value - mean) * (value - mean) / repeat;
+
+    return { workload.name, engine, mean, sqrt(variance), mean != 0 ? 1e3 / mean : 0, last.instructions, last.stop };
+}
+
+void write_json(const char* path, const std::vector<Result>& results, uint64_t count, int repeat)
+{
+    FILE* file = fopen(path, "w");
+
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"repeat\": %d,\n  \"results\": [\n", (unsigned long long)count, repeat);
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+
+        fprintf(file, "    { \"workload\": \"%s\", \"engine\": \"%s\", \"ns_per_instruction\": %.4f, \"stddev\": %.4f, \"mips\": %.2f, \"instructions\": %llu, \"stop\": \"%s\" }%s\n",
+            r.workload.c_str(), engine_name[r.engine], r.ns_mean, r.ns_stddev, r.mips, (unsigned long long)r.instructions, r.stop, i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+void usage(char** argv)
+{
+    fprintf(stderr, "use: %s [--engine E]... [--instructions N] [--repeat N] [--json FILE] [file...]\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<Engine> engines;
+    std::vector<Workload> workloads = micro_benchmarks();
+    uint64_t count = INSTRUCTIONS;
+    int repeat = REPEAT;
+    const char* json = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            Engine engine;
+
+            if (!parse_engine(argv[++i], engine))
+                usage(argv);
+
+            engines.push_back(engine);
+        }
+        else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc)
+            count = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json = argv[++i];
+        else if (argv[i][0] == '-')
+            usage(argv);
+        else
+        {
+            Workload workload = { argv[i], std::vector<uint8_t>(MEMORY_SIZE), true };
+
+            if (!load_binary(argv[i], workload.image.data(), MEMORY_SIZE))
+                return EXIT_FAILURE;
+
+            workloads.push_back(workload);
+        }
+    }
+
+    if (count == 0 || repeat <= 0)
+        usage(argv);
+
+    if (engines.empty())
+        engines = { ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT };
+
+    std::vector<Result> results;
+
+    printf("%-18s %-12s %10s %10s %10s %12s %s\n", "workload", "engine", "ns/inst", "stddev", "MIPS", "instructions", "stop");
+
+    for (const Workload& workload : workloads)
+    {
+        for (Engine engine : engines)
+        {
+            Result r = measure(workload, engine, count, repeat);
+            results.push_back(r);
+
+            printf("%-18s %-12s %10.3f %10.3f %10.2f %12llu %s\n", r.workload.c_str(), engine_name[r.engine], r.ns_mean, r.ns_stddev, r.mips,
+                (unsigned long long)r.instructions, r.stop);
+        }
+    }
+
+    if (json != nullptr)
+        write_json(json, results, count, repeat);
+
+    return 0;
+}
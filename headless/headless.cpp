@@ -0,0 +1,167 @@
+#include <disassembler.h>
+#include <machine.h>
+#include <pool.h>
+#include <chrono>
+#include <string.h>
+
+#define EXIT_LIMIT          124
+
+void usage(char** argv)
+{
+    fprintf(stderr, "use: %s [--engine interpreter|threaded|jit] [--memory SIZE] [--max-instructions N] [--timeout SECONDS] [--seed N] [--seeds N] [--input FILE] [--state FILE] [--trace FILE] [--profile PREFIX] [--sandbox DIR] [--gdb ADDRESS] [--threads N] [--disassemble] file...\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
+
+// the segments each file loads, listed instead of run
+int list_files(const std::vector<const char*>& paths, uint64_t memory_size, int threads)
+{
+    for (const char* path : paths)
+    {
+        Machine machine(memory_size);
+
+        if (!machine.load(path))
+            return EXIT_FAILURE;
+
+        if (paths.size() > 1)
+            printf("%s:\n", path);
+
+        for (const Segment& segment : machine.program.segments)
+        {
+            std::string listing = disassemble_range(machine.cpu.memory, segment.address, segment.address + segment.size, &machine.program.symbols, threads);
+            fwrite(listing.data(), 1, listing.size(), stdout);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+    Job base;
+    std::vector<const char*> paths;
+    uint32_t seeds = 1;
+    int threads = 0;
+    bool listing = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            if (!parse_engine(argv[++i], base.engine))
+                usage(argv);
+        }
+        else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc)
+        {
+            if (!parse_memory_size(argv[++i], base.memory_size))
+                usage(argv);
+        }
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+            base.max_instructions = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+            base.timeout = strtod(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            base.seed = strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc)
+            seeds = strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--disassemble") == 0)
+            listing = true;
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            if (!load_input(argv[++i], base.input))
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            base.trace = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            base.profile = argv[++i];
+        else if (strcmp(argv[i], "--sandbox") == 0 && i + 1 < argc)
+            base.sandbox = argv[++i];
+        else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc)
+            base.gdb = argv[++i];
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc)
+        {
+            auto state = std::make_shared<SaveState>();
+
+            if (!read_state(argv[++i], *state))
+                return EXIT_FAILURE;
+
+            base.state = state;
+        }
+        else if (argv[i][0] == '-')
+            usage(argv);
+        else
+            paths.push_back(argv[i]);
+    }
+
+    // traces and profiles go to fixed files and gdb attaches to one guest,
+    // so they only make sense for a single run
+    bool single = base.trace.empty() && base.profile.empty() && base.gdb.empty();
+
+    if (paths.empty() || seeds == 0 || (!single && (paths.size() > 1 || seeds > 1)))
+        usage(argv);
+
+    if (listing)
+        return list_files(paths, base.memory_size, threads);
+
+    std::vector<Job> jobs;
+
+    for (const char* path : paths)
+    {
+        for (uint32_t i = 0; i < seeds; i++)
+        {
+            Job job = base;
+            job.path = path;
+            job.seed = base.seed + i;
+            jobs.push_back(job);
+        }
+    }
+
+    std::vector<JobResult> results(jobs.size());
+
+    auto start = std::chrono::steady_clock::now();
+
+    parallel_for(jobs.size(), threads, [&](size_t i)
+    {
+        results[i] = run_job(jobs[i]);
+    });
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t instructions = 0;
+    int exited = 0;
+    int failed = 0;
+    int errors = 0;
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const JobResult& r = results[i];
+
+        printf("file=%s seed=%u exit=%s code=%u instructions=%llu seconds=%.3f mips=%.2f\n", jobs[i].path.c_str(), jobs[i].seed,
+            r.reason, r.exit_code, (unsigned long long)r.instructions, r.seconds, r.seconds > 0 ? r.instructions / r.seconds / 1e6 : 0.0);
+
+        if (!r.error.empty())
+            fprintf(stderr, "%s: %s\n", jobs[i].path.c_str(), r.error.c_str());
+
+        bool halted = strcmp(r.reason, "ecall") == 0 || strcmp(r.reason, "mmio") == 0;
+
+        instructions += r.instructions;
+        exited += halted;
+        failed += halted && r.exit_code != 0;
+        errors += strcmp(r.reason, "error") == 0;
+    }
+
+    if (jobs.size() == 1)
+    {
+        if (errors != 0)
+            return EXIT_FAILURE;
+
+        return exited != 0 ? results[0].exit_code & 0xff : EXIT_LIMIT;
+    }
+
+    printf("jobs=%zu exited=%d failed=%d errors=%d instructions=%llu seconds=%.3f mips=%.2f\n", jobs.size(), exited, failed, errors,
+        (unsigned long long)instructions, elapsed, elapsed > 0 ? instructions / elapsed / 1e6 : 0.0);
+
+    return failed == 0 && errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
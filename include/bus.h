@@ -0,0 +1,188 @@
+#pragma once
+
+#include <ram.h>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1 << PAGE_SHIFT)
+
+#define BUS_PAGES       (1 << (32 - PAGE_SHIFT))
+#define BUS_RAM         0
+#define BUS_WATCHED     0xfd
+#define BUS_ABSENT      0xfe
+#define BUS_UNMAPPED    0xff
+#define BUS_MAX_DEVICES (BUS_WATCHED - 1)
+#define BUS_LINE_SHIFT  5
+
+// every consumer of the dirty lines owns a bit, stores set all of them
+#define DIRTY_SCREEN    1
+#define DIRTY_ALL       0xff
+
+// the accesses a watchpoint stops on
+#define WATCH_WRITE     1
+#define WATCH_READ      2
+#define WATCH_ACCESS    (WATCH_READ | WATCH_WRITE)
+
+// exception codes, numbered like mcause
+#define FAULT_FETCH_MISALIGNED  0
+#define FAULT_FETCH_ACCESS      1
+#define FAULT_ILLEGAL           2
+#define FAULT_BREAKPOINT        3
+#define FAULT_LOAD_MISALIGNED   4
+#define FAULT_LOAD_ACCESS       5
+#define FAULT_STORE_MISALIGNED  6
+#define FAULT_STORE_ACCESS      7
+
+// what the host sees of an exception the guest had no handler for
+struct Fault : std::runtime_error
+{
+    uint32_t cause;
+    uint32_t address;
+
+    Fault(uint32_t _cause, uint32_t _address);
+};
+
+// callbacks get the offset into the device and return false to fault
+typedef std::function<bool(uint32_t offset, uint32_t size, uint32_t& value)> ReadCallback;
+typedef std::function<bool(uint32_t offset, uint32_t size, uint32_t value)> WriteCallback;
+
+struct Device
+{
+    uint32_t base;
+    uint32_t size;
+    ReadCallback read;
+    WriteCallback write;
+
+    // reads or sets the guest's time, which generated code does not keep
+    bool timed;
+};
+
+struct Watchpoint
+{
+    uint32_t address;
+    uint32_t size;
+    uint8_t kind;
+};
+
+// called once the access is done, with the address it was made to
+typedef std::function<void(const Watchpoint& watchpoint, uint32_t address)> WatchCallback;
+
+// Every 4 KiB page of the guest address space is plain RAM, a device or
+// unmapped. RAM is the zero entry, so an aligned access to it costs a single
+// table lookup and branch, everything else goes through the slow path.
+// RAM pages start out absent and become plain RAM the first time they are
+// accessed, so the pages a guest uses are known without scanning memory.
+// Stores to RAM also set a byte per 32-byte line, consumers such as the
+// screen clear their own bit once they have caught up, and list the page
+// the first time it changes, so that save states only look at those.
+// RAM pages under a watchpoint are marked watched, which sends only them
+// down the slow path.
+struct Bus
+{
+    uint8_t* memory;
+    uint64_t memory_size;
+
+    // the dirty lines and then a byte per RAM page that is set while it is
+    // in changed follow the page table, generated code reaches all three
+    // through the same base register
+    Ram pages;
+    uint8_t* dirty;
+    uint8_t* stored;
+    std::vector<Device> devices;
+
+    // RAM pages accessed since the memory was last cleared, in that order
+    std::vector<uint32_t> present;
+
+    // RAM pages stored to since they were last taken, each once
+    std::vector<uint32_t> changed;
+
+    std::vector<Watchpoint> watchpoints;
+    WatchCallback on_watch;
+
+    // set by an access that faulted, which reads as zero, for the CPU to
+    // turn into an exception
+    bool faulted = false;
+    uint32_t fault_cause = 0;
+    uint32_t fault_address = 0;
+
+    Bus(uint8_t* _memory, uint64_t _memory_size);
+
+    // new memory, every RAM page absent and the devices where they were
+    void resize(uint8_t* _memory, uint64_t _memory_size);
+
+    void map(uint32_t base, uint32_t size, ReadCallback read, WriteCallback write, bool timed = false);
+
+    bool is_ram(uint32_t address) const
+    {
+        return pages[address >> PAGE_SHIFT] == BUS_RAM;
+    }
+
+    bool is_timed(uint32_t address) const
+    {
+        uint8_t page = pages[address >> PAGE_SHIFT];
+
+        return page != BUS_RAM && page <= BUS_MAX_DEVICES && devices[page - 1].timed;
+    }
+
+    // an absent page becomes plain RAM, false if the page is not RAM at all
+    bool fault_in(uint32_t page);
+
+    // every present page back to absent and unchanged, for memory that
+    // was cleared
+    void evict();
+
+    // only RAM can be watched, unwatch takes exactly what watch was given
+    void watch(uint32_t address, uint32_t size, uint8_t kind);
+    bool unwatch(uint32_t address, uint32_t size, uint8_t kind);
+
+    template<typename T> T read(uint32_t address)
+    {
+        if (((address & (sizeof(T) - 1)) | pages[address >> PAGE_SHIFT]) == 0)
+            return *((T*)&memory[address]);
+
+        return (T)read_slow(address, sizeof(T));
+    }
+
+    template<typename T> void write(uint32_t address, T value)
+    {
+        if (((address & (sizeof(T) - 1)) | pages[address >> PAGE_SHIFT]) == 0)
+        {
+            *((T*)&memory[address]) = value;
+            mark_store(address);
+        }
+        else
+            write_slow(address, sizeof(T), value);
+    }
+
+    // for every store to RAM, also those made behind the bus
+    void mark_store(uint32_t address)
+    {
+        dirty[address >> BUS_LINE_SHIFT] = DIRTY_ALL;
+
+        if (stored[address >> PAGE_SHIFT] == 0)
+            mark_changed(address >> PAGE_SHIFT);
+    }
+
+    void mark_changed(uint32_t page);
+    void mark_page(uint32_t page, uint8_t bits);
+
+    // the changed pages, which are unchanged again afterwards
+    std::vector<uint32_t> take_changed();
+
+    // aligned device accesses only, false where the slow path would fault
+    bool read_device(uint32_t address, uint32_t size, uint32_t& value);
+    bool write_device(uint32_t address, uint32_t size, uint32_t value);
+
+private:
+
+    void fill();
+    void mark_watched(uint32_t address, uint32_t size);
+    void check_watch(uint32_t address, uint32_t size, uint8_t kind);
+
+    uint32_t fail(uint32_t cause, uint32_t address);
+    uint32_t read_slow(uint32_t address, uint32_t size);
+    void write_slow(uint32_t address, uint32_t size, uint32_t value);
+};
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <bus.h>
 #include <cstdint>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 #define OPCODE_MASK     0b01111111
 #define OPCODE_LUI      0b00110111
@@ -14,51 +18,325 @@
 #define OPCODE_STORE    0b00100011
 #define OPCODE_ALUI     0b00010011
 #define OPCODE_ALU      0b00110011
+#define OPCODE_SYSTEM   0b01110011
+#define OPCODE_FENCE    0b00001111
+
+#define SYSCALL_EXIT    93
+
+// the immediates of the privileged instructions under OPCODE_SYSTEM
+#define SYSTEM_MRET     0x302
+#define SYSTEM_WFI      0x105
+
+#define CSR_MSTATUS     0x300
+#define CSR_MISA        0x301
+#define CSR_MIE         0x304
+#define CSR_MTVEC       0x305
+#define CSR_MSCRATCH    0x340
+#define CSR_MEPC        0x341
+#define CSR_MCAUSE      0x342
+#define CSR_MTVAL       0x343
+#define CSR_MIP         0x344
+#define CSR_MCYCLE      0xb00
+#define CSR_MINSTRET    0xb02
+#define CSR_MCYCLEH     0xb80
+#define CSR_MINSTRETH   0xb82
+#define CSR_CYCLE       0xc00
+#define CSR_TIME        0xc01
+#define CSR_INSTRET     0xc02
+#define CSR_CYCLEH      0xc80
+#define CSR_TIMEH       0xc81
+#define CSR_INSTRETH    0xc82
+#define CSR_MVENDORID   0xf11
+#define CSR_MARCHID     0xf12
+#define CSR_MIMPID      0xf13
+#define CSR_MHARTID     0xf14
+
+// RV32 with I, M and C
+#define MISA            0x40001104
+
+#define MSTATUS_MIE     (1 << 3)
+#define MSTATUS_MPIE    (1 << 7)
+#define MSTATUS_MPP     (3 << 11)
+
+// interrupt numbers as mcause has them, and their bits in mie and mip
+#define IRQ_SOFTWARE    3
+#define IRQ_TIMER       7
+#define IRQ_EXTERNAL    11
+#define MIP_MSIP        (1 << IRQ_SOFTWARE)
+#define MIP_MTIP        (1 << IRQ_TIMER)
+#define MIP_MEIP        (1 << IRQ_EXTERNAL)
+
+#define MCAUSE_INTERRUPT    0x80000000
+
+enum Engine
+{
+    ENGINE_INTERPRETER,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+};
+
+// concrete instructions dispatched by the threaded engine, OP_REFERENCE
+// falls back to the decoded handler
+enum Op : uint8_t
+{
+    OP_NONE,
+    OP_REFERENCE,
+    OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    OP_COUNT
+};
+
+struct CPU;
+struct Jit;
+struct TraceWriter;
+struct Profiler;
+struct Syscalls;
+
+// machine mode, the only one there is
+struct Csrs
+{
+    uint32_t mstatus = 0;
+    uint32_t mie = 0;
+    uint32_t mtvec = 0;
+    uint32_t mscratch = 0;
+    uint32_t mepc = 0;
+    uint32_t mcause = 0;
+    uint32_t mtval = 0;
+
+    // raised by devices, the timer interrupt follows from mtimecmp instead
+    uint32_t mip = 0;
+};
+
+struct Decoded
+{
+    void (CPU::*handler)(const Decoded&);
+    uint32_t imm;
+    uint8_t op;
+    uint8_t func7;
+    uint8_t func3;
+    uint8_t dest;
+    uint8_t src1;
+    uint8_t src2;
+    uint8_t size;
+};
+
+// One entry per halfword, compressed instructions can start at any of them.
+// The two past the end are never filled, so the threaded engine stepping
+// off the page finds OP_NONE and refetches.
+struct DecodedPage
+{
+    Decoded inst[PAGE_SIZE / 2 + 2];
+};
 
 struct CPU
 {
     uint8_t* memory;
+    uint64_t memory_size;
+    Bus bus;
 
     uint32_t x[32];
     uint32_t pc;
 
     int dirty = -1;
 
-    CPU(uint8_t* _memory) : memory(_memory) {}
+    bool halted = false;
+    uint32_t exit_code = 0;
+
+    // halted by a breakpoint or watchpoint, clearing both resumes the guest
+    bool trapped = false;
+
+    // halted in wfi until an enabled interrupt is pending
+    bool waiting = false;
+
+    // halted only for run() to look at interrupts again
+    bool yielded = false;
+
+    // halted at the end of a frame, run() returns and the next step goes on
+    bool paused = false;
+
+    Csrs csr;
+
+    // mtime is the retired instructions plus the ticks skipped waiting, so
+    // guest time is the same whatever engine runs it and however fast
+    uint64_t instret = 0;
+    uint64_t idle = 0;
+    uint64_t mtimecmp = UINT64_MAX;
+
+    Engine engine = ENGINE_INTERPRETER;
+
+    // when either is set every instruction runs in the interpreter
+    TraceWriter* trace = nullptr;
+    Profiler* profile = nullptr;
+
+    // every ecall but exit goes there, they are ignored without it
+    Syscalls* syscalls = nullptr;
+
+    CPU(uint8_t* _memory, uint64_t _memory_size);
+    ~CPU();
+
+    // moves to other memory, nothing decoded or translated survives
+    void resize(uint8_t* _memory, uint64_t _memory_size);
 
     void reset();
     void execute(uint32_t instruction);
     void step();
-    std::string disassemble(uint32_t instruction);
+
+    // runs for count ticks of guest time, fewer if the guest halted or
+    // waits for something no amount of time brings
+    uint64_t run(uint64_t count);
+
+    // before the next step, wakes from wfi and takes a pending interrupt,
+    // skipping at most limit ticks while waiting for the timer, false as
+    // long as the guest can't go on
+    bool ready(uint64_t limit);
+
+    bool exited() const { return halted && !trapped && !waiting && !yielded && !paused; }
+    uint64_t time() const { return instret + idle; }
+    uint32_t pending() const { return csr.mip | (time() >= mtimecmp ? MIP_MTIP : 0); }
+
+    // what devices do to the hart, each stops the engines so that an
+    // interrupt they enable is taken before the next instruction
+    void raise(uint32_t bits);
+    void lower(uint32_t bits);
+    void set_timer(uint64_t compare);
+
+    // only after restoring the state behind them
+    void reschedule();
+
+    // step() for the engines, an exception with no handler to take it only
+    // halts the guest, and run() throws it once the engine returned
+    void advance();
+    void invalidate(uint32_t address);
+    void invalidate_page(uint32_t address);
+
+    // drops every decoded instruction, nothing fetch returned may be held
+    void forget_decoded();
+    const Decoded& fetch(uint32_t address);
+
+    // decoded in place of the instruction, so they cost nothing elsewhere
+    // and every engine stops in front of them
+    void set_breakpoint(uint32_t address, bool enabled);
+    bool has_breakpoint(uint32_t address) const { return !breakpoints.empty() && breakpoints.count(address) != 0; }
 
 private:
 
-    uint8_t func7;
-    uint8_t func3;
-    uint8_t dest;
-    uint8_t src1;
-    uint8_t src2;
-    uint32_t imm;
+    // a pointer per page of the address space, set for the pages code ran
+    // from, decoded_pages owns what they point to
+    Ram decoded;
+    std::vector<std::unique_ptr<DecodedPage>> decoded_pages;
+
+    DecodedPage*& decoded_page(uint32_t index) { return ((DecodedPage**)decoded.data())[index]; }
+    std::unique_ptr<Jit> jit;
+    std::unordered_set<uint32_t> breakpoints;
 
-    void decode_R_type(uint32_t inst);
-    void decode_I_type(uint32_t inst);
-    void decode_S_type(uint32_t inst);
-    void decode_B_type(uint32_t inst);
-    void decode_U_type(uint32_t inst);
-    void decode_J_type(uint32_t inst);
-
-    void lui(uint32_t inst);
-    void auipc(uint32_t inst);
-    void jal(uint32_t inst);
-    void jalr(uint32_t inst);
-    void branch(uint32_t inst);
-    void load(uint32_t inst);
-    void store(uint32_t inst);
-    void alu(uint32_t inst, bool immediate);
-
-    std::string disassemble_alu(uint32_t inst, bool immediate);
+    // the time from which an enabled interrupt is due, run() ends its
+    // slices there
+    uint64_t event = UINT64_MAX;
+
+    // the exception that halted the guest for want of a handler
+    bool faulted = false;
+    uint32_t fault_cause = 0;
+    uint32_t fault_address = 0;
+
+    void run_engine(uint64_t count);
+    void interrupt();
+    void exception(uint32_t cause, uint32_t value);
+    void bus_fault();
+    [[noreturn]] void throw_fault();
+    void trap(uint32_t cause, uint32_t value);
+    uint32_t read_csr(uint32_t number);
+    void write_csr(uint32_t number, uint32_t value);
+
+    Decoded decode(uint32_t inst);
+    void instrumented(const Decoded& d);
+
+    void lui(const Decoded& d);
+    void auipc(const Decoded& d);
+    void jal(const Decoded& d);
+    void jalr(const Decoded& d);
+    void branch(const Decoded& d);
+    void load(const Decoded& d);
+    void store(const Decoded& d);
+    void alu_imm(const Decoded& d);
+    void alu_reg(const Decoded& d);
+    void alu(const Decoded& d, uint32_t value);
+    void muldiv(const Decoded& d);
+    void system(const Decoded& d);
+    void access_csr(const Decoded& d);
+    void fence(const Decoded& d);
+    void illegal(const Decoded& d);
+    void breakpoint(const Decoded& d);
 };
 
+// whether an instruction may read the CSR, and write it when write is set
+bool csr_allowed(uint32_t number, bool write);
+
+// 2 for compressed instructions, 4 for everything else
+inline uint32_t inst_size(uint32_t inst)
+{
+    return (inst & 3) == 3 ? 4 : 2;
+}
+
+// the fields of a 32-bit instruction as its format lays them out, shift
+// immediates split into func7 and the amount, false if it is illegal here;
+// leaves the handler, op and size alone
+bool decode_fields(uint32_t inst, Decoded& d);
+
+// the 32-bit equivalent of a compressed instruction, 0 when it has none,
+// anything else is returned as it is
+uint32_t expand_compressed(uint32_t inst);
+
+// the register a 32-bit instruction writes its result to: rd, except for
+// ecall, which returns its result in a0
+uint32_t result_register(uint32_t inst);
+
+uint32_t bit_cut(uint32_t value, int a, int b, bool sign = false);
+
+// RV32M division never traps: dividing by zero gives all ones and leaves
+// the dividend as the remainder, INT_MIN / -1 wraps to INT_MIN with no
+// remainder
+inline uint32_t div_signed(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+        return 0xffffffff;
+
+    if (b == 0xffffffff)
+        return -a;
+
+    return (int32_t)a / (int32_t)b;
+}
+
+inline uint32_t div_unsigned(uint32_t a, uint32_t b)
+{
+    return b == 0 ? 0xffffffff : a / b;
+}
+
+inline uint32_t rem_signed(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+        return a;
+
+    if (b == 0xffffffff)
+        return 0;
+
+    return (int32_t)a % (int32_t)b;
+}
+
+inline uint32_t rem_unsigned(uint32_t a, uint32_t b)
+{
+    return b == 0 ? a : a % b;
+}
+
 extern const char* reg_name[];
+extern const char* engine_name[];
+
+bool parse_engine(const char* name, Engine& engine);
+
+uint64_t run_threaded(CPU& cpu, uint64_t count);
 
 std::string fmt(const char* fmt, ...);
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// room for any line disassemble writes, its label included
+#define DISASSEMBLY_SIZE    96
+
+// bytes of a listing each thread decodes and formats at a time
+#define DISASSEMBLY_CHUNK   0x10000
+
+struct SymbolTable;
+
+// Writes the text of one instruction to text, at most size bytes with the
+// terminator, and returns its length. Everything is decoded into locals and
+// written in place, so any thread can call it at any time without touching
+// a CPU or the heap. Jumps and branches at address get the label of their
+// target from symbols, if any.
+size_t disassemble(uint32_t inst, char* text, size_t size, uint32_t address = 0, const SymbolTable* symbols = nullptr);
+
+// One line per instruction from begin to end of memory, which holds the
+// whole address space: the address, the encoding and the text. Symbols and
+// the targets of jumps and branches in the range start a line of their own,
+// and the jumps name the label they go to. Large ranges are listed a chunk
+// per task on threads threads, 0 for one per core.
+std::string disassemble_range(const uint8_t* memory, uint32_t begin, uint32_t end, const SymbolTable* symbols, int threads = 0);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <disassembler.h>
+#include <gdb.h>
+#include <history.h>
+#include <lockfree.h>
+#include <machine.h>
+#include <profiler.h>
+#include <scheduler.h>
+#include <atomic>
+#include <thread>
+
+#define COMMAND_QUEUE       256
+#define SNAPSHOT_CODE       5
+#define SNAPSHOT_MEMORY     1024
+
+// milliseconds a paused frame waits on gdb, so packets are not a frame apart
+#define GDB_WAIT            5
+
+enum CommandType : uint8_t
+{
+    COMMAND_KEYBOARD,
+    COMMAND_TOGGLE_RUN,
+    COMMAND_TOGGLE_REVERSE,
+    COMMAND_STEP,
+    COMMAND_STEP_BACK,
+    COMMAND_RESET,
+    COMMAND_SAVE,
+    COMMAND_LOAD,
+    COMMAND_PROFILE,
+};
+
+// sent from the UI, a keyboard command carries the axis and its new value
+struct Command
+{
+    CommandType type;
+    uint8_t axis;
+    int8_t value;
+};
+
+// everything the UI draws, copied out by the CPU thread
+struct Snapshot
+{
+    uint64_t sequence = 0;
+
+    uint32_t x[32] = {};
+    uint32_t pc = 0;
+    int dirty = -1;
+    bool running = false;
+    double mips = 0;
+    uint64_t history = 0;
+
+    // disassembly from pc - 8 to pc + 8, empty outside memory
+    char code[SNAPSHOT_CODE][DISASSEMBLY_SIZE];
+    std::string function;
+
+    uint32_t memory_view = 0;
+    uint32_t memory_length = 0;
+    uint8_t memory[SNAPSHOT_MEMORY];
+    std::string memory_labels[SNAPSHOT_MEMORY / 16];
+
+    // per word of the memory view and per line of code, while profiling
+    bool profiling = false;
+    uint8_t heat[SNAPSHOT_MEMORY / 4];
+    uint8_t code_heat[SNAPSHOT_CODE];
+    uint64_t code_hits[SNAPSHOT_CODE];
+
+    // rows stored to since the previous snapshot, none when first > last
+    std::vector<uint8_t> screen;
+    uint32_t screen_first = 1;
+    uint32_t screen_last = 0;
+};
+
+// Runs the machine on its own thread, paced by the scheduler. The UI talks
+// to it only through the command queue, the memory view offset and the
+// published snapshots, so neither thread ever blocks the other.
+struct Emulator
+{
+    Machine& machine;
+    Scheduler& scheduler;
+
+    SpscQueue<Command, COMMAND_QUEUE> commands;
+    TripleBuffer<Snapshot> snapshots;
+    std::atomic<uint32_t> memory_view{ 0 };
+
+    // recorded while stepping or running forwards, disabled at capacity 0
+    History history{ HISTORY_DEFAULT };
+
+    // attached to the CPU while profiling is switched on
+    Profiler profiler;
+
+    // where the quick state is saved to and read from at start, if set
+    std::string state_path;
+
+    // where start waits for gdb to connect, if set
+    std::string gdb_address;
+
+    Emulator(Machine& _machine, Scheduler& _scheduler) : machine(_machine), scheduler(_scheduler) {}
+    ~Emulator();
+
+    void start();
+    void stop();
+
+private:
+
+    std::thread thread;
+    std::atomic<bool> quit{ false };
+    // 1 running forwards, -1 backwards, 0 paused
+    int direction = 0;
+    uint64_t sequence = 0;
+
+    // the screen as the guest last presented it, and which frame that was
+    std::vector<uint8_t> frame;
+    uint64_t shown = UINT64_MAX;
+
+    // taken at start, reset returns memory to it as well as the registers
+    SaveState boot;
+    SaveState quick;
+
+    std::unique_ptr<GdbStub> gdb;
+
+    void loop();
+    void execute(const Command& command);
+    void publish();
+    void poll_gdb();
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <bus.h>
+
+// A grey level byte per pixel, stored in guest RAM. Rows are found dirty
+// through the lines the bus marks on every store, so the host only uploads
+// what changed.
+struct Framebuffer
+{
+    uint32_t width;
+    uint32_t height;
+    const uint8_t* pixels = nullptr;
+
+    Framebuffer(uint32_t _width, uint32_t _height) : width(_width), height(_height) {}
+
+    uint32_t size() const { return width * height; }
+
+    void attach(Bus& bus, uint32_t address);
+    void mark_all() { all = true; }
+    bool take_dirty(uint32_t& first, uint32_t& last);
+
+private:
+
+    uint8_t* lines = nullptr;
+    bool all = true;
+};
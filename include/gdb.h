@@ -0,0 +1,87 @@
+#pragma once
+
+#include <history.h>
+#include <machine.h>
+#include <map>
+#include <string>
+
+#define GDB_PACKET_SIZE     0x4000
+#define GDB_SIGINT          2
+#define GDB_SIGILL          4
+#define GDB_SIGTRAP         5
+#define GDB_SIGBUS          7
+#define GDB_SIGSEGV         11
+
+// breakpoint kinds, gdb can ask for both at one address
+#define GDB_SOFTWARE        1
+#define GDB_HARDWARE        2
+
+// A GDB remote serial protocol target for one connection over TCP or a Unix
+// socket. The guest keeps its engine while gdb has it running, breakpoints
+// are decoded into the instruction stream and watchpoints mark their pages
+// for the bus slow path, so neither costs anything anywhere else. With a
+// history attached gdb can also step and continue backwards.
+struct GdbStub
+{
+    Machine& machine;
+    History* history = nullptr;
+
+    // gdb resumed the guest and waits for stopped() or fault()
+    bool running = false;
+
+    // gdb asked to kill the guest before it went away
+    bool killed = false;
+
+    GdbStub(Machine& _machine);
+    GdbStub(const GdbStub&) = delete;
+    GdbStub& operator=(const GdbStub&) = delete;
+    ~GdbStub();
+
+    // PORT, HOST:PORT or the path of a Unix socket, waits for gdb to connect
+    bool open(const char* address);
+    bool connected() const { return fd >= 0; }
+
+    // handles what gdb sends until nothing arrives for timeout milliseconds,
+    // -1 for as long as the guest is stopped, false once gdb is gone
+    bool poll(int timeout);
+
+    // the guest stopped while running, for a breakpoint, a watchpoint, its
+    // exit or anything else, which gdb sees as an interrupt
+    void stopped();
+    void fault(const std::exception& e);
+
+    // clears a trap and runs the instruction at pc with any breakpoint on it
+    // lifted, throws whatever the guest faults with
+    void step_over();
+
+private:
+
+    int fd = -1;
+    bool ack = true;
+    std::string input;
+    std::string sent;
+    std::string stop_reply;
+
+    std::map<uint32_t, uint8_t> breakpoints;
+
+    // the watchpoint that halted the guest and the address it was hit at
+    bool watch_hit = false;
+    Watchpoint watch = {};
+    uint32_t watch_address = 0;
+
+    void close();
+    void detach();
+    void transmit(const std::string& bytes);
+    void send(const std::string& packet);
+    void report(const std::string& reply);
+    void stop(int signal);
+    void handle(const std::string& packet);
+    void resume(bool step);
+    void reverse(bool step);
+    std::string breakpoint(const std::string& packet, bool insert);
+
+    std::string read_registers();
+    std::string read_memory(uint32_t address, uint32_t length);
+    bool write_memory(uint32_t address, const std::string& hex);
+    std::string read_features(const std::string& annex, uint32_t offset, uint32_t length);
+};
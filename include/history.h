@@ -0,0 +1,59 @@
+#pragma once
+
+#include <machine.h>
+#include <deque>
+
+#define HISTORY_DEFAULT     (1 << 22)
+#define HISTORY_CHECKPOINT  (1 << 16)
+#define HISTORY_STORE       1
+
+// One per retired instruction: the register it overwrote and its old value,
+// or for a store the old contents of the aligned word it hit. Bit 0 of pc
+// tells the two apart.
+struct JournalEntry
+{
+    uint32_t pc;
+    uint32_t where;
+    uint32_t old;
+};
+
+struct Checkpoint
+{
+    uint64_t time;
+    SaveState state;
+};
+
+// Records the instructions a machine retires in a bounded ring buffer, so
+// it can be stepped backwards one entry at a time. Save states taken every
+// HISTORY_CHECKPOINT instructions bound the cost of going back far. Device
+// state, such as the keyboard or the random register, is not rewound, and
+// neither are the CSRs or time spent waiting unless a checkpoint restores
+// them, so going back over an interrupt leaves it taken.
+struct History
+{
+    History(uint32_t _capacity) : capacity(_capacity) {}
+
+    bool enabled() const { return capacity != 0; }
+    uint64_t available() const { return count; }
+
+    void clear();
+
+    // the interpreter, journaling as it goes, run() also takes interrupts
+    // and waits like CPU::run()
+    void step(Machine& machine);
+    uint64_t run(Machine& machine, uint64_t count);
+
+    // returns how far it went, less than count at the start of history
+    uint64_t back(Machine& machine, uint64_t count);
+
+private:
+
+    uint32_t capacity;
+    std::vector<JournalEntry> journal;
+    uint32_t head = 0;
+    uint64_t count = 0;
+    uint64_t time = 0;
+    std::deque<Checkpoint> checkpoints;
+
+    void undo(Machine& machine);
+};
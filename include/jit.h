@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cpu.h>
+#include <unordered_map>
+
+#define JIT_CODE_SIZE       (16 << 20)
+#define JIT_CODE_SLACK      (64 << 10)
+#define JIT_MAX_BLOCK       64
+#define JIT_MAP_SHIFT       1
+
+// state shared with generated code, offsets are baked into the trampoline
+struct JitContext
+{
+    uint32_t* x;
+    uint8_t* memory;
+    uint8_t* code_map;
+    const uint8_t* pages;
+    int64_t budget;
+    uint8_t* patch;
+    uint32_t pc;
+    uint32_t store;
+    uint8_t flush;
+    uint8_t step;
+    uint8_t check;
+    CPU* cpu;
+};
+
+struct Block
+{
+    uint8_t* entry;
+    uint32_t length;
+};
+
+// a guarded access whose stub is emitted after the block, the stub returns
+// to resume once a device has handled it
+struct SlowPath
+{
+    uint8_t* sites[2];
+    uint32_t index;
+    uint32_t pc;
+    uint8_t size;
+    uint8_t op;
+    uint8_t dest;
+    uint8_t src2;
+    uint8_t* resume;
+};
+
+struct Jit
+{
+    CPU& cpu;
+
+    Jit(CPU& _cpu);
+    ~Jit();
+
+    uint64_t run(uint64_t count);
+    void invalidate(uint32_t address);
+    void invalidate_page(uint32_t address);
+
+    // the CPU decoded the instruction at address
+    void decoded(uint32_t address);
+
+private:
+
+    JitContext ctx;
+
+    uint8_t* code;
+    size_t code_used;
+    size_t code_start;
+    uint8_t* exit;
+    void (*enter)(JitContext*, uint8_t*);
+
+    // one byte per guest halfword, set where translated or decoded code
+    // lives, the decoded instructions are dropped with it to keep it so
+    Ram code_map;
+    std::unordered_map<uint32_t, Block> blocks;
+    uint64_t generation = 0;
+    std::vector<SlowPath> slow_paths;
+
+    const Block* lookup(uint32_t pc);
+    const Block* translate(uint32_t pc);
+    void flush();
+    void patch(uint8_t* site, uint8_t* target);
+
+    void emit_trampoline();
+    void emit_instruction(const Decoded& d, uint32_t pc, uint32_t index, uint32_t length);
+    void emit_chain(uint32_t target);
+    void emit_guard(const Decoded& d, uint8_t size, uint32_t pc, uint32_t index);
+    void emit_slow_paths(uint32_t length);
+    void emit_muldiv(uint8_t op);
+
+    void emit(std::initializer_list<uint8_t> bytes);
+    void emit32(uint32_t value);
+    void emit64(uint64_t value);
+    void emit_rel32(uint8_t* target);
+    void load_reg(int host, int reg);
+    void store_reg(int host, int reg);
+};
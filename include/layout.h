@@ -0,0 +1,19 @@
+#pragma once
+
+#define MEMORY_SIZE         0x100000
+#define MEMORY_MIN          0x20000
+#define MEMORY_MAX          0x100000000
+#define SCREEN_ADDRESS      0x10000
+#define IO_ADDRESS          0x09000
+#define KEYBOARD_ADDRESS    0x09000
+#define RANDOM_ADDRESS      0x09002
+#define EXIT_ADDRESS        0x09004
+#define PRESENT_ADDRESS     0x09008
+#define STACK_POINTER       0x20000
+#define CLINT_ADDRESS       0x2000000
+#define CLINT_SIZE          0x10000
+#define CLINT_MSIP          0x0000
+#define CLINT_MTIMECMP      0x4000
+#define CLINT_MTIME         0xbff8
+#define FB_WIDTH            32
+#define FB_HEIGHT           16
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <ram.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Symbol
+{
+    uint32_t address;
+    uint32_t size;
+    std::string name;
+};
+
+// sorted by address
+struct SymbolTable
+{
+    std::vector<Symbol> symbols;
+
+    // the closest symbol at or before address, null past its known size
+    const Symbol* find(uint32_t address) const;
+    const Symbol* find(const std::string& name) const;
+
+    // the first symbol in [first, last)
+    const Symbol* first_in(uint32_t first, uint32_t last) const;
+
+    // name or name+offset, empty without a symbol
+    std::string label(uint32_t address) const;
+};
+
+// a range of memory the loader filled from the file
+struct Segment
+{
+    uint32_t address;
+    uint32_t size;
+};
+
+struct Program
+{
+    uint32_t entry = 0;
+
+    // everything outside them is still zero
+    std::vector<Segment> segments;
+
+    // past the last byte any segment takes up, BSS included
+    uint32_t end = 0;
+
+    // taken from __stack_top and __global_pointer$ when the file has them
+    uint32_t stack_pointer = 0;
+    uint32_t global_pointer = 0;
+
+    SymbolTable symbols;
+};
+
+bool load_binary(const char* path, uint8_t* memory, uint32_t memory_size);
+
+// ELF32 RISC-V executables by their segments, anything else as a raw binary
+// at address 0
+bool load_program(const char* path, Ram& ram, Program& program);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define TRIPLE_FRESH        4
+
+// Ring buffer for exactly one producer and one consumer thread, N has to
+// be a power of two.
+template<typename T, size_t N>
+struct SpscQueue
+{
+    bool push(const T& item)
+    {
+        size_t index = tail.load(std::memory_order_relaxed);
+
+        if (index - head.load(std::memory_order_acquire) == N)
+            return false;
+
+        items[index & (N - 1)] = item;
+        tail.store(index + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        size_t index = head.load(std::memory_order_relaxed);
+
+        if (index == tail.load(std::memory_order_acquire))
+            return false;
+
+        item = items[index & (N - 1)];
+        head.store(index + 1, std::memory_order_release);
+
+        return true;
+    }
+
+private:
+
+    T items[N];
+    alignas(64) std::atomic<size_t> head{ 0 };
+    alignas(64) std::atomic<size_t> tail{ 0 };
+};
+
+// The writer fills back() and publishes it, the reader picks up the newest
+// published buffer. Neither side ever waits for the other; buffers the
+// reader was too slow for are skipped.
+template<typename T>
+struct TripleBuffer
+{
+    T& back() { return buffers[back_index]; }
+    const T& front() const { return buffers[front_index]; }
+
+    void publish()
+    {
+        back_index = middle.exchange(back_index | TRIPLE_FRESH, std::memory_order_acq_rel) & ~TRIPLE_FRESH;
+    }
+
+    // false when nothing was published since the last call
+    bool acquire()
+    {
+        if ((middle.load(std::memory_order_relaxed) & TRIPLE_FRESH) == 0)
+            return false;
+
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & ~TRIPLE_FRESH;
+
+        return true;
+    }
+
+private:
+
+    T buffers[3];
+    uint8_t back_index = 0;
+    std::atomic<uint8_t> middle{ 1 };
+    uint8_t front_index = 2;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cpu.h>
+#include <framebuffer.h>
+#include <layout.h>
+#include <loader.h>
+#include <profiler.h>
+#include <savestate.h>
+#include <syscalls.h>
+#include <trace.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#define MACHINE_SLICE       (1 << 16)
+
+// keyboard state the guest sees from the given tick of guest time onwards
+struct InputEvent
+{
+    uint64_t at;
+    int8_t vertical;
+    int8_t horizontal;
+};
+
+struct Job
+{
+    std::string path;
+    Engine engine = ENGINE_INTERPRETER;
+    uint64_t memory_size = MEMORY_SIZE;
+    uint32_t seed = 1;
+    std::vector<InputEvent> input;
+    uint64_t max_instructions = 0;
+    double timeout = 0;
+
+    // started from instead of a fresh reset, the seed still applies
+    std::shared_ptr<const SaveState> state;
+
+    // every instruction is written there, which runs the interpreter
+    std::string trace;
+
+    // written as PREFIX.csv, PREFIX.mix.csv and PREFIX.folded, also interpreted
+    std::string profile;
+
+    // the directory the guest can open files in, none if empty
+    std::string sandbox;
+
+    // waits there for gdb, which runs the guest until it detaches, input,
+    // limits and the timeout only apply afterwards
+    std::string gdb;
+};
+
+struct JobResult
+{
+    const char* reason = nullptr;
+    uint32_t exit_code = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+    std::string error;
+};
+
+// RAM plus the keyboard, random, exit and present registers in the IO page,
+// the screen at SCREEN_ADDRESS, the timer at CLINT_ADDRESS and the system
+// calls behind ecall. A change of keyboard raises the external interrupt,
+// reading the keyboard clears it.
+struct Machine
+{
+    Ram memory;
+    CPU cpu;
+    Program program;
+    Framebuffer screen;
+    Syscalls syscalls;
+
+    int8_t keyboard[2] = { 0, 0 };
+    std::minstd_rand random;
+    bool tohost = false;
+
+    // frames the guest finished by writing the present register, with vsync
+    // each one also pauses the CPU so the host can show it
+    uint64_t frames = 0;
+    bool vsync = false;
+
+    Machine(uint64_t memory_size = MEMORY_SIZE);
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    bool load(const char* path);
+    void reset();
+    bool set_screen(uint32_t width, uint32_t height);
+    void set_keyboard(int8_t vertical, int8_t horizontal);
+
+    // before loading, throws away whatever memory held
+    bool set_memory(uint64_t size);
+
+    SaveState save();
+    void restore(const SaveState& state);
+
+private:
+
+    // memory as of the last save or restore, pages stored to since then are
+    // the bus's changed pages and present pages the table lacks are zero
+    std::shared_ptr<const PageTable> pages;
+
+    bool io_read(uint32_t offset, uint32_t size, uint32_t& value);
+    bool io_write(uint32_t offset, uint32_t size, uint32_t value);
+    bool clint_read(uint32_t offset, uint32_t size, uint32_t& value);
+    bool clint_write(uint32_t offset, uint32_t size, uint32_t value);
+};
+
+JobResult run_job(const Job& job);
+bool load_input(const char* path, std::vector<InputEvent>& input);
+
+// a size in bytes with an optional K, M or G suffix, whole pages from
+// MEMORY_MIN up to the 4 GiB address space
+bool parse_memory_size(const char* text, uint64_t& size);
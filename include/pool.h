@@ -0,0 +1,6 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+void parallel_for(size_t count, int threads, const std::function<void(size_t)>& task);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <bus.h>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct CPU;
+
+enum ProfileClass : uint8_t
+{
+    CLASS_LUI,
+    CLASS_AUIPC,
+    CLASS_JAL,
+    CLASS_JALR,
+    CLASS_BRANCH,
+    CLASS_LOAD,
+    CLASS_STORE,
+    CLASS_ALU_IMM,
+    CLASS_ALU,
+    CLASS_MULDIV,
+    CLASS_SYSTEM,
+    CLASS_OTHER,
+    CLASS_COUNT
+};
+
+// one node per distinct call stack, children are found by parent and callee
+struct StackNode
+{
+    uint32_t parent;
+    uint32_t function;
+    uint64_t samples;
+};
+
+// counters of the instructions on one page, one per halfword
+struct ProfilePage
+{
+    uint64_t hits[PAGE_SIZE / 2] = {};
+    uint64_t blocks[PAGE_SIZE / 2] = {};
+    uint64_t taken[PAGE_SIZE / 2] = {};
+};
+
+// Counts executions per instruction halfword, entries into basic blocks, taken
+// branches, the mix of instruction classes and instructions per call stack.
+// Counters only exist for pages code ran from. It is fed from the
+// interpreter, the other engines never see it.
+struct Profiler
+{
+    uint64_t classes[CLASS_COUNT] = {};
+    uint64_t max_hits = 0;
+
+    Profiler();
+
+    void clear();
+    void record(uint32_t pc, uint32_t inst, uint32_t next);
+
+    // executions of the instruction at address
+    uint64_t count(uint32_t address) const;
+
+    // 0 to 255 on a log scale up to the hottest instruction
+    uint8_t heat(uint32_t address) const;
+
+    // prefix.csv per instruction, prefix.mix.csv and prefix.folded
+    bool write(const std::string& prefix, CPU& cpu) const;
+    bool write_csv(const char* path, CPU& cpu) const;
+    bool write_mix(const char* path) const;
+    bool write_folded(const char* path) const;
+
+private:
+
+    std::map<uint32_t, ProfilePage> pages;
+
+    // the page of the previous instruction, usually that of the next one
+    ProfilePage* last = nullptr;
+    uint32_t last_page = 0;
+
+    uint32_t expected = 0;
+    bool transfer = true;
+
+    std::vector<StackNode> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;
+    uint32_t stack = 0;
+
+    void call(uint32_t target);
+};
+
+extern const char* class_name[];
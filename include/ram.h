@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+// A private anonymous mapping that is only reserved up front, the host backs
+// a page with memory the first time it is touched. It holds guest RAM, into
+// which whole pages of a file can be mapped copy-on-write instead of being
+// read, and the tables that grow with the guest address space.
+struct Ram
+{
+    Ram(uint64_t _size);
+    Ram(const Ram&) = delete;
+    Ram& operator=(const Ram&) = delete;
+    ~Ram();
+
+    uint8_t* data() const { return base; }
+    uint64_t size() const { return length; }
+    uint8_t& operator[](uint64_t address) { return base[address]; }
+    const uint8_t& operator[](uint64_t address) const { return base[address]; }
+
+    // back to all zero, dropping any mapped file pages
+    void clear();
+
+    // a new all zero mapping of another size, data() changes
+    void resize(uint64_t _size);
+
+    // page-aligned address, offset and length only
+    bool map_file(uint32_t address, int fd, uint64_t offset, uint32_t size);
+
+private:
+
+    uint8_t* base;
+    uint64_t length;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <bus.h>
+#include <cpu.h>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#define STATE_MAGIC         0x53535652
+#define STATE_VERSION       4
+
+// a page table has directories of leaves of pages
+#define PAGE_LEAF_SHIFT         6
+#define PAGE_LEAF_SIZE          (1 << PAGE_LEAF_SHIFT)
+#define PAGE_DIRECTORY_SHIFT    7
+#define PAGE_DIRECTORY_SIZE     (1 << PAGE_DIRECTORY_SHIFT)
+#define PAGE_DIRECTORIES        (BUS_PAGES >> (PAGE_DIRECTORY_SHIFT + PAGE_LEAF_SHIFT))
+
+typedef std::array<uint8_t, PAGE_SIZE> Page;
+typedef std::array<std::shared_ptr<const Page>, PAGE_LEAF_SIZE> PageLeaf;
+typedef std::array<std::shared_ptr<const PageLeaf>, PAGE_DIRECTORY_SIZE> PageDirectory;
+typedef std::vector<std::pair<uint32_t, std::shared_ptr<const Page>>> PageChanges;
+
+// The pages of an address space by number, in three levels. Tables never
+// change once made and share every directory and leaf the changes that made
+// them did not touch, so one with a few pages replaced costs those pages
+// and the few hundred pointers above them, whatever the size of the
+// address space.
+struct PageTable
+{
+    std::array<std::shared_ptr<const PageDirectory>, PAGE_DIRECTORIES> directories;
+
+    // null for a page the table does not have
+    const std::shared_ptr<const Page>& find(uint32_t index) const;
+
+    std::shared_ptr<const PageTable> update(PageChanges changes) const;
+
+    // the pages it has, in order
+    template<typename F> void each(F visit) const
+    {
+        for (uint32_t i = 0; i < PAGE_DIRECTORIES; i++)
+        {
+            for (uint32_t j = 0; directories[i] != nullptr && j < PAGE_DIRECTORY_SIZE; j++)
+            {
+                const std::shared_ptr<const PageLeaf>& leaf = (*directories[i])[j];
+
+                for (uint32_t k = 0; leaf != nullptr && k < PAGE_LEAF_SIZE; k++)
+                {
+                    if ((*leaf)[k] != nullptr)
+                        visit(((i << PAGE_DIRECTORY_SHIFT | j) << PAGE_LEAF_SHIFT) | k, (*leaf)[k]);
+                }
+            }
+        }
+    }
+
+    // the pages other has something else for, skipping what both share
+    template<typename F> void differences(const PageTable& other, F visit) const
+    {
+        for (uint32_t i = 0; i < PAGE_DIRECTORIES; i++)
+        {
+            if (directories[i] == other.directories[i])
+                continue;
+
+            for (uint32_t j = 0; j < PAGE_DIRECTORY_SIZE; j++)
+            {
+                const PageLeaf* mine = directories[i] != nullptr ? (*directories[i])[j].get() : nullptr;
+                const PageLeaf* theirs = other.directories[i] != nullptr ? (*other.directories[i])[j].get() : nullptr;
+
+                if (mine == theirs)
+                    continue;
+
+                uint32_t first = (i << PAGE_DIRECTORY_SHIFT | j) << PAGE_LEAF_SHIFT;
+
+                for (uint32_t k = first; k < first + PAGE_LEAF_SIZE; k++)
+                {
+                    if (find(k) != other.find(k))
+                        visit(k);
+                }
+            }
+        }
+    }
+};
+
+// A machine frozen in time. Pages are immutable and shared, both between
+// states and with the machine that took them, and so is the table of them,
+// so a state only owns copies of the pages that changed since the one
+// before it. Only pages the guest had used are kept, any other page of the
+// address space is zero.
+struct SaveState
+{
+    uint32_t x[32] = {};
+    uint32_t pc = 0;
+    bool halted = false;
+    bool trapped = false;
+    uint32_t exit_code = 0;
+
+    Csrs csr;
+    uint64_t instret = 0;
+    uint64_t idle = 0;
+    uint64_t mtimecmp = UINT64_MAX;
+    bool waiting = false;
+
+    int8_t keyboard[2] = { 0, 0 };
+    uint32_t random = 1;
+    bool tohost = false;
+
+    // the program break, files the guest opened are not part of a state
+    uint32_t brk = 0;
+
+    // pages in the address space it was taken from, and the used ones by number
+    uint32_t page_count = 0;
+    std::shared_ptr<const PageTable> pages;
+
+    bool empty() const { return page_count == 0; }
+};
+
+// shared by every page that is all zero
+const std::shared_ptr<const Page>& zero_page();
+
+// only pages that are not all zero end up on disk
+bool write_state(const char* path, const SaveState& state);
+bool read_state(const char* path, SaveState& state);
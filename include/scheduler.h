@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cpu.h>
+#include <chrono>
+#include <functional>
+
+#define FRAME_RATE          60
+#define DEFAULT_IPS         1000
+#define FAST_SLICE          4096
+#define MAX_BACKLOG         0.25
+
+struct Scheduler
+{
+    uint64_t ips;
+
+    uint64_t retired = 0;
+    double mips = 0;
+
+    Scheduler(uint64_t _ips) : ips(_ips) {}
+
+    void start();
+    void run_frame(CPU& cpu);
+
+    // run returns how many instructions it got through, fewer means stop
+    void run_frame(const std::function<uint64_t(uint64_t)>& run);
+    void wait_frame();
+
+private:
+
+    using clock = std::chrono::steady_clock;
+
+    clock::time_point frame_start;
+    clock::time_point run_end;
+    clock::time_point presented;
+    clock::time_point window_start;
+
+    double owed = 0;
+    uint64_t window_retired = 0;
+
+    void update_mips(clock::time_point now);
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Linux system call numbers, which newlib's libgloss uses on RISC-V as well,
+// exit is SYSCALL_EXIT in cpu.h since the CPU handles it on its own
+#define SYSCALL_OPENAT          56
+#define SYSCALL_CLOSE           57
+#define SYSCALL_LSEEK           62
+#define SYSCALL_READ            63
+#define SYSCALL_WRITE           64
+#define SYSCALL_FSTAT           80
+#define SYSCALL_EXIT_GROUP      94
+#define SYSCALL_CLOCK_GETTIME   113
+#define SYSCALL_GETTIMEOFDAY    169
+#define SYSCALL_BRK             214
+#define SYSCALL_CLOCK_GETTIME64 403
+#define SYSCALL_OPEN            1024
+
+// open flags as newlib numbers them, openat takes the Linux ones
+#define NEWLIB_O_ACCMODE        0x0003
+#define NEWLIB_O_APPEND         0x0008
+#define NEWLIB_O_CREAT          0x0200
+#define NEWLIB_O_TRUNC          0x0400
+#define NEWLIB_O_EXCL           0x0800
+
+#define SYSCALL_FILES           64
+#define SYSCALL_PATH            4096
+
+// the RISC-V struct stat, of which only a few fields are filled in
+#define GUEST_STAT_SIZE         128
+#define GUEST_STAT_MODE         16
+#define GUEST_STAT_NLINK        20
+#define GUEST_STAT_SIZE_FIELD   48
+#define GUEST_STAT_BLKSIZE      56
+
+struct CPU;
+
+// The system calls behind ecall: a7 is the number, a0 to a5 the arguments
+// and a0 the result, a negative errno on failure. Reads and writes go
+// straight between guest RAM and the host file in one call. The guest's
+// stdin, stdout and stderr are the host's, any other file it opens has to
+// be inside the sandbox directory.
+struct Syscalls
+{
+    // nothing can be opened while it is empty
+    std::string sandbox;
+
+    // where the heap starts and how far brk has moved it
+    uint32_t heap = 0;
+    uint32_t brk = 0;
+
+    Syscalls();
+    Syscalls(const Syscalls&) = delete;
+    Syscalls& operator=(const Syscalls&) = delete;
+    ~Syscalls();
+
+    void call(CPU& cpu);
+
+    // the break back at the heap and every file the guest opened closed
+    void reset();
+
+private:
+
+    // host descriptor for each guest one, -1 where it is closed
+    std::vector<int> files;
+    int root = -1;
+
+    int32_t open(CPU& cpu, uint32_t path, uint32_t flags, uint32_t mode);
+    int32_t close(uint32_t fd);
+    int32_t read(CPU& cpu, uint32_t fd, uint32_t address, uint32_t length);
+    int32_t write(CPU& cpu, uint32_t fd, uint32_t address, uint32_t length);
+    int32_t lseek(uint32_t fd, int32_t offset, uint32_t whence);
+    int32_t fstat(CPU& cpu, uint32_t fd, uint32_t address);
+    int32_t clock_gettime(CPU& cpu, uint32_t clock, uint32_t address);
+    int32_t gettimeofday(CPU& cpu, uint32_t address);
+    uint32_t set_brk(CPU& cpu, uint32_t address);
+
+    int host_file(uint32_t fd) const;
+};
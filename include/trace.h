@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TRACE_MAGIC         0x43525452
+#define TRACE_VERSION       3
+#define TRACE_CHUNK         4096
+#define TRACE_CHUNKS        8
+#define TRACE_CACHE         4096
+
+// record flags, also the low bits of every encoded record
+#define TRACE_VALUE         0x01
+#define TRACE_MEMORY        0x02
+#define TRACE_JUMP          0x04
+#define TRACE_NEW           0x08
+
+// value is what the instruction wrote to register dest, data what a store
+// wrote to address
+struct TraceRecord
+{
+    uint32_t pc;
+    uint32_t inst;
+    uint32_t value;
+    uint32_t address;
+    uint32_t data;
+    uint8_t flags;
+    uint8_t dest;
+};
+
+// State both ends of the encoding keep in step. Every field of a record
+// is stored as a difference to what the previous records predict: pc to
+// the next instruction, a register value to the register's previous value,
+// an address to the previous address. The instruction is only stored, in
+// two bytes when compressed, when the direct-mapped cache of recent ones
+// misses.
+struct TraceModel
+{
+    uint32_t pc = 0;
+    uint32_t x[32] = {};
+    uint32_t address = 0;
+    uint32_t cache_pc[TRACE_CACHE] = {};
+    uint32_t cache_inst[TRACE_CACHE] = {};
+
+    void encode(const TraceRecord& record, std::vector<uint8_t>& out);
+    bool decode(FILE* file, TraceRecord& record);
+};
+
+// The CPU thread fills fixed-size chunks of raw records, a background thread
+// encodes and writes them. At most TRACE_CHUNKS chunks are in flight, after
+// that the CPU waits for the writer.
+struct TraceWriter
+{
+    TraceWriter() = default;
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+    ~TraceWriter();
+
+    bool open(const char* path);
+    void close();
+
+    void push(const TraceRecord& record)
+    {
+        (*chunk)[fill++] = record;
+
+        if (fill == TRACE_CHUNK)
+            submit();
+    }
+
+private:
+
+    FILE* file = nullptr;
+    std::thread thread;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<std::vector<TraceRecord>> chunks;
+    std::vector<std::vector<TraceRecord>*> spare;
+    std::deque<std::pair<std::vector<TraceRecord>*, uint32_t>> full;
+    bool closing = false;
+
+    std::vector<TraceRecord>* chunk = nullptr;
+    uint32_t fill = 0;
+
+    void submit();
+    void loop();
+};
+
+struct TraceReader
+{
+    TraceReader() = default;
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+    ~TraceReader();
+
+    bool open(const char* path);
+    bool next(TraceRecord& record);
+
+private:
+
+    FILE* file = nullptr;
+    TraceModel model;
+};
@@ -0,0 +1,277 @@
+#include <bus.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+std::string fault_message(uint32_t cause, uint32_t address)
+{
+    const char* kind;
+
+    switch (cause)
+    {
+    case FAULT_FETCH_MISALIGNED:    kind = "Misaligned instruction fetch";  break;
+    case FAULT_FETCH_ACCESS:        kind = "Instruction access fault";      break;
+    case FAULT_ILLEGAL:             kind = "Illegal instruction";           break;
+    case FAULT_BREAKPOINT:          kind = "Breakpoint";                    break;
+    case FAULT_LOAD_MISALIGNED:     kind = "Misaligned load";               break;
+    case FAULT_LOAD_ACCESS:         kind = "Load access fault";             break;
+    case FAULT_STORE_MISALIGNED:    kind = "Misaligned store";              break;
+    case FAULT_STORE_ACCESS:        kind = "Store access fault";            break;
+
+    default: kind = "Fault"; break;
+    }
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s at %08x", kind, address);
+
+    return buffer;
+}
+
+Fault::Fault(uint32_t _cause, uint32_t _address) : std::runtime_error(fault_message(_cause, _address)), cause(_cause), address(_address) {}
+
+Bus::Bus(uint8_t* _memory, uint64_t _memory_size) : memory(_memory), memory_size(_memory_size),
+    pages(BUS_PAGES + (_memory_size >> BUS_LINE_SHIFT) + (_memory_size >> PAGE_SHIFT))
+{
+    fill();
+}
+
+void Bus::resize(uint8_t* _memory, uint64_t _memory_size)
+{
+    memory = _memory;
+    memory_size = _memory_size;
+    present.clear();
+    changed.clear();
+
+    pages.resize(BUS_PAGES + (memory_size >> BUS_LINE_SHIFT) + (memory_size >> PAGE_SHIFT));
+    fill();
+}
+
+// the dirty lines and stored bytes of a fresh mapping are already zero
+void Bus::fill()
+{
+    dirty = &pages[BUS_PAGES];
+    stored = &dirty[memory_size >> BUS_LINE_SHIFT];
+
+    std::fill(&pages[0], &pages[memory_size >> PAGE_SHIFT], BUS_ABSENT);
+    std::fill(&pages[memory_size >> PAGE_SHIFT], &pages[BUS_PAGES], BUS_UNMAPPED);
+
+    for (uint32_t i = 0; i < devices.size(); i++)
+    {
+        uint32_t first = devices[i].base >> PAGE_SHIFT;
+        uint32_t last = (devices[i].base + devices[i].size - 1) >> PAGE_SHIFT;
+
+        for (uint32_t page = first; page <= last; page++)
+            pages[page] = i + 1;
+    }
+
+    for (const Watchpoint& watchpoint : watchpoints)
+        mark_watched(watchpoint.address, watchpoint.size);
+}
+
+void Bus::map(uint32_t base, uint32_t size, ReadCallback read, WriteCallback write, bool timed)
+{
+    if ((base & (PAGE_SIZE - 1)) != 0 || size == 0)
+        throw std::runtime_error("Devices have to start on a page boundary");
+
+    if (devices.size() >= BUS_MAX_DEVICES)
+        throw std::runtime_error("Too many devices on the bus");
+
+    devices.push_back({ base, size, read, write, timed });
+
+    uint32_t first = base >> PAGE_SHIFT;
+    uint32_t last = (base + size - 1) >> PAGE_SHIFT;
+
+    for (uint32_t page = first; page <= last; page++)
+        pages[page] = devices.size();
+}
+
+bool Bus::fault_in(uint32_t page)
+{
+    if (pages[page] == BUS_ABSENT)
+    {
+        pages[page] = BUS_RAM;
+        present.push_back(page);
+    }
+
+    return pages[page] == BUS_RAM || pages[page] == BUS_WATCHED;
+}
+
+void Bus::evict()
+{
+    for (uint32_t page : present)
+        pages[page] = BUS_ABSENT;
+
+    present.clear();
+    take_changed();
+
+    for (const Watchpoint& watchpoint : watchpoints)
+        mark_watched(watchpoint.address, watchpoint.size);
+}
+
+void Bus::watch(uint32_t address, uint32_t size, uint8_t kind)
+{
+    watchpoints.push_back({ address, size, kind });
+    mark_watched(address, size);
+}
+
+bool Bus::unwatch(uint32_t address, uint32_t size, uint8_t kind)
+{
+    for (auto i = watchpoints.begin(); i != watchpoints.end(); i++)
+    {
+        if (i->address == address && i->size == size && i->kind == kind)
+        {
+            watchpoints.erase(i);
+            mark_watched(address, size);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the RAM pages in the range become watched or plain again
+void Bus::mark_watched(uint32_t address, uint32_t size)
+{
+    uint64_t end = (uint64_t)address + std::max<uint32_t>(size, 1);
+
+    for (uint64_t page = address >> PAGE_SHIFT; page << PAGE_SHIFT < end && page < BUS_PAGES; page++)
+    {
+        if (!fault_in(page))
+            continue;
+
+        uint64_t start = page << PAGE_SHIFT;
+        bool watched = false;
+
+        for (const Watchpoint& watchpoint : watchpoints)
+            watched |= watchpoint.address < start + PAGE_SIZE && (uint64_t)watchpoint.address + watchpoint.size > start;
+
+        pages[page] = watched ? BUS_WATCHED : BUS_RAM;
+    }
+}
+
+void Bus::check_watch(uint32_t address, uint32_t size, uint8_t kind)
+{
+    for (const Watchpoint& watchpoint : watchpoints)
+    {
+        if ((watchpoint.kind & kind) != 0 && address < (uint64_t)watchpoint.address + watchpoint.size && (uint64_t)address + size > watchpoint.address)
+        {
+            if (on_watch)
+                on_watch(watchpoint, address);
+
+            return;
+        }
+    }
+}
+
+void Bus::mark_changed(uint32_t page)
+{
+    if (stored[page] == 0)
+    {
+        stored[page] = 1;
+        changed.push_back(page);
+    }
+}
+
+std::vector<uint32_t> Bus::take_changed()
+{
+    std::vector<uint32_t> taken;
+    taken.swap(changed);
+
+    for (uint32_t page : taken)
+        stored[page] = 0;
+
+    return taken;
+}
+
+void Bus::mark_page(uint32_t page, uint8_t bits)
+{
+    uint8_t* lines = &dirty[page << (PAGE_SHIFT - BUS_LINE_SHIFT)];
+
+    for (uint32_t i = 0; i < PAGE_SIZE >> BUS_LINE_SHIFT; i++)
+        lines[i] |= bits;
+}
+
+bool Bus::read_device(uint32_t address, uint32_t size, uint32_t& value)
+{
+    uint8_t page = pages[address >> PAGE_SHIFT];
+
+    if (page == BUS_RAM || page > BUS_MAX_DEVICES || (address & (size - 1)) != 0)
+        return false;
+
+    Device& device = devices[page - 1];
+    value = 0;
+
+    return address - device.base < device.size && device.read && device.read(address - device.base, size, value);
+}
+
+bool Bus::write_device(uint32_t address, uint32_t size, uint32_t value)
+{
+    uint8_t page = pages[address >> PAGE_SHIFT];
+
+    if (page == BUS_RAM || page > BUS_MAX_DEVICES || (address & (size - 1)) != 0)
+        return false;
+
+    Device& device = devices[page - 1];
+
+    return address - device.base < device.size && device.write && device.write(address - device.base, size, value);
+}
+
+uint32_t Bus::fail(uint32_t cause, uint32_t address)
+{
+    faulted = true;
+    fault_cause = cause;
+    fault_address = address;
+
+    return 0;
+}
+
+// aligned RAM never gets here, so the access is misaligned or not to RAM
+uint32_t Bus::read_slow(uint32_t address, uint32_t size)
+{
+    uint32_t value;
+
+    if ((address & (size - 1)) != 0)
+        return fail(FAULT_LOAD_MISALIGNED, address);
+
+    // the first access to a RAM page
+    if (fault_in(address >> PAGE_SHIFT))
+    {
+        value = 0;
+        memcpy(&value, &memory[address], size);
+
+        if (pages[address >> PAGE_SHIFT] == BUS_WATCHED)
+            check_watch(address, size, WATCH_READ);
+
+        return value;
+    }
+
+    if (!read_device(address, size, value))
+        return fail(FAULT_LOAD_ACCESS, address);
+
+    return value;
+}
+
+void Bus::write_slow(uint32_t address, uint32_t size, uint32_t value)
+{
+    if ((address & (size - 1)) != 0)
+    {
+        fail(FAULT_STORE_MISALIGNED, address);
+        return;
+    }
+
+    if (fault_in(address >> PAGE_SHIFT))
+    {
+        memcpy(&memory[address], &value, size);
+        mark_store(address);
+
+        if (pages[address >> PAGE_SHIFT] == BUS_WATCHED)
+            check_watch(address, size, WATCH_WRITE);
+
+        return;
+    }
+
+    if (!write_device(address, size, value))
+        fail(FAULT_STORE_ACCESS, address);
+}
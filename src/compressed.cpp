@@ -0,0 +1,209 @@
+#include <cpu.h>
+
+// RV32C: every compressed instruction is rewritten into the 32-bit one it
+// stands for when it is decoded, so the engines only ever execute RV32IM.
+// Registers written rd' or rs1' are x8 to x15, encoded in three bits.
+// Floating point loads and stores and the encodings reserved on RV32
+// expand to 0, which decodes as an unknown instruction.
+
+static uint32_t r_type(uint32_t func7, uint32_t src2, uint32_t src1, uint32_t func3, uint32_t dest)
+{
+    return func7 << 25 | src2 << 20 | src1 << 15 | func3 << 12 | dest << 7 | OPCODE_ALU;
+}
+
+static uint32_t i_type(uint32_t imm, uint32_t src1, uint32_t func3, uint32_t dest, uint32_t opcode)
+{
+    return (imm & 0xfff) << 20 | src1 << 15 | func3 << 12 | dest << 7 | opcode;
+}
+
+static uint32_t s_type(uint32_t imm, uint32_t src2, uint32_t src1, uint32_t func3)
+{
+    return ((imm >> 5) & 0x7f) << 25 | src2 << 20 | src1 << 15 | func3 << 12 | (imm & 0x1f) << 7 | OPCODE_STORE;
+}
+
+static uint32_t b_type(uint32_t imm, uint32_t src2, uint32_t src1, uint32_t func3)
+{
+    return ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3f) << 25 | src2 << 20 | src1 << 15 | func3 << 12
+        | ((imm >> 1) & 0xf) << 8 | ((imm >> 11) & 1) << 7 | OPCODE_BRANCH;
+}
+
+static uint32_t j_type(uint32_t imm, uint32_t dest)
+{
+    return ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3ff) << 21 | ((imm >> 11) & 1) << 20
+        | ((imm >> 12) & 0xff) << 12 | dest << 7 | OPCODE_JAL;
+}
+
+// all ones when bit 12, the sign of every signed immediate, is set
+static uint32_t sign(uint32_t inst)
+{
+    return (int32_t)(inst << 19) >> 31;
+}
+
+// CJ-format offset of c.j and c.jal
+static uint32_t jump_offset(uint32_t inst)
+{
+    return (sign(inst) << 11) | (bit_cut(inst, 11, 11) << 4) | (bit_cut(inst, 10, 9) << 8)
+        | (bit_cut(inst, 8, 8) << 10) | (bit_cut(inst, 7, 7) << 6) | (bit_cut(inst, 6, 6) << 7)
+        | (bit_cut(inst, 5, 3) << 1) | (bit_cut(inst, 2, 2) << 5);
+}
+
+static uint32_t expand_quadrant_0(uint32_t inst)
+{
+    uint32_t rd = bit_cut(inst, 4, 2) + 8;
+    uint32_t rs1 = bit_cut(inst, 9, 7) + 8;
+
+    // c.lw and c.sw
+    uint32_t offset = (bit_cut(inst, 12, 10) << 3) | (bit_cut(inst, 6, 6) << 2) | (bit_cut(inst, 5, 5) << 6);
+
+    switch (bit_cut(inst, 15, 13))
+    {
+    case 0b000:
+    {
+        // c.addi4spn, a zero immediate is illegal and covers the all-zero halfword
+        uint32_t imm = (bit_cut(inst, 12, 11) << 4) | (bit_cut(inst, 10, 7) << 6) | (bit_cut(inst, 6, 6) << 2) | (bit_cut(inst, 5, 5) << 3);
+
+        if (imm == 0)
+            return 0;
+
+        return i_type(imm, 2, 0b000, rd, OPCODE_ALUI);
+    }
+    case 0b010:     return i_type(offset, rs1, 0b010, rd, OPCODE_LOAD);
+    case 0b110:     return s_type(offset, rd, rs1, 0b010);
+    }
+
+    return 0;
+}
+
+static uint32_t expand_quadrant_1(uint32_t inst)
+{
+    uint32_t rd = bit_cut(inst, 11, 7);
+    uint32_t rd_short = bit_cut(inst, 9, 7) + 8;
+    uint32_t rs2_short = bit_cut(inst, 4, 2) + 8;
+    uint32_t imm = (sign(inst) << 5) | bit_cut(inst, 6, 2);
+
+    switch (bit_cut(inst, 15, 13))
+    {
+    case 0b000:     return i_type(imm, rd, 0b000, rd, OPCODE_ALUI);                 // c.addi, c.nop
+    case 0b001:     return j_type(jump_offset(inst), 1);                            // c.jal
+    case 0b010:     return i_type(imm, 0, 0b000, rd, OPCODE_ALUI);                  // c.li
+    case 0b011:
+    {
+        if (rd == 2)
+        {
+            // c.addi16sp
+            uint32_t offset = (sign(inst) << 9) | (bit_cut(inst, 6, 6) << 4) | (bit_cut(inst, 5, 5) << 6)
+                | (bit_cut(inst, 4, 3) << 7) | (bit_cut(inst, 2, 2) << 5);
+
+            if (offset == 0)
+                return 0;
+
+            return i_type(offset, 2, 0b000, 2, OPCODE_ALUI);
+        }
+
+        // c.lui
+        if (imm == 0)
+            return 0;
+
+        return (imm << 12) | rd << 7 | OPCODE_LUI;
+    }
+    case 0b100:
+    {
+        uint32_t shamt = bit_cut(inst, 6, 2);
+
+        switch (bit_cut(inst, 11, 10))
+        {
+        case 0b00:  return bit_cut(inst, 12, 12) ? 0 : i_type(shamt, rd_short, 0b101, rd_short, OPCODE_ALUI);                // c.srli
+        case 0b01:  return bit_cut(inst, 12, 12) ? 0 : i_type(shamt | 0x400, rd_short, 0b101, rd_short, OPCODE_ALUI);       // c.srai
+        case 0b10:  return i_type(imm, rd_short, 0b111, rd_short, OPCODE_ALUI);                                              // c.andi
+        }
+
+        // c.subw and c.addw only exist on RV64
+        if (bit_cut(inst, 12, 12))
+            return 0;
+
+        switch (bit_cut(inst, 6, 5))
+        {
+        case 0b00:  return r_type(0b0100000, rs2_short, rd_short, 0b000, rd_short);     // c.sub
+        case 0b01:  return r_type(0, rs2_short, rd_short, 0b100, rd_short);             // c.xor
+        case 0b10:  return r_type(0, rs2_short, rd_short, 0b110, rd_short);             // c.or
+        case 0b11:  return r_type(0, rs2_short, rd_short, 0b111, rd_short);             // c.and
+        }
+
+        return 0;
+    }
+    case 0b101:     return j_type(jump_offset(inst), 0);                                // c.j
+    case 0b110:
+    case 0b111:
+    {
+        // c.beqz and c.bnez
+        uint32_t offset = (sign(inst) << 8) | (bit_cut(inst, 11, 10) << 3) | (bit_cut(inst, 6, 5) << 6)
+            | (bit_cut(inst, 4, 3) << 1) | (bit_cut(inst, 2, 2) << 5);
+
+        return b_type(offset, 0, rd_short, bit_cut(inst, 13, 13));
+    }
+    }
+
+    return 0;
+}
+
+static uint32_t expand_quadrant_2(uint32_t inst)
+{
+    uint32_t rd = bit_cut(inst, 11, 7);
+    uint32_t rs2 = bit_cut(inst, 6, 2);
+
+    switch (bit_cut(inst, 15, 13))
+    {
+    case 0b000:     return bit_cut(inst, 12, 12) ? 0 : i_type(rs2, rd, 0b001, rd, OPCODE_ALUI);    // c.slli
+    case 0b010:
+    {
+        // c.lwsp
+        uint32_t offset = (bit_cut(inst, 12, 12) << 5) | (bit_cut(inst, 6, 4) << 2) | (bit_cut(inst, 3, 2) << 6);
+
+        if (rd == 0)
+            return 0;
+
+        return i_type(offset, 2, 0b010, rd, OPCODE_LOAD);
+    }
+    case 0b100:
+    {
+        if (bit_cut(inst, 12, 12) == 0)
+        {
+            // c.jr, c.mv
+            if (rs2 == 0)
+                return rd == 0 ? 0 : i_type(0, rd, 0b000, 0, OPCODE_JALR);
+
+            return r_type(0, rs2, 0, 0b000, rd);
+        }
+
+        // c.ebreak, c.jalr, c.add
+        if (rd == 0 && rs2 == 0)
+            return i_type(1, 0, 0b000, 0, OPCODE_SYSTEM);
+
+        if (rs2 == 0)
+            return i_type(0, rd, 0b000, 1, OPCODE_JALR);
+
+        return r_type(0, rs2, rd, 0b000, rd);
+    }
+    case 0b110:
+    {
+        // c.swsp
+        uint32_t offset = (bit_cut(inst, 12, 9) << 2) | (bit_cut(inst, 8, 7) << 6);
+
+        return s_type(offset, rs2, 2, 0b010);
+    }
+    }
+
+    return 0;
+}
+
+uint32_t expand_compressed(uint32_t inst)
+{
+    switch (inst & 3)
+    {
+    case 0b00:  return expand_quadrant_0(inst & 0xffff);
+    case 0b01:  return expand_quadrant_1(inst & 0xffff);
+    case 0b10:  return expand_quadrant_2(inst & 0xffff);
+    }
+
+    return inst;
+}
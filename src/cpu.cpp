@@ -1,9 +1,15 @@
 #include <cpu.h>
+#include <jit.h>
+#include <profiler.h>
+#include <syscalls.h>
+#include <trace.h>
+#include <algorithm>
 #include <stdarg.h>
+#include <string.h>
 
-uint32_t bit_cut(uint32_t value, int a, int b, bool sign = false)
+uint32_t bit_cut(uint32_t value, int a, int b, bool sign)
 {
-    uint32_t mask = (-1 << b) ^ ((-1 << a) << 1);
+    uint32_t mask = (~0u << b) ^ ((~0u << a) << 1);
 
     if (sign)
         return (int)(value & mask) >> b;
@@ -11,418 +17,764 @@ uint32_t bit_cut(uint32_t value, int a, int b, bool sign = false)
     return (value & mask) >> b;
 }
 
-void CPU::reset()
+static const uint8_t branch_ops[8] = { OP_BEQ, OP_BNE, OP_REFERENCE, OP_REFERENCE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU };
+static const uint8_t load_ops[8] = { OP_LB, OP_LH, OP_LW, OP_REFERENCE, OP_LBU, OP_LHU, OP_REFERENCE, OP_REFERENCE };
+static const uint8_t store_ops[8] = { OP_SB, OP_SH, OP_SW, OP_REFERENCE, OP_REFERENCE, OP_REFERENCE, OP_REFERENCE, OP_REFERENCE };
+static const uint8_t alui_ops[8] = { OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI };
+static const uint8_t alu_ops[8] = { OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND };
+static const uint8_t muldiv_ops[8] = { OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU };
+
+uint8_t select_op(uint8_t opcode, uint8_t func3, uint8_t func7)
 {
-    for (int i = 0; i < 32; i++)
-        this->x[i] = 0;
+    switch (opcode)
+    {
+    case OPCODE_LUI:    return OP_LUI;
+    case OPCODE_AUIPC:  return OP_AUIPC;
+    case OPCODE_JAL:    return OP_JAL;
+    case OPCODE_JALR:   return func3 == 0 ? OP_JALR : OP_REFERENCE;
+    case OPCODE_BRANCH: return branch_ops[func3];
+    case OPCODE_LOAD:   return load_ops[func3];
+    case OPCODE_STORE:  return store_ops[func3];
+    case OPCODE_ALUI:
+    {
+        if (func3 == 0b101 && func7 == 0b0100000)
+            return OP_SRAI;
 
-    dirty = -1;
+        if ((func3 == 0b001 || func3 == 0b101) && func7 != 0)
+            return OP_REFERENCE;
+
+        return alui_ops[func3];
+    }
+    case OPCODE_ALU:
+    {
+        if (func7 == 0)
+            return alu_ops[func3];
+
+        if (func7 == 0b0000001)
+            return muldiv_ops[func3];
+
+        if (func7 == 0b0100000 && func3 == 0b000)
+            return OP_SUB;
+
+        if (func7 == 0b0100000 && func3 == 0b101)
+            return OP_SRA;
+
+        return OP_REFERENCE;
+    }
+    }
+
+    return OP_REFERENCE;
 }
 
-void CPU::execute(uint32_t inst)
+// encodings the handlers can take as given, anything else is illegal
+static bool legal(uint8_t opcode, uint8_t func3, uint8_t func7, uint32_t inst)
 {
-    uint8_t opcode = inst & OPCODE_MASK;
-
-    x[0] = 0;
+    uint32_t rd = bit_cut(inst, 11, 7);
+    uint32_t rs1 = bit_cut(inst, 19, 15);
+    uint32_t number = bit_cut(inst, 31, 20);
 
     switch (opcode)
     {
-    case OPCODE_LUI:    lui(inst);          break;
-    case OPCODE_AUIPC:  auipc(inst);        break;
-    case OPCODE_JAL:    jal(inst);          break;
-    case OPCODE_JALR:   jalr(inst);         break;
-    case OPCODE_BRANCH: branch(inst);       break;
-    case OPCODE_LOAD:   load(inst);         break;
-    case OPCODE_STORE:  store(inst);        break;
-    case OPCODE_ALUI:   alu(inst, true);    break;
-    case OPCODE_ALU:    alu(inst, false);   break;
+    case OPCODE_JALR:   return func3 == 0;
+    case OPCODE_BRANCH: return func3 != 0b010 && func3 != 0b011;
+    case OPCODE_LOAD:   return func3 != 0b011 && func3 < 0b110;
+    case OPCODE_STORE:  return func3 < 0b011;
+    case OPCODE_FENCE:  return func3 < 0b010;
+    case OPCODE_ALUI:
+    {
+        if (func3 == 0b101 && func7 == 0b0100000)
+            return true;
+
+        return (func3 != 0b001 && func3 != 0b101) || func7 == 0;
     }
-}
+    case OPCODE_ALU:
+    {
+        if (func7 == 0b0100000)
+            return func3 == 0b000 || func3 == 0b101;
 
-void CPU::step()
-{
-    dirty = -1;
+        return func7 == 0 || func7 == 0b0000001;
+    }
+    case OPCODE_SYSTEM:
+    {
+        if (func3 == 0b100)
+            return false;
+
+        if (func3 == 0)
+            return rd == 0 && rs1 == 0 && (number == 0 || number == 1 || number == SYSTEM_MRET || number == SYSTEM_WFI);
+
+        // csrrw always writes, csrrs and csrrc only with something to set or clear
+        return csr_allowed(number, (func3 & 0b011) == 0b01 || rs1 != 0);
+    }
+    }
 
-    uint32_t instruction = *((uint32_t*)(memory + pc));
-    execute(instruction);
+    return true;
 }
 
-void CPU::decode_R_type(uint32_t inst)
+static void decode_R_type(uint32_t inst, Decoded& d)
 {
-    func7 = bit_cut(inst, 31, 25);
-    func3 = bit_cut(inst, 14, 12);
-    dest = bit_cut(inst, 11, 7);
-    src1 = bit_cut(inst, 19, 15);
-    src2 = bit_cut(inst, 24, 20);
-    imm = 0;
+    d.func7 = bit_cut(inst, 31, 25);
+    d.func3 = bit_cut(inst, 14, 12);
+    d.dest = bit_cut(inst, 11, 7);
+    d.src1 = bit_cut(inst, 19, 15);
+    d.src2 = bit_cut(inst, 24, 20);
+    d.imm = 0;
 }
 
-void CPU::decode_I_type(uint32_t inst)
+static void decode_I_type(uint32_t inst, Decoded& d)
 {
-    func7 = 0;
-    func3 = bit_cut(inst, 14, 12);
-    dest = bit_cut(inst, 11, 7);
-    src1 = bit_cut(inst, 19, 15);
-    src2 = 0;
-    imm = bit_cut(inst, 31, 20, true);
+    d.func7 = 0;
+    d.func3 = bit_cut(inst, 14, 12);
+    d.dest = bit_cut(inst, 11, 7);
+    d.src1 = bit_cut(inst, 19, 15);
+    d.src2 = 0;
+    d.imm = bit_cut(inst, 31, 20, true);
 }
 
-void CPU::decode_S_type(uint32_t inst)
+static void decode_S_type(uint32_t inst, Decoded& d)
 {
-    func7 = 0;
-    func3 = bit_cut(inst, 14, 12);
-    dest = 0;
-    src1 = bit_cut(inst, 19, 15);
-    src2 = bit_cut(inst, 24, 20);
-    imm = (bit_cut(inst, 31, 25, true) << 5) + bit_cut(inst, 11, 7);
+    d.func7 = 0;
+    d.func3 = bit_cut(inst, 14, 12);
+    d.dest = 0;
+    d.src1 = bit_cut(inst, 19, 15);
+    d.src2 = bit_cut(inst, 24, 20);
+    d.imm = (bit_cut(inst, 31, 25, true) << 5) + bit_cut(inst, 11, 7);
 }
 
-void CPU::decode_B_type(uint32_t inst)
+static void decode_B_type(uint32_t inst, Decoded& d)
 {
-    func7 = 0;
-    func3 = bit_cut(inst, 14, 12);
-    dest = 0;
-    src1 = bit_cut(inst, 19, 15);
-    src2 = bit_cut(inst, 24, 20);
+    d.func7 = 0;
+    d.func3 = bit_cut(inst, 14, 12);
+    d.dest = 0;
+    d.src1 = bit_cut(inst, 19, 15);
+    d.src2 = bit_cut(inst, 24, 20);
 
     uint32_t bit_12 = bit_cut(inst, 31, 31, true);
     uint32_t bit_10_5 = bit_cut(inst, 30, 25);
     uint32_t bit_4_1 = bit_cut(inst, 11, 8);
     uint32_t bit_11 = bit_cut(inst, 7, 7);
 
-    imm = (bit_12 << 12) + (bit_10_5 << 5) + (bit_4_1 << 1) + (bit_11 << 11);
+    d.imm = (bit_12 << 12) + (bit_10_5 << 5) + (bit_4_1 << 1) + (bit_11 << 11);
 }
 
-void CPU::decode_U_type(uint32_t inst)
+static void decode_U_type(uint32_t inst, Decoded& d)
 {
-    func7 = 0;
-    func3 = 0;
-    dest = bit_cut(inst, 11, 7);
-    src1 = 0;
-    src2 = 0;
-    imm = bit_cut(inst, 31, 12) << 12;
+    d.func7 = 0;
+    d.func3 = 0;
+    d.dest = bit_cut(inst, 11, 7);
+    d.src1 = 0;
+    d.src2 = 0;
+    d.imm = bit_cut(inst, 31, 12) << 12;
 }
 
-void CPU::decode_J_type(uint32_t inst)
+static void decode_J_type(uint32_t inst, Decoded& d)
 {
-    func7 = 0;
-    func3 = 0;
-    dest = bit_cut(inst, 11, 7);
-    src1 = 0;
-    src2 = 0;
+    d.func7 = 0;
+    d.func3 = 0;
+    d.dest = bit_cut(inst, 11, 7);
+    d.src1 = 0;
+    d.src2 = 0;
 
     uint32_t bit_20 = bit_cut(inst, 31, 31, true);
     uint32_t bit_10_1 = bit_cut(inst, 30, 21);
     uint32_t bit_19_12 = bit_cut(inst, 19, 12);
     uint32_t bit_11 = bit_cut(inst, 20, 20);
 
-    imm = (bit_20 << 20) + (bit_10_1 << 1) + (bit_19_12 << 12) + (bit_11 << 11);
+    d.imm = (bit_20 << 20) + (bit_10_1 << 1) + (bit_19_12 << 12) + (bit_11 << 11);
 }
 
-void CPU::lui(uint32_t inst)
+bool decode_fields(uint32_t inst, Decoded& d)
 {
-    decode_U_type(inst);
+    uint8_t opcode = inst & OPCODE_MASK;
 
-    x[dest] = imm;
-    dirty = dest;
+    switch (opcode)
+    {
+    case OPCODE_LUI:
+    case OPCODE_AUIPC:  decode_U_type(inst, d);     break;
+    case OPCODE_JAL:    decode_J_type(inst, d);     break;
+    case OPCODE_BRANCH: decode_B_type(inst, d);     break;
+    case OPCODE_STORE:  decode_S_type(inst, d);     break;
+    case OPCODE_ALU:    decode_R_type(inst, d);     break;
+    case OPCODE_JALR:
+    case OPCODE_LOAD:
+    case OPCODE_ALUI:
+    case OPCODE_SYSTEM:
+    case OPCODE_FENCE:  decode_I_type(inst, d);     break;
+
+    default: return false;
+    }
 
-    pc += 4;
+    // shift immediates keep func7 in the upper bits of the I-type immediate
+    if (opcode == OPCODE_ALUI && (d.func3 == 0b001 || d.func3 == 0b101))
+    {
+        d.func7 = bit_cut(inst, 31, 25);
+        d.imm = bit_cut(inst, 24, 20);
+    }
+
+    return legal(opcode, d.func3, d.func7, inst);
 }
 
-void CPU::auipc(uint32_t inst)
+uint32_t result_register(uint32_t inst)
 {
-    decode_U_type(inst);
-
-    x[dest] = pc + imm;
-    dirty = dest;
+    bool ecall = (inst & OPCODE_MASK) == OPCODE_SYSTEM && bit_cut(inst, 14, 12) == 0 && bit_cut(inst, 31, 20) == 0;
 
-    pc += 4;
+    return ecall ? 10 : bit_cut(inst, 11, 7);
 }
 
-void CPU::jal(uint32_t inst)
+CPU::CPU(uint8_t* _memory, uint64_t _memory_size) : memory(_memory), memory_size(_memory_size), bus(_memory, _memory_size),
+    decoded(((_memory_size + PAGE_SIZE - 1) >> PAGE_SHIFT) * sizeof(DecodedPage*)) {}
+
+CPU::~CPU() = default;
+
+void CPU::resize(uint8_t* _memory, uint64_t _memory_size)
 {
-    decode_J_type(inst);
+    memory = _memory;
+    memory_size = _memory_size;
+    bus.resize(_memory, _memory_size);
+    decoded.resize(((_memory_size + PAGE_SIZE - 1) >> PAGE_SHIFT) * sizeof(DecodedPage*));
+    decoded_pages.clear();
+    jit.reset();
+}
 
-    x[dest] = pc + 4;
-    dirty = dest;
+void CPU::reset()
+{
+    for (int i = 0; i < 32; i++)
+        this->x[i] = 0;
 
-    pc += imm;
+    dirty = -1;
+    halted = false;
+    trapped = false;
+    waiting = false;
+    yielded = false;
+    paused = false;
+    faulted = false;
+    exit_code = 0;
+
+    csr = Csrs();
+    instret = 0;
+    idle = 0;
+    mtimecmp = UINT64_MAX;
+    event = UINT64_MAX;
 }
 
-void CPU::jalr(uint32_t inst)
+Decoded CPU::decode(uint32_t inst)
 {
-    decode_I_type(inst);
+    if (inst_size(inst) == 2)
+    {
+        uint32_t expanded = expand_compressed(inst);
+
+        if (expanded == 0)
+            return { &CPU::illegal, 0, OP_REFERENCE, 0, 0, 0, 0, 0, 2 };
+
+        Decoded d = decode(expanded);
+        d.size = 2;
+        return d;
+    }
+
+    Decoded d = {};
+    d.size = 4;
+
+    if (!decode_fields(inst, d))
+        return { &CPU::illegal, 0, OP_REFERENCE, 0, 0, 0, 0, 0, 4 };
+
+    uint8_t opcode = inst & OPCODE_MASK;
+
+    switch (opcode)
+    {
+    case OPCODE_LUI:    d.handler = &CPU::lui;      break;
+    case OPCODE_AUIPC:  d.handler = &CPU::auipc;    break;
+    case OPCODE_JAL:    d.handler = &CPU::jal;      break;
+    case OPCODE_JALR:   d.handler = &CPU::jalr;     break;
+    case OPCODE_BRANCH: d.handler = &CPU::branch;   break;
+    case OPCODE_LOAD:   d.handler = &CPU::load;     break;
+    case OPCODE_STORE:  d.handler = &CPU::store;    break;
+    case OPCODE_ALUI:   d.handler = &CPU::alu_imm;  break;
+    case OPCODE_ALU:    d.handler = &CPU::alu_reg;  break;
+    case OPCODE_SYSTEM: d.handler = &CPU::system;   break;
+    case OPCODE_FENCE:  d.handler = &CPU::fence;    break;
+    }
 
-    if (func3 != 0)
-        throw std::runtime_error("Expected func3 to be zero in jalr instruction");
+    if (opcode == OPCODE_ALU && d.func7 == 0b0000001)
+        d.handler = &CPU::muldiv;
 
-    uint32_t reg = x[src1];
+    if (opcode == OPCODE_SYSTEM && d.func3 != 0)
+        d.handler = &CPU::access_csr;
 
-    x[dest] = pc + 4;
-    dirty = dest;
+    // ecall returns its result in a0, which history and traces have to see
+    if (opcode == OPCODE_SYSTEM)
+        d.dest = result_register(inst);
 
-    pc = reg + imm;
+    d.op = select_op(opcode, d.func3, d.func7);
+
+    return d;
 }
 
-void CPU::branch(uint32_t inst)
+void CPU::execute(uint32_t inst)
 {
-    decode_B_type(inst);
+    Decoded d = decode(inst);
 
-    bool result;
+    x[0] = 0;
+    (this->*d.handler)(d);
+}
 
-    switch (func3)
+const Decoded& CPU::fetch(uint32_t address)
+{
+    DecodedPage*& page = decoded_page(address >> PAGE_SHIFT);
+
+    if (page == nullptr)
     {
-    case 0b000:     result = (x[src1] == x[src2]);                  break;
-    case 0b001:     result = (x[src1] != x[src2]);                  break;
-    case 0b100:     result = ((int)x[src1] < (int)x[src2]);         break;
-    case 0b101:     result = ((int)x[src1] >= (int)x[src2]);        break;
-    case 0b110:     result = (x[src1] < x[src2]);                   break;
-    case 0b111:     result = (x[src1] >= x[src2]);                  break;
-
-    default: throw std::runtime_error("Unexpected bit pattern in branch instruction");
+        decoded_pages.push_back(std::make_unique<DecodedPage>());
+        page = decoded_pages.back().get();
     }
 
-    pc += result ? imm : 4;
+    Decoded& d = page->inst[(address & (PAGE_SIZE - 1)) >> 1];
+
+    if (d.handler == nullptr)
+    {
+        uint32_t inst = *((uint16_t*)(memory + address));
+
+        if (inst_size(inst) == 4 && (uint64_t)address + 4 <= memory_size)
+            inst |= *((uint16_t*)(memory + address + 2)) << 16;
+
+        d = decode(inst);
+
+        if (!breakpoints.empty() && breakpoints.count(address) != 0)
+            d = { &CPU::breakpoint, 0, OP_REFERENCE, 0, 0, 0, 0, 0, d.size };
+
+        // generated stores only look for code where the JIT knows of it
+        if (jit)
+            jit->decoded(address);
+    }
+
+    return d;
 }
 
-void CPU::load(uint32_t inst)
+void CPU::set_breakpoint(uint32_t address, bool enabled)
 {
-    decode_I_type(inst);
+    if (enabled)
+        breakpoints.insert(address);
+    else
+        breakpoints.erase(address);
 
-    int address = x[src1] + imm;
+    invalidate(address);
+}
 
-    switch (func3)
+void CPU::step()
+{
+    advance();
+
+    if (faulted)
+        throw_fault();
+}
+
+// an instruction that traps takes its tick of time like any other, a
+// breakpoint stops before its instruction and takes none
+void CPU::advance()
+{
+    dirty = -1;
+
+    if ((pc & 1) != 0)
+        exception(FAULT_FETCH_MISALIGNED, pc);
+    else if (!bus.is_ram(pc) && !bus.fault_in(pc >> PAGE_SHIFT))
+        exception(FAULT_FETCH_ACCESS, pc);
+    else
     {
-    case 0b000:     x[dest] = *((int8_t*)&memory[address]);         break;
-    case 0b001:     x[dest] = *((int16_t*)&memory[address]);        break;
-    case 0b010:     x[dest] = *((uint32_t*)&memory[address]);       break;
-    case 0b100:     x[dest] = *((uint8_t*)&memory[address]);        break;
-    case 0b101:     x[dest] = *((uint16_t*)&memory[address]);       break;
+        const Decoded& d = fetch(pc);
 
-    default: throw std::runtime_error("Unexpected func3 in load instruction");
-    }
+        if (d.handler == &CPU::breakpoint)
+            return breakpoint(d);
+
+        x[0] = 0;
 
-    dirty = dest;
+        if (trace != nullptr || profile != nullptr)
+            instrumented(d);
+        else
+            (this->*d.handler)(d);
+    }
 
-    pc += 4;
+    instret++;
 }
 
-void CPU::store(uint32_t inst)
+void CPU::instrumented(const Decoded& d)
 {
-    decode_S_type(inst);
+    uint32_t inst = *((uint16_t*)&memory[pc]);
+
+    if (d.size == 4)
+        inst |= *((uint16_t*)&memory[pc + 2]) << 16;
 
-    int address = x[src1] + imm;
+    TraceRecord record = { pc, inst, 0, 0, 0, 0, 0 };
 
-    switch (func3)
+    // operands are read before a load can overwrite them
+    if (d.op >= OP_LB && d.op <= OP_SW)
     {
-    case 0b000:     *((uint8_t*)&memory[address]) = (uint8_t)x[src2];       break;
-    case 0b001:     *((uint16_t*)&memory[address]) = (uint16_t)x[src2];     break;
-    case 0b010:     *((uint32_t*)&memory[address]) = x[src2];               break;
+        record.address = x[d.src1] + d.imm;
+        record.data = x[d.src2];
+        record.flags |= TRACE_MEMORY;
+    }
+
+    (this->*d.handler)(d);
 
-    default: throw std::runtime_error("Unexpected func3 in store instruction");
+    if (dirty > 0)
+    {
+        record.value = x[dirty];
+        record.dest = dirty;
+        record.flags |= TRACE_VALUE;
     }
 
-    pc += 4;
+    if (profile != nullptr)
+        profile->record(record.pc, record.inst, pc);
+
+    if (trace != nullptr)
+        trace->push(record);
 }
 
-void CPU::alu(uint32_t inst, bool immediate)
+uint64_t CPU::run(uint64_t count)
 {
-    if (immediate)
-        decode_I_type(inst);
-    else
-        decode_R_type(inst);
+    uint64_t start = time();
+
+    // the engines run up to the next interrupt, waiting skips ahead to it
+    while (time() - start < count && ready(count - (time() - start)))
+    {
+        run_engine(std::min(count - (time() - start), event - time()));
+
+        if (paused)
+            break;
+    }
+
+    if (yielded)
+        halted = yielded = false;
+
+    if (faulted)
+        throw_fault();
 
-    uint32_t value = immediate ? imm : x[src2];
+    return time() - start;
+}
 
-    if (func7 == 0)
+// each engine leaves instret at exactly what it retired
+void CPU::run_engine(uint64_t count)
+{
+    switch (trace != nullptr || profile != nullptr ? ENGINE_INTERPRETER : engine)
     {
-        switch (func3)
-        {
-        case 0b000:     x[dest] = x[src1] + value;                                          break;
-        case 0b001:     x[dest] = x[src1] << value;                                         break;
-        case 0b010:     x[dest] = ((int)x[src1] < (int)value) ? 1 : 0;                      break;
-        case 0b011:     x[dest] = ((unsigned int)x[src1] < (unsigned int)value) ? 1 : 0;    break;
-        case 0b100:     x[dest] = x[src1] ^ value;                                          break;
-        case 0b101:     x[dest] = (unsigned int)x[src1] >> value;                           break;
-        case 0b110:     x[dest] = x[src1] | value;                                          break;
-        case 0b111:     x[dest] = x[src1] & value;                                          break;
-
-        default: throw std::runtime_error("Unexpected func3 in alu instruction");
-        }
+    case ENGINE_THREADED:   run_threaded(*this, count);     return;
+    case ENGINE_JIT:
+    {
+        if (!jit)
+            jit = std::make_unique<Jit>(*this);
+
+        jit->run(count);
+        return;
     }
-    else if (func7 == 0b0100000)
+    default: break;
+    }
+
+    for (uint64_t i = 0; i < count && !halted; i++)
+        advance();
+}
+
+void CPU::invalidate(uint32_t address)
+{
+    uint32_t index = address >> PAGE_SHIFT;
+    uint32_t slot = (address & (PAGE_SIZE - 1)) >> 1;
+    uint64_t count = decoded.size() / sizeof(DecodedPage*);
+
+    // the byte may also be the upper half of an instruction starting before it
+    if (index < count && decoded_page(index))
     {
-        switch (func3)
-        {
-        case 0b000:     x[dest] = x[src1] - value;          break;
-        case 0b101:     x[dest] = (int)x[src1] >> value;    break;
+        decoded_page(index)->inst[slot] = {};
 
-        default: throw std::runtime_error("Unexpected func3 in alu instruction");
-        }
+        if (slot > 0)
+            decoded_page(index)->inst[slot - 1] = {};
     }
-    else
-        throw std::runtime_error("Unexpected func7 in alu instruction");
 
-    dirty = dest;
+    if (slot == 0 && index > 0 && index <= count && decoded_page(index - 1))
+        decoded_page(index - 1)->inst[PAGE_SIZE / 2 - 1] = {};
 
-    pc += 4;
+    if (jit)
+        jit->invalidate(address);
 }
 
-const char* reg_name[] =
+void CPU::forget_decoded()
 {
-    "zero",
-    "ra",
-    "sp",
-    "gp",
-    "tp",
-    "t0","t1","t2",
-    "s0","s1",
-    "a0","a1","a2","a3","a4","a5","a6","a7",
-    "s2","s3","s4","s5","s6","s7","s8","s9","s10","s11",
-    "t3","t4","t5","t6"
-};
+    decoded.clear();
+    decoded_pages.clear();
+}
 
-std::string fmt(const char* fmt, ...)
+// for memory rewritten behind the bus, such as a restored save state
+void CPU::invalidate_page(uint32_t address)
 {
-    va_list args;
-    va_list args_copy;
+    uint32_t index = address >> PAGE_SHIFT;
 
-    va_start(args, fmt);
-    va_copy(args_copy, args);
+    if (index < decoded.size() / sizeof(DecodedPage*) && decoded_page(index))
+        std::fill(std::begin(decoded_page(index)->inst), std::end(decoded_page(index)->inst), Decoded());
 
-    int size = vsnprintf(nullptr, 0, fmt, args_copy);
-    char buffer[size + 1];
-    vsnprintf(buffer, size + 1, fmt, args);
+    if (jit)
+        jit->invalidate_page(address);
+}
 
-    va_end(args_copy);
-    va_end(args);
 
-    return std::string(buffer);
+void CPU::lui(const Decoded& d)
+{
+    x[d.dest] = d.imm;
+    dirty = d.dest;
+
+    pc += d.size;
 }
 
-std::string CPU::disassemble(uint32_t inst)
+void CPU::auipc(const Decoded& d)
 {
-    uint8_t opcode = inst & OPCODE_MASK;
+    x[d.dest] = pc + d.imm;
+    dirty = d.dest;
 
-    switch (opcode)
-    {
-    case OPCODE_LUI:    decode_U_type(inst);    return fmt("lui %s, %d", reg_name[dest], imm >> 12);
-    case OPCODE_AUIPC:  decode_U_type(inst);    return fmt("auipc %s, %d", reg_name[dest], imm >> 12);
-    case OPCODE_JAL:    decode_J_type(inst);    return fmt("jal %s, %d", reg_name[dest], imm);
-    case OPCODE_JALR:
+    pc += d.size;
+}
+
+void CPU::jal(const Decoded& d)
+{
+    x[d.dest] = pc + d.size;
+    dirty = d.dest;
+
+    pc += d.imm;
+}
+
+void CPU::jalr(const Decoded& d)
+{
+    uint32_t reg = x[d.src1];
+
+    x[d.dest] = pc + d.size;
+    dirty = d.dest;
+
+    pc = (reg + d.imm) & ~1;
+}
+
+void CPU::branch(const Decoded& d)
+{
+    bool result = false;
+
+    switch (d.func3)
     {
-        decode_I_type(inst);
+    case 0b000:     result = (x[d.src1] == x[d.src2]);                  break;
+    case 0b001:     result = (x[d.src1] != x[d.src2]);                  break;
+    case 0b100:     result = ((int)x[d.src1] < (int)x[d.src2]);         break;
+    case 0b101:     result = ((int)x[d.src1] >= (int)x[d.src2]);        break;
+    case 0b110:     result = (x[d.src1] < x[d.src2]);                   break;
+    case 0b111:     result = (x[d.src1] >= x[d.src2]);                  break;
+    }
 
-        if (func3 != 0)
-            break;
+    pc += result ? d.imm : d.size;
+}
+
+void CPU::load(const Decoded& d)
+{
+    uint32_t address = x[d.src1] + d.imm;
+    uint32_t value = 0;
 
-        return fmt("jalr %s, %d(%s)", reg_name[dest], imm, reg_name[src1]);
+    switch (d.func3)
+    {
+    case 0b000:     value = (int8_t)bus.read<uint8_t>(address);       break;
+    case 0b001:     value = (int16_t)bus.read<uint16_t>(address);     break;
+    case 0b010:     value = bus.read<uint32_t>(address);              break;
+    case 0b100:     value = bus.read<uint8_t>(address);               break;
+    case 0b101:     value = bus.read<uint16_t>(address);              break;
     }
-    case OPCODE_BRANCH:
+
+    if (bus.faulted)
+        return bus_fault();
+
+    x[d.dest] = value;
+    dirty = d.dest;
+
+    pc += d.size;
+}
+
+void CPU::store(const Decoded& d)
+{
+    uint32_t address = x[d.src1] + d.imm;
+
+    switch (d.func3)
     {
-        decode_B_type(inst);
+    case 0b000:     bus.write<uint8_t>(address, x[d.src2]);       break;
+    case 0b001:     bus.write<uint16_t>(address, x[d.src2]);      break;
+    case 0b010:     bus.write<uint32_t>(address, x[d.src2]);      break;
+    }
 
-        std::string res = "";
+    if (bus.faulted)
+        return bus_fault();
 
-        switch (func3)
+    // keep the decoded cache in sync with self-modifying code, which may
+    // clear d itself
+    uint32_t last = address + (1 << d.func3) - 1;
+    uint32_t size = d.size;
+
+    invalidate(address);
+    invalidate(last);
+
+    pc += size;
+}
+
+void CPU::alu_imm(const Decoded& d)
+{
+    alu(d, d.imm);
+}
+
+void CPU::alu_reg(const Decoded& d)
+{
+    alu(d, x[d.src2]);
+}
+
+// shifts only take the low five bits of the amount, as RV32I has it
+void CPU::alu(const Decoded& d, uint32_t value)
+{
+    if (d.func7 == 0)
+    {
+        switch (d.func3)
         {
-        case 0b000:     res = "beq";        break;
-        case 0b001:     res = "bne";        break;
-        case 0b100:     res = "blt";        break;
-        case 0b101:     res = "bge";        break;
-        case 0b110:     res = "bltu";       break;
-        case 0b111:     res = "bgeu";       break;
-
-        default: break;
+        case 0b000:     x[d.dest] = x[d.src1] + value;                                          break;
+        case 0b001:     x[d.dest] = x[d.src1] << (value & 31);                                  break;
+        case 0b010:     x[d.dest] = ((int)x[d.src1] < (int)value) ? 1 : 0;                      break;
+        case 0b011:     x[d.dest] = ((unsigned int)x[d.src1] < (unsigned int)value) ? 1 : 0;    break;
+        case 0b100:     x[d.dest] = x[d.src1] ^ value;                                          break;
+        case 0b101:     x[d.dest] = (unsigned int)x[d.src1] >> (value & 31);                    break;
+        case 0b110:     x[d.dest] = x[d.src1] | value;                                          break;
+        case 0b111:     x[d.dest] = x[d.src1] & value;                                          break;
         }
-
-        return fmt("%s %s, %s, %d", res.c_str(), reg_name[src1], reg_name[src2], imm);
     }
-    case OPCODE_LOAD:
+    else
     {
-        decode_I_type(inst);
-
-        int address = x[src1] + imm;
+        switch (d.func3)
+        {
+        case 0b000:     x[d.dest] = x[d.src1] - value;                  break;
+        case 0b101:     x[d.dest] = (int)x[d.src1] >> (value & 31);     break;
+        }
+    }
 
-        std::string res = "";
+    dirty = d.dest;
 
-        switch (func3)
-        {
-        case 0b000:     res = "lb";         break;
-        case 0b001:     res = "lh";         break;
-        case 0b010:     res = "lw";         break;
-        case 0b100:     res = "lbu";        break;
-        case 0b101:     res = "lhu";        break;
+    pc += d.size;
+}
 
-        default: break;
-        }
+void CPU::muldiv(const Decoded& d)
+{
+    uint32_t a = x[d.src1];
+    uint32_t b = x[d.src2];
 
-        return fmt("%s %s, %d(%s)", res.c_str(), reg_name[dest], imm, reg_name[src1]);
-    }
-    case OPCODE_STORE:
+    switch (d.func3)
     {
-        decode_S_type(inst);
+    case 0b000:     x[d.dest] = a * b;                                                  break;
+    case 0b001:     x[d.dest] = ((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32;      break;
+    case 0b010:     x[d.dest] = ((int64_t)(int32_t)a * (int64_t)b) >> 32;               break;
+    case 0b011:     x[d.dest] = ((uint64_t)a * (uint64_t)b) >> 32;                      break;
+    case 0b100:     x[d.dest] = div_signed(a, b);                                       break;
+    case 0b101:     x[d.dest] = div_unsigned(a, b);                                     break;
+    case 0b110:     x[d.dest] = rem_signed(a, b);                                       break;
+    case 0b111:     x[d.dest] = rem_unsigned(a, b);                                     break;
+    }
 
-        int address = x[src1] + imm;
+    dirty = d.dest;
 
-        std::string res = "";
+    pc += d.size;
+}
 
-        switch (func3)
-        {
-        case 0b000:     res = "sb";         break;
-        case 0b001:     res = "sh";         break;
-        case 0b010:     res = "sw";         break;
+void CPU::system(const Decoded& d)
+{
+    // a system call reading into this page clears d itself
+    uint32_t size = d.size;
 
-        default: break;
-        }
+    if (d.func3 == 0 && d.imm == 0 && x[17] == SYSCALL_EXIT)
+    {
+        halted = true;
+        exit_code = x[10];
+    }
+    else if (d.func3 == 0 && d.imm == 0 && syscalls != nullptr)
+    {
+        dirty = d.dest;
+        syscalls->call(*this);
+    }
+    else if (d.imm == 1)
+        return exception(FAULT_BREAKPOINT, pc);
+    else if (d.imm == SYSTEM_MRET)
+    {
+        pc = csr.mepc;
+        csr.mstatus = (csr.mstatus & ~MSTATUS_MIE) | MSTATUS_MPIE | (csr.mstatus & MSTATUS_MPIE ? MSTATUS_MIE : 0);
+        reschedule();
 
-        return fmt("%s %s, %d(%s)", res.c_str(), reg_name[dest], imm, reg_name[src1]);
+        return;
     }
-    case OPCODE_ALUI:   return disassemble_alu(inst, true);
-    case OPCODE_ALU:    return disassemble_alu(inst, false);
+    else if (d.imm == SYSTEM_WFI && (pending() & csr.mie) == 0)
+    {
+        halted = true;
+        waiting = true;
     }
 
-    return "Bad instruction";
+    pc += size;
 }
 
-std::string CPU::disassemble_alu(uint32_t inst, bool immediate)
+void CPU::fence(const Decoded& d)
 {
-    if (immediate)
-        decode_I_type(inst);
-    else
-        decode_R_type(inst);
+    // one hart, and decoded code already follows every store
+    pc += d.size;
+}
+
+// mtval has the instruction, which fetch left in RAM
+void CPU::illegal(const Decoded& d)
+{
+    uint32_t inst = *((uint16_t*)&memory[pc]);
+
+    if (d.size == 4 && (uint64_t)pc + 4 <= memory_size)
+        inst |= *((uint16_t*)&memory[pc + 2]) << 16;
+
+    exception(FAULT_ILLEGAL, inst);
+}
 
-    std::string res = "";
+// pc stays on the instruction, the debugger steps over it
+void CPU::breakpoint(const Decoded&)
+{
+    halted = true;
+    trapped = true;
+}
 
-    if (func7 == 0)
+const char* reg_name[] =
+{
+    "zero",
+    "ra",
+    "sp",
+    "gp",
+    "tp",
+    "t0","t1","t2",
+    "s0","s1",
+    "a0","a1","a2","a3","a4","a5","a6","a7",
+    "s2","s3","s4","s5","s6","s7","s8","s9","s10","s11",
+    "t3","t4","t5","t6"
+};
+
+const char* engine_name[] = { "interpreter", "threaded", "jit" };
+
+bool parse_engine(const char* name, Engine& engine)
+{
+    for (int i = ENGINE_INTERPRETER; i <= ENGINE_JIT; i++)
     {
-        switch (func3)
+        if (strcmp(name, engine_name[i]) == 0)
         {
-        case 0b000:     res = "add";        break;
-        case 0b001:     res = "sll";        break;
-        case 0b010:     res = "slt";        break;
-        case 0b011:     res = "sltu";       break;
-        case 0b100:     res = "xor";        break;
-        case 0b101:     res = "srl";        break;
-        case 0b110:     res = "or";         break;
-        case 0b111:     res = "and";        break;
-
-        default: return "Bad instruction";
+            engine = (Engine)i;
+            return true;
         }
     }
-    else if (func7 == 0b0100000)
-    {
-        switch (func3)
-        {
-        case 0b000:     res = "sub";        break;
-        case 0b101:     res = "sra";        break;
 
-        default: return "Bad instruction";
-        }
-    }
+    return false;
+}
 
-    if (immediate)
-        return fmt("%si %s, %s, %d", res.c_str(), reg_name[dest], reg_name[src1], imm);
+std::string fmt(const char* fmt, ...)
+{
+    va_list args;
+    va_list args_copy;
+
+    va_start(args, fmt);
+    va_copy(args_copy, args);
+
+    int size = vsnprintf(nullptr, 0, fmt, args_copy);
+    char buffer[size + 1];
+    vsnprintf(buffer, size + 1, fmt, args);
+
+    va_end(args_copy);
+    va_end(args);
 
-    return fmt("%s %s, %s, %s", res.c_str(), reg_name[dest], reg_name[src1], reg_name[src2]);
-}
\ No newline at end of file
+    return std::string(buffer);
+}
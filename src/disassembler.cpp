@@ -0,0 +1,368 @@
+#include <disassembler.h>
+#include <cpu.h>
+#include <loader.h>
+#include <pool.h>
+#include <algorithm>
+#include <stdarg.h>
+#include <vector>
+
+static const char* branch_names[8] = { "beq", "bne", nullptr, nullptr, "blt", "bge", "bltu", "bgeu" };
+static const char* load_names[8] = { "lb", "lh", "lw", nullptr, "lbu", "lhu", nullptr, nullptr };
+static const char* store_names[8] = { "sb", "sh", "sw", nullptr, nullptr, nullptr, nullptr, nullptr };
+static const char* alu_names[8] = { "add", "sll", "slt", "sltu", "xor", "srl", "or", "and" };
+static const char* muldiv_names[8] = { "mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu" };
+static const char* csr_op_names[8] = { nullptr, "csrrw", "csrrs", "csrrc", nullptr, "csrrwi", "csrrsi", "csrrci" };
+
+// a fixed buffer written like a stream, whatever does not fit is cut off
+struct TextBuffer
+{
+    char* data;
+    size_t size;
+    size_t length = 0;
+
+    TextBuffer(char* _data, size_t _size) : data(_data), size(_size)
+    {
+        if (size != 0)
+            data[0] = 0;
+    }
+
+    void add(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        if (length + 1 >= size)
+            return;
+
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(data + length, size - length, format, args);
+        va_end(args);
+
+        if (written > 0)
+            length = std::min(length + written, size - 1);
+    }
+};
+
+static const char* csr_name(uint32_t number)
+{
+    switch (number)
+    {
+    case CSR_MSTATUS:   return "mstatus";
+    case CSR_MISA:      return "misa";
+    case CSR_MIE:       return "mie";
+    case CSR_MTVEC:     return "mtvec";
+    case CSR_MSCRATCH:  return "mscratch";
+    case CSR_MEPC:      return "mepc";
+    case CSR_MCAUSE:    return "mcause";
+    case CSR_MTVAL:     return "mtval";
+    case CSR_MIP:       return "mip";
+    case CSR_MCYCLE:    return "mcycle";
+    case CSR_MINSTRET:  return "minstret";
+    case CSR_MCYCLEH:   return "mcycleh";
+    case CSR_MINSTRETH: return "minstreth";
+    case CSR_CYCLE:     return "cycle";
+    case CSR_TIME:      return "time";
+    case CSR_INSTRET:   return "instret";
+    case CSR_CYCLEH:    return "cycleh";
+    case CSR_TIMEH:     return "timeh";
+    case CSR_INSTRETH:  return "instreth";
+    case CSR_MVENDORID: return "mvendorid";
+    case CSR_MARCHID:   return "marchid";
+    case CSR_MIMPID:    return "mimpid";
+    case CSR_MHARTID:   return "mhartid";
+
+    default: return nullptr;
+    }
+}
+
+// anything decode would not execute is a bad instruction
+static void write_instruction(uint32_t inst, TextBuffer& text)
+{
+    if (inst_size(inst) == 2)
+    {
+        uint32_t expanded = expand_compressed(inst);
+
+        if (expanded == 0)
+            return text.add("Bad instruction");
+
+        text.add("c.");
+
+        return write_instruction(expanded, text);
+    }
+
+    Decoded d;
+
+    if (!decode_fields(inst, d))
+        return text.add("Bad instruction");
+
+    const char* rd = reg_name[d.dest];
+    const char* rs1 = reg_name[d.src1];
+    const char* rs2 = reg_name[d.src2];
+    int32_t imm = d.imm;
+
+    switch (inst & OPCODE_MASK)
+    {
+    case OPCODE_LUI:    return text.add("lui %s, %d", rd, d.imm >> 12);
+    case OPCODE_AUIPC:  return text.add("auipc %s, %d", rd, d.imm >> 12);
+    case OPCODE_JAL:    return text.add("jal %s, %d", rd, imm);
+    case OPCODE_JALR:   return text.add("jalr %s, %d(%s)", rd, imm, rs1);
+    case OPCODE_BRANCH: return text.add("%s %s, %s, %d", branch_names[d.func3], rs1, rs2, imm);
+    case OPCODE_LOAD:   return text.add("%s %s, %d(%s)", load_names[d.func3], rd, imm, rs1);
+    case OPCODE_STORE:  return text.add("%s %s, %d(%s)", store_names[d.func3], rs2, imm, rs1);
+    case OPCODE_FENCE:  return text.add("%s", d.func3 == 0 ? "fence" : "fence.i");
+    case OPCODE_ALUI:
+    {
+        const char* name = d.func7 == 0b0100000 ? "sra" : alu_names[d.func3];
+
+        return text.add("%si %s, %s, %d", name, rd, rs1, imm);
+    }
+    case OPCODE_ALU:
+    {
+        const char* name = alu_names[d.func3];
+
+        if (d.func7 == 0b0000001)
+            name = muldiv_names[d.func3];
+        else if (d.func7 == 0b0100000)
+            name = d.func3 == 0 ? "sub" : "sra";
+
+        return text.add("%s %s, %s, %s", name, rd, rs1, rs2);
+    }
+    case OPCODE_SYSTEM:
+    {
+        uint32_t number = d.imm & 0xfff;
+
+        if (d.func3 == 0)
+        {
+            switch (number)
+            {
+            case 0:             return text.add("ecall");
+            case 1:             return text.add("ebreak");
+            case SYSTEM_MRET:   return text.add("mret");
+            default:            return text.add("wfi");
+            }
+        }
+
+        const char* name = csr_name(number);
+
+        text.add("%s %s, ", csr_op_names[d.func3], rd);
+
+        if (name != nullptr)
+            text.add("%s, ", name);
+        else
+            text.add("0x%03x, ", number);
+
+        // the immediate forms take the register field as the value
+        if (d.func3 & 0b100)
+            return text.add("%d", d.src1);
+
+        return text.add("%s", rs1);
+    }
+    }
+}
+
+// where a jump or branch at address goes, false for anything else
+static bool target_of(uint32_t inst, uint32_t address, uint32_t& target)
+{
+    if (inst_size(inst) == 2)
+        inst = expand_compressed(inst);
+
+    uint8_t opcode = inst & OPCODE_MASK;
+    Decoded d;
+
+    if ((opcode != OPCODE_JAL && opcode != OPCODE_BRANCH) || !decode_fields(inst, d))
+        return false;
+
+    target = address + d.imm;
+
+    return true;
+}
+
+// name or name+offset, like SymbolTable::label but written in place
+static void write_symbol(uint32_t address, const SymbolTable* symbols, TextBuffer& text)
+{
+    const Symbol* symbol = symbols->find(address);
+
+    if (symbol == nullptr)
+        return;
+
+    if (address == symbol->address)
+        text.add(" <%s>", symbol->name.c_str());
+    else
+        text.add(" <%s+%x>", symbol->name.c_str(), address - symbol->address);
+}
+
+size_t disassemble(uint32_t inst, char* text, size_t size, uint32_t address, const SymbolTable* symbols)
+{
+    TextBuffer line(text, size);
+    uint32_t target;
+
+    write_instruction(inst, line);
+
+    if (symbols != nullptr && target_of(inst, address, target))
+        write_symbol(target, symbols, line);
+
+    return line.length;
+}
+
+// A listing is cut into chunks that are decoded and formatted on their own.
+// With compressed code a chunk can't tell whether its first halfword starts
+// an instruction, so each assumes it does and the chunks are checked in
+// order afterwards, the rare one that guessed wrong decoded again from
+// where the one before it really ended.
+struct ListingChunk
+{
+    uint32_t start;
+    uint32_t last;
+
+    // where the first instruction past the chunk starts
+    uint32_t next;
+
+    std::vector<uint32_t> targets;
+    std::string text;
+};
+
+// a 32-bit instruction that does not fit before end is left a halfword
+static uint32_t fetch(const uint8_t* memory, uint32_t address, uint32_t end, uint32_t& size)
+{
+    uint32_t inst = memory[address] | memory[address + 1] << 8;
+
+    size = inst_size(inst) == 4 && end - address >= 4 ? 4 : 2;
+
+    if (size == 4)
+        inst |= (memory[address + 2] | memory[address + 3] << 8) << 16;
+
+    return inst;
+}
+
+static void sweep(const uint8_t* memory, uint32_t end, ListingChunk& chunk)
+{
+    uint32_t address = chunk.start;
+
+    chunk.targets.clear();
+
+    while (address < chunk.last && end - address >= 2)
+    {
+        uint32_t size;
+        uint32_t inst = fetch(memory, address, end, size);
+        uint32_t target;
+
+        if (size == inst_size(inst) && target_of(inst, address, target))
+            chunk.targets.push_back(target);
+
+        address += size;
+    }
+
+    chunk.next = address;
+}
+
+// a symbol starting at address or else, if something jumps there, a local
+// label made of the address
+static void write_label(uint32_t address, const SymbolTable* symbols, bool target, TextBuffer& text)
+{
+    const Symbol* symbol = symbols != nullptr ? symbols->find(address) : nullptr;
+
+    if (symbol != nullptr && symbol->address == address)
+        text.add("%s", symbol->name.c_str());
+    else if (target)
+        text.add(".L%08x", address);
+}
+
+static void list(const uint8_t* memory, uint32_t end, const SymbolTable* symbols, const std::vector<uint32_t>& targets, ListingChunk& chunk)
+{
+    char buffer[DISASSEMBLY_SIZE * 2];
+
+    // the targets are sorted, so the next one at or after the line is kept
+    auto next = std::lower_bound(targets.begin(), targets.end(), chunk.start);
+
+    chunk.text.clear();
+
+    for (uint32_t address = chunk.start; address < chunk.last && end - address >= 2;)
+    {
+        TextBuffer line(buffer, sizeof(buffer));
+        uint32_t size;
+        uint32_t inst = fetch(memory, address, end, size);
+        uint32_t target;
+
+        while (next != targets.end() && *next < address)
+            next++;
+
+        write_label(address, symbols, next != targets.end() && *next == address, line);
+
+        if (line.length != 0)
+            line.add(":\n");
+
+        line.add(size == 2 ? "%08x  %04x      " : "%08x  %08x  ", address, inst);
+
+        if (size != inst_size(inst))
+            line.add("Bad instruction");
+        else
+            write_instruction(inst, line);
+
+        if (size == inst_size(inst) && target_of(inst, address, target))
+        {
+            char label[DISASSEMBLY_SIZE];
+            TextBuffer name(label, sizeof(label));
+
+            write_label(target, symbols, std::binary_search(targets.begin(), targets.end(), target), name);
+
+            // otherwise somewhere inside a symbol, or nowhere known
+            if (name.length != 0)
+                line.add(" <%s>", label);
+            else if (symbols != nullptr)
+                write_symbol(target, symbols, line);
+        }
+
+        line.add("\n");
+        chunk.text.append(buffer, line.length);
+
+        address += size;
+    }
+}
+
+std::string disassemble_range(const uint8_t* memory, uint32_t begin, uint32_t end, const SymbolTable* symbols, int threads)
+{
+    begin &= ~1;
+
+    if (begin >= end)
+        return "";
+
+    std::vector<ListingChunk> chunks((end - begin + DISASSEMBLY_CHUNK - 1) / DISASSEMBLY_CHUNK);
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        chunks[i].start = begin + i * DISASSEMBLY_CHUNK;
+        chunks[i].last = i + 1 < chunks.size() ? chunks[i].start + DISASSEMBLY_CHUNK : end;
+    }
+
+    parallel_for(chunks.size(), threads, [&](size_t i) { sweep(memory, end, chunks[i]); });
+
+    for (size_t i = 1; i < chunks.size(); i++)
+    {
+        if (chunks[i].start != chunks[i - 1].next)
+        {
+            chunks[i].start = chunks[i - 1].next;
+            sweep(memory, end, chunks[i]);
+        }
+    }
+
+    std::vector<uint32_t> targets;
+
+    for (const ListingChunk& chunk : chunks)
+        targets.insert(targets.end(), chunk.targets.begin(), chunk.targets.end());
+
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+    parallel_for(chunks.size(), threads, [&](size_t i) { list(memory, end, symbols, targets, chunks[i]); });
+
+    size_t length = 0;
+
+    for (const ListingChunk& chunk : chunks)
+        length += chunk.text.size();
+
+    std::string listing;
+    listing.reserve(length);
+
+    for (const ListingChunk& chunk : chunks)
+        listing += chunk.text;
+
+    return listing;
+}
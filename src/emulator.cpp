@@ -0,0 +1,307 @@
+#include <emulator.h>
+#include <algorithm>
+#include <cstring>
+
+Emulator::~Emulator()
+{
+    stop();
+}
+
+void Emulator::start()
+{
+    boot = machine.save();
+
+    // a guest writing the present register stops there until its frame
+    // went out and the input was read again
+    machine.vsync = true;
+
+    if (!state_path.empty() && !read_state(state_path.c_str(), quick))
+        quick = SaveState();
+
+    if (!gdb_address.empty())
+    {
+        gdb = std::make_unique<GdbStub>(machine);
+        gdb->history = &history;
+
+        if (!gdb->open(gdb_address.c_str()))
+            gdb.reset();
+    }
+
+    quit = false;
+    thread = std::thread(&Emulator::loop, this);
+}
+
+void Emulator::stop()
+{
+    quit = true;
+
+    if (thread.joinable())
+        thread.join();
+}
+
+void Emulator::loop()
+{
+    scheduler.start();
+
+    while (!quit)
+    {
+        Command command;
+
+        try
+        {
+            while (commands.pop(command))
+                execute(command);
+
+            if (gdb)
+                poll_gdb();
+
+            if (direction > 0 && history.enabled())
+                scheduler.run_frame([this](uint64_t count) { return history.run(machine, count); });
+            else if (direction > 0)
+                scheduler.run_frame(machine.cpu);
+            else if (direction < 0)
+            {
+                scheduler.run_frame([this](uint64_t count) { return history.back(machine, count); });
+
+                if (history.available() == 0)
+                    direction = 0;
+            }
+
+            if (machine.cpu.trapped)
+                direction = 0;
+
+            // gdb hears about every stop while it has the guest running
+            if (gdb && gdb->running && (machine.cpu.exited() || machine.cpu.trapped || direction <= 0))
+            {
+                direction = 0;
+                gdb->stopped();
+            }
+        }
+        catch (const std::exception& e)
+        {
+            // a guest fault stops execution with pc left on the faulting instruction
+            fprintf(stderr, "%08x: %s\n", machine.cpu.pc, e.what());
+            direction = 0;
+
+            if (gdb && gdb->running)
+                gdb->fault(e);
+        }
+
+        publish();
+        scheduler.wait_frame();
+    }
+}
+
+void Emulator::execute(const Command& command)
+{
+    switch (command.type)
+    {
+    case COMMAND_KEYBOARD:
+    {
+        int8_t keys[2] = { machine.keyboard[0], machine.keyboard[1] };
+        keys[command.axis] = command.value;
+        machine.set_keyboard(keys[0], keys[1]);
+
+        break;
+    }
+    case COMMAND_STEP_BACK:     history.back(machine, 1);                           break;
+    case COMMAND_STEP:
+    {
+        // a waiting guest only moves once something wakes it
+        if (gdb)
+            gdb->step_over();
+        else if (!machine.cpu.ready(0))
+            break;
+        else if (history.enabled())
+            history.step(machine);
+        else
+            machine.cpu.step();
+
+        break;
+    }
+    case COMMAND_RESET:
+    {
+        machine.restore(boot);
+        history.clear();
+        shown = UINT64_MAX;
+
+        break;
+    }
+    case COMMAND_SAVE:
+    {
+        quick = machine.save();
+
+        if (!state_path.empty())
+            write_state(state_path.c_str(), quick);
+
+        break;
+    }
+    case COMMAND_LOAD:
+    {
+        if (!quick.empty())
+        {
+            machine.restore(quick);
+            history.clear();
+            shown = UINT64_MAX;
+        }
+
+        break;
+    }
+    case COMMAND_PROFILE:
+    {
+        machine.cpu.profile = machine.cpu.profile ? nullptr : &profiler;
+
+        break;
+    }
+    case COMMAND_TOGGLE_RUN:
+    {
+        direction = direction > 0 ? 0 : 1;
+        scheduler.start();
+
+        // off the breakpoint or past the watched access first
+        if (direction > 0 && gdb && machine.cpu.trapped)
+            gdb->step_over();
+
+        break;
+    }
+    case COMMAND_TOGGLE_REVERSE:
+    {
+        direction = direction < 0 ? 0 : -1;
+        scheduler.start();
+
+        break;
+    }
+    }
+}
+
+// packets are handled between frames, gdb resuming or interrupting the
+// guest moves it in the same direction as the run toggle
+void Emulator::poll_gdb()
+{
+    bool running = gdb->running;
+
+    if (!gdb->poll(direction == 0 && !running ? GDB_WAIT : 0))
+    {
+        gdb.reset();
+        return;
+    }
+
+    if (gdb->running != running)
+    {
+        direction = gdb->running ? 1 : 0;
+        scheduler.start();
+    }
+}
+
+static uint32_t size_at(const CPU& cpu, uint32_t address)
+{
+    return (uint64_t)address + 2 <= cpu.memory_size ? inst_size(cpu.memory[address]) : 2;
+}
+
+// Where the lines of the code view start, pc in the middle. Lengths vary
+// once code is compressed, so the instructions before pc are found by
+// decoding forwards from a little earlier until a run lands on pc.
+static void code_addresses(const CPU& cpu, uint32_t pc, uint32_t* addresses)
+{
+    const int before = SNAPSHOT_CODE / 2;
+
+    for (int i = 0; i < before; i++)
+        addresses[i] = pc - (before - i) * 4;
+
+    for (uint32_t start = pc - before * 4; start != pc; start += 2)
+    {
+        uint32_t run[SNAPSHOT_CODE * 2];
+        int length = 0;
+        uint32_t address = start;
+
+        while (address < pc && length < SNAPSHOT_CODE * 2)
+        {
+            run[length++] = address;
+            address += size_at(cpu, address);
+        }
+
+        if (address == pc && length >= before)
+        {
+            std::copy(run + length - before, run + length, addresses);
+            break;
+        }
+    }
+
+    addresses[before] = pc;
+
+    for (int i = before + 1; i < SNAPSHOT_CODE; i++)
+        addresses[i] = addresses[i - 1] + size_at(cpu, addresses[i - 1]);
+}
+
+void Emulator::publish()
+{
+    Snapshot& snapshot = snapshots.back();
+    CPU& cpu = machine.cpu;
+
+    snapshot.sequence = ++sequence;
+
+    memcpy(snapshot.x, cpu.x, sizeof(snapshot.x));
+    snapshot.pc = cpu.pc;
+    snapshot.dirty = cpu.dirty;
+    snapshot.running = direction != 0;
+    snapshot.mips = direction != 0 ? scheduler.mips : 0;
+    snapshot.history = history.available();
+
+    uint32_t addresses[SNAPSHOT_CODE];
+
+    code_addresses(cpu, cpu.pc, addresses);
+
+    for (int i = 0; i < SNAPSHOT_CODE; i++)
+    {
+        uint32_t address = addresses[i];
+
+        if (address <= cpu.memory_size - 4)
+            disassemble(*((uint32_t*)&cpu.memory[address]), snapshot.code[i], DISASSEMBLY_SIZE, address, &machine.program.symbols);
+        else
+            snapshot.code[i][0] = 0;
+
+        snapshot.code_heat[i] = profiler.heat(address);
+        snapshot.code_hits[i] = profiler.count(address);
+    }
+
+    snapshot.memory_view = std::min<uint64_t>(memory_view, cpu.memory_size);
+    snapshot.memory_length = std::min<uint64_t>(SNAPSHOT_MEMORY, cpu.memory_size - snapshot.memory_view);
+    memcpy(snapshot.memory, &cpu.memory[snapshot.memory_view], snapshot.memory_length);
+
+    snapshot.function = machine.program.symbols.label(cpu.pc);
+
+    for (uint32_t i = 0; i < SNAPSHOT_MEMORY / 16; i++)
+    {
+        const Symbol* symbol = machine.program.symbols.first_in(snapshot.memory_view + i * 16, snapshot.memory_view + i * 16 + 16);
+        snapshot.memory_labels[i] = symbol ? symbol->name : "";
+    }
+
+    snapshot.profiling = cpu.profile != nullptr;
+
+    for (uint32_t i = 0; i < SNAPSHOT_MEMORY / 4; i++)
+    {
+        uint32_t address = (snapshot.memory_view & ~3) + i * 4;
+
+        snapshot.heat[i] = std::max(profiler.heat(address), profiler.heat(address + 2));
+    }
+
+    Framebuffer& screen = machine.screen;
+
+    // running forwards a guest that presents its frames is only ever seen
+    // between them, paused it is seen as it is
+    bool whole = machine.frames != 0 && direction > 0;
+
+    snapshot.screen_first = 1;
+    snapshot.screen_last = 0;
+
+    if (!whole || machine.frames != shown)
+    {
+        frame.assign(screen.pixels, screen.pixels + screen.size());
+        screen.take_dirty(snapshot.screen_first, snapshot.screen_last);
+        shown = machine.frames;
+    }
+
+    snapshot.screen = frame;
+
+    snapshots.publish();
+}
@@ -0,0 +1,44 @@
+#include <framebuffer.h>
+#include <algorithm>
+
+void Framebuffer::attach(Bus& bus, uint32_t address)
+{
+    pixels = &bus.memory[address];
+    lines = &bus.dirty[address >> BUS_LINE_SHIFT];
+    all = true;
+}
+
+bool Framebuffer::take_dirty(uint32_t& first, uint32_t& last)
+{
+    uint32_t count = (size() + (1 << BUS_LINE_SHIFT) - 1) >> BUS_LINE_SHIFT;
+
+    if (all)
+    {
+        first = 0;
+        last = height - 1;
+    }
+    else
+    {
+        uint32_t begin = 0;
+        uint32_t end = count;
+
+        while (begin < count && (lines[begin] & DIRTY_SCREEN) == 0)
+            begin++;
+
+        if (begin == count)
+            return false;
+
+        while ((lines[end - 1] & DIRTY_SCREEN) == 0)
+            end--;
+
+        first = (begin << BUS_LINE_SHIFT) / width;
+        last = std::min((end << BUS_LINE_SHIFT) - 1, size() - 1) / width;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        lines[i] &= ~DIRTY_SCREEN;
+
+    all = false;
+
+    return true;
+}
@@ -0,0 +1,822 @@
+#include <gdb.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+// a big-endian hex number as used for addresses and lengths, pos ends up
+// on the first character that is not a digit
+static uint32_t parse_hex(const std::string& text, size_t& pos)
+{
+    uint32_t value = 0;
+
+    while (pos < text.size() && hex_digit(text[pos]) >= 0)
+        value = value << 4 | hex_digit(text[pos++]);
+
+    return value;
+}
+
+// registers go over the wire as target-order bytes, little-endian here
+static std::string hex_register(uint32_t value)
+{
+    return fmt("%02x%02x%02x%02x", value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24);
+}
+
+static bool parse_register(const std::string& text, size_t pos, uint32_t& value)
+{
+    if (pos + 8 > text.size())
+        return false;
+
+    value = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        int high = hex_digit(text[pos + i * 2]);
+        int low = hex_digit(text[pos + i * 2 + 1]);
+
+        if (high < 0 || low < 0)
+            return false;
+
+        value |= (uint32_t)(high << 4 | low) << (i * 8);
+    }
+
+    return true;
+}
+
+// RAM whether or not the guest touched it yet, never a device
+static bool is_memory(const Bus& bus, uint32_t address)
+{
+    uint8_t page = bus.pages[address >> PAGE_SHIFT];
+
+    return page == BUS_RAM || page == BUS_ABSENT || page == BUS_WATCHED;
+}
+
+static const char* reg_type(int index)
+{
+    switch (index)
+    {
+    case 1:     return "code_ptr";
+    case 2:     return "data_ptr";
+    case 3:     return "data_ptr";
+    case 32:    return "code_ptr";
+
+    default: return "int";
+    }
+}
+
+GdbStub::GdbStub(Machine& _machine) : machine(_machine)
+{
+    stop_reply = fmt("S%02x", GDB_SIGTRAP);
+
+    machine.cpu.bus.on_watch = [this](const Watchpoint& watchpoint, uint32_t address)
+    {
+        watch_hit = true;
+        watch = watchpoint;
+        watch_address = address;
+
+        machine.cpu.halted = true;
+        machine.cpu.trapped = true;
+    };
+}
+
+GdbStub::~GdbStub()
+{
+    detach();
+    close();
+
+    machine.cpu.bus.on_watch = nullptr;
+}
+
+bool GdbStub::open(const char* address)
+{
+    std::string text = address;
+    bool local = text.find('/') != std::string::npos;
+    int listener = -1;
+
+    if (local)
+    {
+        sockaddr_un name = {};
+        name.sun_family = AF_UNIX;
+
+        if (text.size() < sizeof(name.sun_path))
+        {
+            strcpy(name.sun_path, address);
+            unlink(address);
+
+            listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+            if (listener >= 0 && bind(listener, (sockaddr*)&name, sizeof(name)) != 0)
+            {
+                ::close(listener);
+                listener = -1;
+            }
+        }
+    }
+    else
+    {
+        // a bare port listens on loopback only, an empty host on everything
+        size_t colon = text.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : text.substr(0, colon);
+        std::string port = colon == std::string::npos ? text : text.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        addrinfo* found = nullptr;
+
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) == 0)
+        {
+            for (addrinfo* i = found; i != nullptr && listener < 0; i = i->ai_next)
+            {
+                listener = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+
+                int reuse = 1;
+
+                if (listener >= 0)
+                    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+                if (listener >= 0 && bind(listener, i->ai_addr, i->ai_addrlen) != 0)
+                {
+                    ::close(listener);
+                    listener = -1;
+                }
+            }
+
+            freeaddrinfo(found);
+        }
+    }
+
+    if (listener < 0 || listen(listener, 1) != 0)
+    {
+        fprintf(stderr, "Could not listen on `%s`\n", address);
+
+        if (listener >= 0)
+            ::close(listener);
+
+        return false;
+    }
+
+    fprintf(stderr, "Waiting for gdb on %s\n", address);
+
+    do
+        fd = accept(listener, nullptr, nullptr);
+    while (fd < 0 && errno == EINTR);
+
+    ::close(listener);
+
+    if (local)
+        unlink(address);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not accept gdb on `%s`\n", address);
+        return false;
+    }
+
+    // replies are small and gdb waits for each one
+    int nodelay = 1;
+
+    if (!local)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    ack = true;
+    input.clear();
+
+    return true;
+}
+
+void GdbStub::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+
+    fd = -1;
+    running = false;
+}
+
+// leaves the guest as it would have been without the debugger
+void GdbStub::detach()
+{
+    CPU& cpu = machine.cpu;
+
+    for (const auto& entry : breakpoints)
+        cpu.set_breakpoint(entry.first, false);
+
+    breakpoints.clear();
+
+    while (!cpu.bus.watchpoints.empty())
+    {
+        Watchpoint watchpoint = cpu.bus.watchpoints.back();
+        cpu.bus.unwatch(watchpoint.address, watchpoint.size, watchpoint.kind);
+    }
+
+    if (cpu.trapped)
+        cpu.halted = cpu.trapped = false;
+
+    watch_hit = false;
+    running = false;
+}
+
+bool GdbStub::poll(int timeout)
+{
+    while (fd >= 0 && !(running && timeout < 0))
+    {
+        pollfd request = { fd, POLLIN, 0 };
+
+        if (::poll(&request, 1, timeout) <= 0)
+            break;
+
+        char buffer[4096];
+        ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+
+        if (length < 0 && errno == EINTR)
+            continue;
+
+        if (length <= 0)
+        {
+            detach();
+            close();
+            break;
+        }
+
+        input.append(buffer, length);
+
+        while (!input.empty() && fd >= 0)
+        {
+            char c = input[0];
+
+            if (c != '$')
+            {
+                input.erase(0, 1);
+
+                // Ctrl-C, acks are only interesting when they ask for a resend
+                if (c == 0x03 && running)
+                    stop(GDB_SIGINT);
+                else if (c == '-' && ack && !sent.empty())
+                    transmit(sent);
+
+                continue;
+            }
+
+            size_t end = input.find('#');
+
+            if (end == std::string::npos || input.size() < end + 3)
+                break;
+
+            std::string packet = input.substr(1, end - 1);
+            int high = hex_digit(input[end + 1]);
+            int low = hex_digit(input[end + 2]);
+            uint8_t sum = 0;
+
+            input.erase(0, end + 3);
+
+            for (char byte : packet)
+                sum += byte;
+
+            if (ack)
+            {
+                if ((high << 4 | low) != sum)
+                {
+                    transmit("-");
+                    continue;
+                }
+
+                transmit("+");
+            }
+
+            handle(packet);
+        }
+
+        if (running)
+            break;
+    }
+
+    return fd >= 0;
+}
+
+void GdbStub::transmit(const std::string& bytes)
+{
+    size_t done = 0;
+
+    while (fd >= 0 && done < bytes.size())
+    {
+        ssize_t length = ::send(fd, bytes.data() + done, bytes.size() - done, MSG_NOSIGNAL);
+
+        if (length < 0 && errno == EINTR)
+            continue;
+
+        if (length <= 0)
+        {
+            close();
+            return;
+        }
+
+        done += length;
+    }
+}
+
+void GdbStub::send(const std::string& packet)
+{
+    uint8_t sum = 0;
+
+    for (char c : packet)
+        sum += c;
+
+    sent = "$" + packet + fmt("#%02x", sum);
+    transmit(sent);
+}
+
+void GdbStub::report(const std::string& reply)
+{
+    stop_reply = reply;
+    send(reply);
+}
+
+void GdbStub::stopped()
+{
+    stop(GDB_SIGINT);
+}
+
+void GdbStub::fault(const std::exception& e)
+{
+    const Fault* fault = dynamic_cast<const Fault*>(&e);
+    int signal = GDB_SIGILL;
+
+    if (fault != nullptr)
+    {
+        switch (fault->cause)
+        {
+        case FAULT_ILLEGAL:             signal = GDB_SIGILL;    break;
+        case FAULT_BREAKPOINT:          signal = GDB_SIGTRAP;   break;
+        case FAULT_FETCH_MISALIGNED:
+        case FAULT_LOAD_MISALIGNED:
+        case FAULT_STORE_MISALIGNED:    signal = GDB_SIGBUS;    break;
+
+        default: signal = GDB_SIGSEGV; break;
+        }
+    }
+
+    running = false;
+    report(fmt("T%02x", signal));
+}
+
+// the reason the CPU gives, or signal when it stopped for none of its own
+void GdbStub::stop(int signal)
+{
+    CPU& cpu = machine.cpu;
+
+    running = false;
+
+    if (cpu.exited())
+        report(fmt("W%02x", cpu.exit_code & 0xff));
+    else if (watch_hit)
+    {
+        const char* kind = watch.kind == WATCH_WRITE ? "watch" : watch.kind == WATCH_READ ? "rwatch" : "awatch";
+
+        report(fmt("T%02x%s:%x;", GDB_SIGTRAP, kind, std::max(watch_address, watch.address)));
+    }
+    else if (cpu.trapped)
+    {
+        auto it = breakpoints.find(cpu.pc);
+        bool software = it != breakpoints.end() && (it->second & GDB_SOFTWARE) != 0;
+
+        report(fmt("T%02x%s:;", GDB_SIGTRAP, software ? "swbreak" : "hwbreak"));
+    }
+    else
+        report(fmt("T%02x", signal));
+}
+
+void GdbStub::step_over()
+{
+    CPU& cpu = machine.cpu;
+
+    if (cpu.trapped)
+        cpu.halted = cpu.trapped = false;
+
+    watch_hit = false;
+
+    // a waiting guest steps to whatever wakes it, or stays
+    if (!cpu.ready(UINT64_MAX))
+        return;
+
+    uint32_t pc = cpu.pc;
+    bool lifted = cpu.has_breakpoint(pc);
+
+    if (lifted)
+        cpu.set_breakpoint(pc, false);
+
+    try
+    {
+        if (history != nullptr && history->enabled())
+            history->step(machine);
+        else
+            cpu.step();
+    }
+    catch (...)
+    {
+        if (lifted)
+            cpu.set_breakpoint(pc, true);
+
+        throw;
+    }
+
+    if (lifted)
+        cpu.set_breakpoint(pc, true);
+}
+
+void GdbStub::resume(bool step)
+{
+    CPU& cpu = machine.cpu;
+
+    // an exited guest stays exited
+    if (cpu.exited())
+        return stop(GDB_SIGTRAP);
+
+    if (cpu.trapped)
+        cpu.halted = cpu.trapped = false;
+
+    watch_hit = false;
+
+    // stepping off a breakpoint first means continuing never stops on it again
+    if (step || cpu.has_breakpoint(cpu.pc))
+    {
+        try
+        {
+            step_over();
+        }
+        catch (const std::exception& e)
+        {
+            return fault(e);
+        }
+
+        if (step || cpu.exited() || cpu.trapped)
+            return stop(GDB_SIGTRAP);
+    }
+
+    running = true;
+}
+
+void GdbStub::reverse(bool step)
+{
+    CPU& cpu = machine.cpu;
+
+    if (history == nullptr || !history->enabled())
+        return send("");
+
+    watch_hit = false;
+
+    bool moved = false;
+
+    while (history->back(machine, 1) == 1)
+    {
+        moved = true;
+
+        if (step || cpu.has_breakpoint(cpu.pc))
+            break;
+    }
+
+    // going back undoes an exit or a trap as well
+    if (moved)
+        cpu.halted = cpu.trapped = false;
+
+    if (history->available() == 0 && !(step && moved))
+        report(fmt("T%02xreplaylog:begin;", GDB_SIGTRAP));
+    else if (cpu.has_breakpoint(cpu.pc) && !step)
+        report(fmt("T%02xswbreak:;", GDB_SIGTRAP));
+    else
+        report(fmt("T%02x", GDB_SIGTRAP));
+}
+
+// Z and z packets, TYPE,ADDRESS,KIND with anything after KIND ignored
+std::string GdbStub::breakpoint(const std::string& packet, bool insert)
+{
+    CPU& cpu = machine.cpu;
+    size_t pos = 1;
+    uint32_t type = parse_hex(packet, pos);
+
+    if (pos >= packet.size() || packet[pos++] != ',')
+        return "E01";
+
+    uint32_t address = parse_hex(packet, pos);
+
+    if (pos >= packet.size() || packet[pos++] != ',')
+        return "E01";
+
+    uint32_t length = parse_hex(packet, pos);
+
+    if (type == 0 || type == 1)
+    {
+        uint8_t kind = type == 0 ? GDB_SOFTWARE : GDB_HARDWARE;
+        auto it = breakpoints.find(address);
+
+        if (insert)
+        {
+            if (it == breakpoints.end())
+                cpu.set_breakpoint(address, true);
+
+            breakpoints[address] |= kind;
+        }
+        else if (it != breakpoints.end() && (it->second &= ~kind) == 0)
+        {
+            breakpoints.erase(it);
+            cpu.set_breakpoint(address, false);
+        }
+
+        return "OK";
+    }
+
+    if (type >= 2 && type <= 4)
+    {
+        uint8_t kind = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_ACCESS;
+
+        if (length == 0 || !is_memory(cpu.bus, address) || !is_memory(cpu.bus, address + length - 1))
+            return "E01";
+
+        if (insert)
+            cpu.bus.watch(address, length, kind);
+        else
+            cpu.bus.unwatch(address, length, kind);
+
+        return "OK";
+    }
+
+    return "";
+}
+
+std::string GdbStub::read_registers()
+{
+    std::string reply;
+
+    for (int i = 0; i < 32; i++)
+        reply += hex_register(machine.cpu.x[i]);
+
+    return reply + hex_register(machine.cpu.pc);
+}
+
+std::string GdbStub::read_memory(uint32_t address, uint32_t length)
+{
+    std::string reply;
+
+    length = std::min<uint32_t>(length, GDB_PACKET_SIZE / 2);
+
+    // a short read where memory ends, gdb only needs the first byte to work
+    for (uint32_t i = 0; i < length && is_memory(machine.cpu.bus, address + i); i++)
+        reply += fmt("%02x", machine.memory[address + i]);
+
+    return reply.empty() && length != 0 ? "E01" : reply;
+}
+
+bool GdbStub::write_memory(uint32_t address, const std::string& hex)
+{
+    CPU& cpu = machine.cpu;
+    uint32_t length = hex.size() / 2;
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        if (!is_memory(cpu.bus, address + i) || hex_digit(hex[i * 2]) < 0 || hex_digit(hex[i * 2 + 1]) < 0)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        uint32_t target = address + i;
+
+        cpu.bus.fault_in(target >> PAGE_SHIFT);
+        machine.memory[target] = hex_digit(hex[i * 2]) << 4 | hex_digit(hex[i * 2 + 1]);
+        cpu.bus.mark_store(target);
+        cpu.invalidate(target);
+    }
+
+    return true;
+}
+
+std::string GdbStub::read_features(const std::string& annex, uint32_t offset, uint32_t length)
+{
+    if (annex != "target.xml")
+        return "E00";
+
+    std::string xml =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\">"
+        "<architecture>riscv:rv32</architecture>"
+        "<feature name=\"org.gnu.gdb.riscv.cpu\">";
+
+    for (int i = 0; i < 32; i++)
+        xml += fmt("<reg name=\"%s\" bitsize=\"32\" type=\"%s\" regnum=\"%d\"/>", reg_name[i], reg_type(i), i);
+
+    xml += fmt("<reg name=\"pc\" bitsize=\"32\" type=\"%s\" regnum=\"32\"/>", reg_type(32));
+    xml += "</feature></target>";
+
+    if (offset >= xml.size())
+        return "l";
+
+    std::string part = xml.substr(offset, length);
+
+    return (offset + part.size() >= xml.size() ? "l" : "m") + part;
+}
+
+void GdbStub::handle(const std::string& packet)
+{
+    CPU& cpu = machine.cpu;
+    size_t pos = 1;
+
+    if (packet.empty())
+        return send("");
+
+    switch (packet[0])
+    {
+    case '?':   return send(stop_reply);
+    case 'g':   return send(read_registers());
+    case 'H':   return send("OK");
+    case 'T':   return send("OK");
+    case 's':
+    case 'c':
+    {
+        if (packet.size() > 1)
+            cpu.pc = parse_hex(packet, pos);
+
+        return resume(packet[0] == 's');
+    }
+    case 'b':
+    {
+        if (packet == "bs" || packet == "bc")
+            return reverse(packet == "bs");
+
+        return send("");
+    }
+    case 'G':
+    {
+        uint32_t values[33];
+
+        for (int i = 0; i < 33; i++)
+        {
+            if (!parse_register(packet, 1 + i * 8, values[i]))
+                return send("E01");
+        }
+
+        std::copy(values + 1, values + 32, cpu.x + 1);
+        cpu.pc = values[32];
+
+        return send("OK");
+    }
+    case 'p':
+    {
+        uint32_t index = parse_hex(packet, pos);
+
+        if (index < 32)
+            return send(hex_register(cpu.x[index]));
+
+        return send(index == 32 ? hex_register(cpu.pc) : "E01");
+    }
+    case 'P':
+    {
+        uint32_t index = parse_hex(packet, pos);
+        uint32_t value;
+
+        if (pos >= packet.size() || packet[pos] != '=' || !parse_register(packet, pos + 1, value) || index > 32)
+            return send("E01");
+
+        if (index == 32)
+            cpu.pc = value;
+        else if (index != 0)
+            cpu.x[index] = value;
+
+        return send("OK");
+    }
+    case 'm':
+    {
+        uint32_t address = parse_hex(packet, pos);
+
+        if (pos >= packet.size() || packet[pos++] != ',')
+            return send("E01");
+
+        return send(read_memory(address, parse_hex(packet, pos)));
+    }
+    case 'M':
+    {
+        uint32_t address = parse_hex(packet, pos);
+        size_t colon = packet.find(':');
+
+        if (colon == std::string::npos)
+            return send("E01");
+
+        return send(write_memory(address, packet.substr(colon + 1)) ? "OK" : "E01");
+    }
+    case 'Z':   return send(breakpoint(packet, true));
+    case 'z':   return send(breakpoint(packet, false));
+    case 'D':
+    {
+        send("OK");
+        detach();
+        close();
+
+        return;
+    }
+    case 'k':
+    {
+        killed = true;
+        detach();
+        close();
+
+        return;
+    }
+    case 'v':
+    {
+        if (packet.compare(0, 5, "vKill") == 0)
+        {
+            killed = true;
+            send("OK");
+            detach();
+            close();
+
+            return;
+        }
+
+        return send("");
+    }
+    case 'Q':
+    {
+        if (packet == "QStartNoAckMode")
+        {
+            send("OK");
+            ack = false;
+
+            return;
+        }
+
+        return send("");
+    }
+    case 'q':
+    {
+        if (packet.compare(0, 10, "qSupported") == 0)
+        {
+            std::string reply = fmt("PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+;QStartNoAckMode+", GDB_PACKET_SIZE);
+
+            if (history != nullptr && history->enabled())
+                reply += ";ReverseStep+;ReverseContinue+";
+
+            return send(reply);
+        }
+
+        const char* features = "qXfer:features:read:";
+
+        if (packet.compare(0, strlen(features), features) == 0)
+        {
+            size_t colon = packet.find(':', strlen(features));
+
+            if (colon == std::string::npos)
+                return send("E00");
+
+            pos = colon + 1;
+
+            uint32_t offset = parse_hex(packet, pos);
+
+            if (pos >= packet.size() || packet[pos++] != ',')
+                return send("E00");
+
+            uint32_t length = parse_hex(packet, pos);
+
+            return send(read_features(packet.substr(strlen(features), colon - strlen(features)), offset, length));
+        }
+
+        if (packet == "qAttached")
+            return send("1");
+
+        if (packet == "qC")
+            return send("QC1");
+
+        if (packet == "qfThreadInfo")
+            return send("m1");
+
+        if (packet == "qsThreadInfo")
+            return send("l");
+
+        return send("");
+    }
+    }
+
+    send("");
+}
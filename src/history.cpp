@@ -0,0 +1,143 @@
+#include <history.h>
+#include <algorithm>
+#include <cstring>
+
+void History::clear()
+{
+    head = 0;
+    count = 0;
+    time = 0;
+    checkpoints.clear();
+}
+
+void History::step(Machine& machine)
+{
+    CPU& cpu = machine.cpu;
+
+    if (journal.size() != capacity)
+        journal.resize(capacity);
+
+    if (time % HISTORY_CHECKPOINT == 0 && (checkpoints.empty() || checkpoints.back().time != time))
+        checkpoints.push_back({ time, machine.save() });
+
+    // the fetch faults or a breakpoint stops in front of it, nothing to record
+    if ((cpu.pc & 1) != 0 || (!cpu.bus.is_ram(cpu.pc) && !cpu.bus.fault_in(cpu.pc >> PAGE_SHIFT)) || cpu.has_breakpoint(cpu.pc))
+    {
+        cpu.step();
+        return;
+    }
+
+    const Decoded& d = cpu.fetch(cpu.pc);
+    JournalEntry entry = { cpu.pc, d.dest, cpu.x[d.dest] };
+
+    if (d.op >= OP_SB && d.op <= OP_SW)
+    {
+        // the whole aligned word, device stores are not rewound
+        uint32_t address = (cpu.x[d.src1] + d.imm) & ~3;
+
+        if (cpu.bus.fault_in(address >> PAGE_SHIFT))
+            entry = { cpu.pc | HISTORY_STORE, address, *((uint32_t*)&cpu.memory[address]) };
+    }
+
+    cpu.step();
+
+    journal[head] = entry;
+    head = (head + 1) % capacity;
+    count = std::min<uint64_t>(count + 1, capacity);
+    time++;
+
+    while (!checkpoints.empty() && checkpoints.front().time < time - count)
+        checkpoints.pop_front();
+}
+
+uint64_t History::run(Machine& machine, uint64_t count)
+{
+    CPU& cpu = machine.cpu;
+    uint64_t start = cpu.time();
+
+    while (cpu.time() - start < count && cpu.ready(count - (cpu.time() - start)))
+    {
+        step(machine);
+
+        if (cpu.paused)
+            break;
+    }
+
+    if (cpu.yielded)
+        cpu.halted = cpu.yielded = false;
+
+    return cpu.time() - start;
+}
+
+uint64_t History::back(Machine& machine, uint64_t count)
+{
+    count = std::min(count, this->count);
+
+    uint64_t target = time - count;
+
+    // restoring a checkpoint is cheaper than undoing a whole interval
+    for (const Checkpoint& checkpoint : checkpoints)
+    {
+        if (checkpoint.time < target)
+            continue;
+
+        if (time - checkpoint.time >= HISTORY_CHECKPOINT)
+        {
+            int8_t keyboard[2] = { machine.keyboard[0], machine.keyboard[1] };
+            std::minstd_rand random = machine.random;
+
+            machine.restore(checkpoint.state);
+
+            machine.keyboard[0] = keyboard[0];
+            machine.keyboard[1] = keyboard[1];
+            machine.random = random;
+
+            uint64_t skipped = time - checkpoint.time;
+
+            head = (head + capacity - skipped % capacity) % capacity;
+            this->count -= skipped;
+            time = checkpoint.time;
+        }
+
+        break;
+    }
+
+    while (time > target)
+        undo(machine);
+
+    // whatever runs next may diverge from the old future
+    while (!checkpoints.empty() && checkpoints.back().time > time)
+        checkpoints.pop_back();
+
+    return count;
+}
+
+void History::undo(Machine& machine)
+{
+    CPU& cpu = machine.cpu;
+
+    head = (head + capacity - 1) % capacity;
+    count--;
+    time--;
+
+    const JournalEntry& entry = journal[head];
+
+    if (entry.pc & HISTORY_STORE)
+    {
+        memcpy(&cpu.memory[entry.where], &entry.old, sizeof(entry.old));
+        cpu.bus.mark_store(entry.where);
+        cpu.invalidate(entry.where);
+        cpu.invalidate(entry.where + 3);
+        cpu.dirty = -1;
+    }
+    else
+    {
+        cpu.x[entry.where] = entry.old;
+        cpu.dirty = entry.where;
+    }
+
+    cpu.x[0] = 0;
+    cpu.pc = entry.pc & ~HISTORY_STORE;
+    cpu.instret--;
+    cpu.halted = cpu.waiting = cpu.paused = false;
+}
@@ -0,0 +1,717 @@
+#include <jit.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+
+// Basic-block translator from RV32IMC to x86-64. While generated code runs,
+// rbx points at the guest registers, r12 at guest memory, r13 holds the
+// remaining instruction budget, r14 the JitContext, r15 the map of guest
+// words that have been translated and rbp the bus page table, which is
+// followed by its dirty lines and stored bytes. Blocks jump straight into
+// each other once chained; anything unusual returns to run(), which falls
+// back to the interpreter. A store over translated code flushes the whole
+// cache, and the first store to a page since it was last taken leaves the
+// block for run() to list the page as changed.
+
+#define RAX     0
+#define RCX     1
+#define RDX     2
+
+#define ALU_ADD     0
+#define ALU_OR      1
+#define ALU_AND     4
+#define ALU_SUB     5
+#define ALU_XOR     6
+#define ALU_CMP     7
+
+#define SHIFT_SHL   4
+#define SHIFT_SHR   5
+#define SHIFT_SAR   7
+
+#define CC_B        0x2
+#define CC_AE       0x3
+#define CC_E        0x4
+#define CC_NE       0x5
+#define CC_L        0xC
+#define CC_GE       0xD
+
+Jit::Jit(CPU& _cpu) : cpu(_cpu), code_map((_cpu.memory_size >> JIT_MAP_SHIFT) + 1)
+{
+    code = (uint8_t*)mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code == MAP_FAILED)
+        throw std::runtime_error("Could not allocate JIT code buffer");
+
+    ctx.memory = cpu.memory;
+    ctx.x = cpu.x;
+    ctx.code_map = code_map.data();
+    ctx.pages = cpu.bus.pages.data();
+    ctx.cpu = &cpu;
+    ctx.store = 0;
+    ctx.flush = 0;
+    ctx.step = 0;
+    ctx.check = 0;
+
+    code_used = 0;
+    emit_trampoline();
+    code_start = code_used;
+
+    // whatever other engines decoded is missing from the map
+    cpu.forget_decoded();
+}
+
+Jit::~Jit()
+{
+    munmap(code, JIT_CODE_SIZE);
+}
+
+uint64_t Jit::run(uint64_t count)
+{
+#if !defined(__x86_64__)
+    return run_threaded(cpu, count);
+#endif
+
+    ctx.budget = count;
+
+    uint64_t retired = cpu.instret;
+
+    while (ctx.budget > 0 && !cpu.halted)
+    {
+        // generated stores bypass CPU::store, so drop the decoded copy too,
+        // which flushes if the store hit translated code
+        if (ctx.check)
+        {
+            ctx.check = 0;
+            cpu.bus.mark_changed(ctx.store >> PAGE_SHIFT);
+            cpu.invalidate(ctx.store);
+            cpu.invalidate(ctx.store + 3);
+        }
+
+        if (ctx.flush)
+            flush();
+
+        // a guarded load or store left its block to fault in the interpreter
+        const Block* block = ctx.step ? nullptr : lookup(cpu.pc);
+        ctx.step = 0;
+
+        if (block == nullptr || ctx.budget < block->length)
+        {
+            cpu.instret = retired + count - ctx.budget;
+            cpu.advance();
+            ctx.budget = count - (cpu.instret - retired);
+            continue;
+        }
+
+        ctx.patch = nullptr;
+        enter(&ctx, block->entry);
+        cpu.pc = ctx.pc;
+
+        if (ctx.patch == nullptr || ctx.flush)
+            continue;
+
+        // chain the exit we just took straight into its successor
+        uint64_t before = generation;
+        const Block* next = lookup(cpu.pc);
+
+        if (next != nullptr && generation == before)
+            patch(ctx.patch, next->entry);
+    }
+
+    cpu.dirty = -1;
+    cpu.instret = retired + count - ctx.budget;
+
+    return count - ctx.budget;
+}
+
+void Jit::invalidate(uint32_t address)
+{
+    if (address < cpu.memory_size && code_map[address >> JIT_MAP_SHIFT])
+        ctx.flush = 1;
+}
+
+// both halfwords, as long as the instruction may be
+void Jit::decoded(uint32_t address)
+{
+    code_map[address >> JIT_MAP_SHIFT] = 1;
+    code_map[(address + 2) >> JIT_MAP_SHIFT] = 1;
+}
+
+void Jit::invalidate_page(uint32_t address)
+{
+    uint32_t first = (address & ~(PAGE_SIZE - 1)) >> JIT_MAP_SHIFT;
+    uint32_t last = first + (PAGE_SIZE >> JIT_MAP_SHIFT);
+
+    if (address < cpu.memory_size && std::find(&code_map[first], &code_map[last], 1) != &code_map[last])
+        ctx.flush = 1;
+}
+
+const Block* Jit::lookup(uint32_t pc)
+{
+    auto it = blocks.find(pc);
+
+    if (it != blocks.end())
+        return &it->second;
+
+    return translate(pc);
+}
+
+const Block* Jit::translate(uint32_t pc)
+{
+    if ((pc & 1) != 0 || !cpu.bus.is_ram(pc))
+        return nullptr;
+
+    Decoded insts[JIT_MAX_BLOCK];
+    uint32_t addresses[JIT_MAX_BLOCK];
+    uint32_t length = 0;
+    uint32_t end = pc;
+    bool terminated = false;
+
+    for (uint32_t address = pc; length < JIT_MAX_BLOCK && address < cpu.memory_size; address += insts[length - 1].size)
+    {
+        if (length > 0 && (address >> PAGE_SHIFT) != (pc >> PAGE_SHIFT))
+            break;
+
+        const Decoded& d = cpu.fetch(address);
+
+        if (d.op == OP_REFERENCE)
+            break;
+
+        addresses[length] = address;
+        insts[length++] = d;
+        end = address + d.size;
+
+        if (d.op == OP_JAL || d.op == OP_JALR || (d.op >= OP_BEQ && d.op <= OP_BGEU))
+        {
+            terminated = true;
+            break;
+        }
+    }
+
+    if (length == 0)
+        return nullptr;
+
+    if (code_used + JIT_CODE_SLACK > JIT_CODE_SIZE)
+        flush();
+
+    uint8_t* entry = code + code_used;
+
+    // not enough budget left for the whole block, let run() single step
+    emit({ 0x49, 0x81, 0xFD });                         // cmp r13, length
+    emit32(length);
+    emit({ 0x7D, 12 });                                 // jge body
+    emit({ 0xB8 });                                     // mov eax, pc
+    emit32(pc);
+    emit({ 0x31, 0xD2 });                               // xor edx, edx
+    emit({ 0xE9 });                                     // jmp exit
+    emit_rel32(exit);
+    emit({ 0x49, 0x81, 0xED });                         // body: sub r13, length
+    emit32(length);
+
+    for (uint32_t i = 0; i < length; i++)
+        emit_instruction(insts[i], addresses[i], i, length);
+
+    if (!terminated)
+        emit_chain(end);
+
+    emit_slow_paths(length);
+
+    std::fill(&code_map[pc >> JIT_MAP_SHIFT], &code_map[((end - 1) >> JIT_MAP_SHIFT) + 1], 1);
+
+    return &(blocks[pc] = { entry, length });
+}
+
+// a store that missed the map would otherwise leave a stale instruction
+// decoded, for the next translation to pick up
+void Jit::flush()
+{
+    blocks.clear();
+    code_map.clear();
+    cpu.forget_decoded();
+
+    code_used = code_start;
+    ctx.flush = 0;
+    generation++;
+}
+
+void Jit::patch(uint8_t* site, uint8_t* target)
+{
+    int32_t rel = target - (site + 5);
+    memcpy(site + 1, &rel, 4);
+}
+
+void Jit::emit_trampoline()
+{
+    enter = (void (*)(JitContext*, uint8_t*))(code + code_used);
+
+    emit({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });   // push rbx, rbp, r12-r15
+    emit({ 0x48, 0x83, 0xEC, 0x08 });                                       // sub rsp, 8
+    emit({ 0x49, 0x89, 0xFE });                                             // mov r14, rdi
+    emit({ 0x49, 0x8B, 0x5E, offsetof(JitContext, x) });                    // mov rbx, [r14 + x]
+    emit({ 0x4D, 0x8B, 0x66, offsetof(JitContext, memory) });               // mov r12, [r14 + memory]
+    emit({ 0x4D, 0x8B, 0x6E, offsetof(JitContext, budget) });               // mov r13, [r14 + budget]
+    emit({ 0x4D, 0x8B, 0x7E, offsetof(JitContext, code_map) });             // mov r15, [r14 + code_map]
+    emit({ 0x49, 0x8B, 0x6E, offsetof(JitContext, pages) });                // mov rbp, [r14 + pages]
+    emit({ 0xFF, 0xE6 });                                                   // jmp rsi
+
+    exit = code + code_used;
+
+    emit({ 0x41, 0x89, 0x46, offsetof(JitContext, pc) });                   // mov [r14 + pc], eax
+    emit({ 0x4D, 0x89, 0x6E, offsetof(JitContext, budget) });               // mov [r14 + budget], r13
+    emit({ 0x49, 0x89, 0x56, offsetof(JitContext, patch) });                // mov [r14 + patch], rdx
+    emit({ 0x48, 0x83, 0xC4, 0x08 });                                       // add rsp, 8
+    emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B });   // pop r15-r12, rbp, rbx
+    emit({ 0xC3 });                                                         // ret
+}
+
+// jumps to the block at target once run() has patched the site, until then
+// falls through to a stub that returns the site and target to run()
+void Jit::emit_chain(uint32_t target)
+{
+    uint8_t* site = code + code_used;
+
+    emit({ 0xE9, 0, 0, 0, 0 });                         // jmp next
+    emit({ 0xB8 });                                     // mov eax, target
+    emit32(target);
+    emit({ 0x48, 0x8D, 0x15 });                         // lea rdx, [site]
+    emit32(site - (code + code_used + 4));
+    emit({ 0xE9 });                                     // jmp exit
+    emit_rel32(exit);
+}
+
+// device loads and stores called from generated code, 0 sends the access to
+// the interpreter so it can fault, or to have instret right for a timed
+// device, 2 leaves the block after the guest halted
+int jit_load(JitContext* ctx, uint32_t address, uint32_t op_dest)
+{
+    uint8_t op = op_dest;
+    uint8_t dest = op_dest >> 8;
+    uint32_t value;
+
+    if (ctx->cpu->bus.is_timed(address) || !ctx->cpu->bus.read_device(address, op == OP_LW ? 4 : op == OP_LH || op == OP_LHU ? 2 : 1, value))
+        return 0;
+
+    if (op == OP_LB)
+        value = (int8_t)value;
+    else if (op == OP_LH)
+        value = (int16_t)value;
+
+    if (dest)
+        ctx->x[dest] = value;
+
+    return 1;
+}
+
+int jit_store(JitContext* ctx, uint32_t address, uint32_t size, uint32_t value)
+{
+    if (size < 4)
+        value &= (1 << (8 * size)) - 1;
+
+    if (ctx->cpu->bus.is_timed(address) || !ctx->cpu->bus.write_device(address, size, value))
+        return 0;
+
+    return ctx->cpu->halted ? 2 : 1;
+}
+
+// checks that the access at eax is aligned and to plain RAM, anything else
+// jumps to an out of line stub emitted after the block
+void Jit::emit_guard(const Decoded& d, uint8_t size, uint32_t pc, uint32_t index)
+{
+    SlowPath slow = { { nullptr, nullptr }, index, pc, d.size, d.op, d.dest, d.src2, nullptr };
+
+    emit({ 0x89, 0xC2 });                                                   // mov edx, eax
+    emit({ 0xC1, 0xEA, PAGE_SHIFT });                                       // shr edx, PAGE_SHIFT
+    emit({ 0x80, 0x7C, 0x15, 0x00, BUS_RAM });                              // cmp byte [rbp + rdx], BUS_RAM
+    emit({ 0x0F, 0x85 });                                                   // jne slow
+    slow.sites[0] = code + code_used;
+    emit32(0);
+
+    if (size > 1)
+    {
+        emit({ 0xA8, (uint8_t)(size - 1) });                                // test al, size - 1
+        emit({ 0x0F, 0x85 });                                               // jne slow
+        slow.sites[1] = code + code_used;
+        emit32(0);
+    }
+
+    slow_paths.push_back(slow);
+}
+
+// devices are called directly, everything else is single stepped by run()
+void Jit::emit_slow_paths(uint32_t length)
+{
+    for (const SlowPath& slow : slow_paths)
+    {
+        bool store = slow.op >= OP_SB && slow.op <= OP_SW;
+
+        for (uint8_t* site : slow.sites)
+        {
+            int32_t rel = (code + code_used) - (site + 4);
+
+            if (site != nullptr)
+                memcpy(site, &rel, 4);
+        }
+
+        emit({ 0x4C, 0x89, 0xF7 });                                         // mov rdi, r14
+        emit({ 0x89, 0xC6 });                                               // mov esi, eax
+        emit({ 0xBA });                                                     // mov edx, size or op | dest << 8
+
+        if (store)
+        {
+            emit32(slow.op == OP_SB ? 1 : slow.op == OP_SH ? 2 : 4);
+            load_reg(RCX, slow.src2);
+        }
+        else
+            emit32(slow.op | slow.dest << 8);
+
+        emit({ 0x48, 0xB8 });                                               // mov rax, helper
+        emit64(store ? (uint64_t)&jit_store : (uint64_t)&jit_load);
+        emit({ 0xFF, 0xD0 });                                               // call rax
+        emit({ 0x83, 0xF8, 0x01 });                                         // cmp eax, 1
+        emit({ 0x0F, 0x84 });                                               // je resume
+        emit_rel32(slow.resume);
+
+        if (store)
+            emit({ 0x77, 24 });                                             // ja halted
+
+        emit({ 0x41, 0xC6, 0x46, offsetof(JitContext, step), 1 });          // mov byte [r14 + step], 1
+        emit({ 0x49, 0x81, 0xC5 });                                         // add r13, unexecuted
+        emit32(length - slow.index);
+        emit({ 0xB8 });                                                     // mov eax, pc
+        emit32(slow.pc);
+        emit({ 0x31, 0xD2 });                                               // xor edx, edx
+        emit({ 0xE9 });                                                     // jmp exit
+        emit_rel32(exit);
+
+        if (store)
+        {
+            emit({ 0x49, 0x81, 0xC5 });                                     // halted: add r13, unexecuted
+            emit32(length - slow.index - 1);
+            emit({ 0xB8 });                                                 // mov eax, next pc
+            emit32(slow.pc + slow.size);
+            emit({ 0x31, 0xD2 });                                           // xor edx, edx
+            emit({ 0xE9 });                                                 // jmp exit
+            emit_rel32(exit);
+        }
+    }
+
+    slow_paths.clear();
+}
+
+void Jit::emit_instruction(const Decoded& d, uint32_t pc, uint32_t index, uint32_t length)
+{
+    int alu = -1;
+    int shift = -1;
+    int cc = -1;
+
+    switch (d.op)
+    {
+    case OP_LUI:    if (d.dest) { emit({ 0xC7, 0x43, (uint8_t)(4 * d.dest) }); emit32(d.imm); }         return;
+    case OP_AUIPC:  if (d.dest) { emit({ 0xC7, 0x43, (uint8_t)(4 * d.dest) }); emit32(pc + d.imm); }    return;
+    case OP_JAL:
+    {
+        if (d.dest)
+        {
+            emit({ 0xC7, 0x43, (uint8_t)(4 * d.dest) });                    // mov [rd], next pc
+            emit32(pc + d.size);
+        }
+
+        emit_chain(pc + d.imm);
+        return;
+    }
+    case OP_JALR:
+    {
+        load_reg(RAX, d.src1);
+        emit({ 0x05 });                                                     // add eax, imm
+        emit32(d.imm);
+        emit({ 0x83, 0xE0, 0xFE });                                         // and eax, ~1
+
+        if (d.dest)
+        {
+            emit({ 0xC7, 0x43, (uint8_t)(4 * d.dest) });                    // mov [rd], next pc
+            emit32(pc + d.size);
+        }
+
+        emit({ 0x31, 0xD2 });                                               // xor edx, edx
+        emit({ 0xE9 });                                                     // jmp exit
+        emit_rel32(exit);
+        return;
+    }
+
+    case OP_BEQ:    cc = CC_E;      break;
+    case OP_BNE:    cc = CC_NE;     break;
+    case OP_BLT:    cc = CC_L;      break;
+    case OP_BGE:    cc = CC_GE;     break;
+    case OP_BLTU:   cc = CC_B;      break;
+    case OP_BGEU:   cc = CC_AE;     break;
+
+    case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+    {
+        load_reg(RAX, d.src1);
+        emit({ 0x05 });                                                     // add eax, imm
+        emit32(d.imm);
+        emit_guard(d, d.op == OP_LW ? 4 : d.op == OP_LH || d.op == OP_LHU ? 2 : 1, pc, index);
+
+        switch (d.op)
+        {
+        case OP_LB:     emit({ 0x41, 0x0F, 0xBE, 0x04, 0x04 });     break;  // movsx eax, byte [r12 + rax]
+        case OP_LH:     emit({ 0x41, 0x0F, 0xBF, 0x04, 0x04 });     break;  // movsx eax, word [r12 + rax]
+        case OP_LW:     emit({ 0x41, 0x8B, 0x04, 0x04 });           break;  // mov eax, [r12 + rax]
+        case OP_LBU:    emit({ 0x41, 0x0F, 0xB6, 0x04, 0x04 });     break;  // movzx eax, byte [r12 + rax]
+        case OP_LHU:    emit({ 0x41, 0x0F, 0xB7, 0x04, 0x04 });     break;  // movzx eax, word [r12 + rax]
+        }
+
+        store_reg(RAX, d.dest);
+        slow_paths.back().resume = code + code_used;
+        return;
+    }
+
+    case OP_SB: case OP_SH: case OP_SW:
+    {
+        uint8_t size = d.op == OP_SB ? 1 : d.op == OP_SH ? 2 : 4;
+
+        load_reg(RAX, d.src1);
+        emit({ 0x05 });                                                     // add eax, imm
+        emit32(d.imm);
+        emit_guard(d, size, pc, index);
+        load_reg(RCX, d.src2);
+
+        switch (d.op)
+        {
+        case OP_SB:     emit({ 0x41, 0x88, 0x0C, 0x04 });           break;  // mov [r12 + rax], cl
+        case OP_SH:     emit({ 0x66, 0x41, 0x89, 0x0C, 0x04 });     break;  // mov [r12 + rax], cx
+        case OP_SW:     emit({ 0x41, 0x89, 0x0C, 0x04 });           break;  // mov [r12 + rax], ecx
+        }
+
+        emit({ 0x89, 0xC2 });                                               // mov edx, eax
+        emit({ 0xC1, 0xEA, BUS_LINE_SHIFT });                               // shr edx, BUS_LINE_SHIFT
+        emit({ 0xC6, 0x84, 0x15 });                                         // mov byte [rbp + rdx + dirty], DIRTY_ALL
+        emit32(BUS_PAGES);
+        emit({ DIRTY_ALL });
+
+        // leave the block if the page was unchanged or the store hit
+        // translated code, run() sorts out which
+        emit({ 0x89, 0xC2 });                                               // mov edx, eax
+        emit({ 0xC1, 0xEA, PAGE_SHIFT });                                   // shr edx, PAGE_SHIFT
+        emit({ 0x80, 0xBC, 0x15 });                                         // cmp byte [rbp + rdx + stored], 0
+        emit32(BUS_PAGES + (cpu.memory_size >> BUS_LINE_SHIFT));
+        emit({ 0 });
+        emit({ 0x74, 24 });                                                 // je leave
+        emit({ 0x8D, 0x50, (uint8_t)(size - 1) });                          // lea edx, [rax + size - 1]
+        emit({ 0x89, 0xC6 });                                               // mov esi, eax
+        emit({ 0xC1, 0xEE, JIT_MAP_SHIFT });                                // shr esi, JIT_MAP_SHIFT
+        emit({ 0xC1, 0xEA, JIT_MAP_SHIFT });                                // shr edx, JIT_MAP_SHIFT
+        emit({ 0x41, 0x0F, 0xB6, 0x34, 0x37 });                             // movzx esi, byte [r15 + rsi]
+        emit({ 0x41, 0x0A, 0x34, 0x17 });                                   // or sil, [r15 + rdx]
+        emit({ 0x85, 0xF6 });                                               // test esi, esi
+        emit({ 0x74, 28 });                                                 // je done
+        emit({ 0x41, 0x89, 0x46, offsetof(JitContext, store) });            // leave: mov [r14 + store], eax
+        emit({ 0x41, 0xC6, 0x46, offsetof(JitContext, check), 1 });         // mov byte [r14 + check], 1
+        emit({ 0x49, 0x81, 0xC5 });                                         // add r13, unexecuted
+        emit32(length - index - 1);
+        emit({ 0xB8 });                                                     // mov eax, next pc
+        emit32(pc + d.size);
+        emit({ 0x31, 0xD2 });                                               // xor edx, edx
+        emit({ 0xE9 });                                                     // jmp exit
+        emit_rel32(exit);
+
+        slow_paths.back().resume = code + code_used;
+        return;
+    }
+
+    case OP_ADDI:   alu = ALU_ADD;      break;
+    case OP_XORI:   alu = ALU_XOR;      break;
+    case OP_ORI:    alu = ALU_OR;       break;
+    case OP_ANDI:   alu = ALU_AND;      break;
+    case OP_SLLI:   shift = SHIFT_SHL;  break;
+    case OP_SRLI:   shift = SHIFT_SHR;  break;
+    case OP_SRAI:   shift = SHIFT_SAR;  break;
+    case OP_SLTI:   cc = CC_L;          break;
+    case OP_SLTIU:  cc = CC_B;          break;
+
+    case OP_ADD:    alu = ALU_ADD;      break;
+    case OP_SUB:    alu = ALU_SUB;      break;
+    case OP_XOR:    alu = ALU_XOR;      break;
+    case OP_OR:     alu = ALU_OR;       break;
+    case OP_AND:    alu = ALU_AND;      break;
+    case OP_SLL:    shift = SHIFT_SHL;  break;
+    case OP_SRL:    shift = SHIFT_SHR;  break;
+    case OP_SRA:    shift = SHIFT_SAR;  break;
+    case OP_SLT:    cc = CC_L;          break;
+    case OP_SLTU:   cc = CC_B;          break;
+
+    case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+    case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+        break;
+
+    default: return;
+    }
+
+    if (d.op >= OP_BEQ && d.op <= OP_BGEU)
+    {
+        load_reg(RAX, d.src1);
+        load_reg(RCX, d.src2);
+        emit({ 0x39, 0xC8 });                                               // cmp eax, ecx
+        emit({ 0x0F, (uint8_t)(0x80 | cc) });                               // jcc taken
+        uint8_t* jcc = code + code_used;
+        emit32(0);
+
+        emit_chain(pc + d.size);
+
+        int32_t rel = (code + code_used) - (jcc + 4);
+        memcpy(jcc, &rel, 4);
+
+        emit_chain(pc + d.imm);
+        return;
+    }
+
+    // the remaining instructions only write rd
+    if (d.dest == 0)
+        return;
+
+    bool immediate = d.op >= OP_ADDI && d.op <= OP_SRAI;
+
+    load_reg(RAX, d.src1);
+
+    if (!immediate)
+        load_reg(RCX, d.src2);
+
+    if (alu >= 0 && immediate)
+    {
+        emit({ 0x81, (uint8_t)(0xC0 | alu << 3) });                         // op eax, imm
+        emit32(d.imm);
+    }
+    else if (alu >= 0)
+        emit({ (uint8_t)(alu << 3 | 1), 0xC8 });                            // op eax, ecx
+    else if (shift >= 0 && immediate)
+        emit({ 0xC1, (uint8_t)(0xC0 | shift << 3), (uint8_t)d.imm });       // shift eax, imm
+    else if (shift >= 0)
+        emit({ 0xD3, (uint8_t)(0xC0 | shift << 3) });                       // shift eax, cl
+    else if (cc < 0)
+        emit_muldiv(d.op);
+    else
+    {
+        if (immediate)
+        {
+            emit({ 0x3D });                                                 // cmp eax, imm
+            emit32(d.imm);
+        }
+        else
+            emit({ 0x39, 0xC8 });                                           // cmp eax, ecx
+
+        emit({ 0x0F, (uint8_t)(0x90 | cc), 0xC0 });                         // setcc al
+        emit({ 0x0F, 0xB6, 0xC0 });                                         // movzx eax, al
+    }
+
+    store_reg(RAX, d.dest);
+    return;
+}
+
+// eax op ecx into eax, the divisions branch around the cases where x86
+// would raise #DE: zero divisors and INT_MIN / -1
+void Jit::emit_muldiv(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_MUL:
+        emit({ 0x0F, 0xAF, 0xC1 });                                         // imul eax, ecx
+        return;
+    case OP_MULH:
+    case OP_MULHSU:
+    case OP_MULHU:
+        if (op != OP_MULHU)
+            emit({ 0x48, 0x63, 0xC0 });                                     // movsxd rax, eax
+        if (op == OP_MULH)
+            emit({ 0x48, 0x63, 0xC9 });                                     // movsxd rcx, ecx
+        emit({ 0x48, 0x0F, 0xAF, 0xC1 });                                   // imul rax, rcx
+        emit({ 0x48, 0xC1, 0xE8, 32 });                                     // shr rax, 32
+        return;
+    }
+
+    bool sign = op == OP_DIV || op == OP_REM;
+    bool rem = op == OP_REM || op == OP_REMU;
+    uint8_t* minus = nullptr;
+
+    emit({ 0x85, 0xC9 });                                                   // test ecx, ecx
+    emit({ 0x74, 0 });                                                      // jz zero
+    uint8_t* zero = code + code_used;
+
+    if (sign)
+    {
+        emit({ 0x83, 0xF9, 0xFF });                                         // cmp ecx, -1
+        emit({ 0x74, 0 });                                                  // je minus
+        minus = code + code_used;
+    }
+
+    if (sign)
+        emit({ 0x99, 0xF7, 0xF9 });                                         // cdq; idiv ecx
+    else
+        emit({ 0x31, 0xD2, 0xF7, 0xF1 });                                   // xor edx, edx; div ecx
+
+    if (rem)
+        emit({ 0x89, 0xD0 });                                               // mov eax, edx
+
+    emit({ 0xEB, 0 });                                                      // jmp done
+    uint8_t* done = code + code_used;
+
+    zero[-1] = (code + code_used) - zero;
+
+    // zero: the quotient is all ones, the remainder the dividend
+    if (!rem)
+        emit({ 0x83, 0xC8, 0xFF });                                         // or eax, -1
+
+    if (sign)
+    {
+        emit({ 0xEB, 0 });                                                  // jmp done
+        uint8_t* skip = code + code_used;
+
+        // minus: x / -1 is -x, wrapping INT_MIN, and x % -1 is 0
+        minus[-1] = (code + code_used) - minus;
+
+        if (rem)
+            emit({ 0x31, 0xC0 });                                           // xor eax, eax
+        else
+            emit({ 0xF7, 0xD8 });                                           // neg eax
+
+        skip[-1] = (code + code_used) - skip;
+    }
+
+    done[-1] = (code + code_used) - done;
+}
+
+void Jit::emit(std::initializer_list<uint8_t> bytes)
+{
+    for (uint8_t byte : bytes)
+        code[code_used++] = byte;
+}
+
+void Jit::emit32(uint32_t value)
+{
+    memcpy(code + code_used, &value, 4);
+    code_used += 4;
+}
+
+void Jit::emit64(uint64_t value)
+{
+    memcpy(code + code_used, &value, 8);
+    code_used += 8;
+}
+
+void Jit::emit_rel32(uint8_t* target)
+{
+    emit32(target - (code + code_used + 4));
+}
+
+void Jit::load_reg(int host, int reg)
+{
+    if (reg == 0)
+        emit({ 0x31, (uint8_t)(0xC0 | host << 3 | host) });                 // xor host, host
+    else
+        emit({ 0x8B, (uint8_t)(0x43 | host << 3), (uint8_t)(4 * reg) });   // mov host, [rbx + 4 * reg]
+}
+
+void Jit::store_reg(int host, int reg)
+{
+    if (reg != 0)
+        emit({ 0x89, (uint8_t)(0x43 | host << 3), (uint8_t)(4 * reg) });   // mov [rbx + 4 * reg], host
+}
@@ -0,0 +1,276 @@
+#include <loader.h>
+#include <bus.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool load_binary(const char* path, uint8_t* memory, uint32_t memory_size)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    std::streamsize size = file.tellg();
+
+    if (size > memory_size)
+    {
+        fprintf(stderr, "Not enough memory\n");
+        return false;
+    }
+
+    file.seekg(0, std::ios::beg);
+    file.read((char*)memory, size);
+    file.close();
+
+    return true;
+}
+
+const Symbol* SymbolTable::find(uint32_t address) const
+{
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), address, [](uint32_t a, const Symbol& s) { return a < s.address; });
+
+    if (it == symbols.begin())
+        return nullptr;
+
+    // the first of several symbols at the same address
+    uint32_t start = (--it)->address;
+
+    while (it != symbols.begin() && (it - 1)->address == start)
+        --it;
+
+    if (it->size != 0 && address - it->address >= it->size)
+        return nullptr;
+
+    return &*it;
+}
+
+const Symbol* SymbolTable::find(const std::string& name) const
+{
+    for (const Symbol& symbol : symbols)
+    {
+        if (symbol.name == name)
+            return &symbol;
+    }
+
+    return nullptr;
+}
+
+const Symbol* SymbolTable::first_in(uint32_t first, uint32_t last) const
+{
+    auto it = std::lower_bound(symbols.begin(), symbols.end(), first, [](const Symbol& s, uint32_t a) { return s.address < a; });
+
+    if (it == symbols.end() || it->address >= last)
+        return nullptr;
+
+    return &*it;
+}
+
+std::string SymbolTable::label(uint32_t address) const
+{
+    const Symbol* symbol = find(address);
+
+    if (symbol == nullptr)
+        return "";
+
+    if (address == symbol->address)
+        return symbol->name;
+
+    char offset[16];
+    snprintf(offset, sizeof(offset), "+%x", address - symbol->address);
+
+    return symbol->name + offset;
+}
+
+// Whole pages are mapped from the file copy-on-write, only the partial
+// pages at either end are copied. The file offset and address have to
+// agree modulo the page size for that, otherwise everything is copied.
+void place(Ram& ram, int fd, const uint8_t* file, uint32_t address, uint32_t offset, uint32_t size)
+{
+    uint64_t end = (uint64_t)address + size;
+    uint32_t first = std::min<uint64_t>(((uint64_t)address + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1), end);
+    uint32_t last = std::max<uint64_t>(first, end & ~(uint64_t)(PAGE_SIZE - 1));
+
+    if ((offset - address) % PAGE_SIZE != 0 || first == last || !ram.map_file(first, fd, offset + (first - address), last - first))
+    {
+        memcpy(&ram[address], file + offset, size);
+        return;
+    }
+
+    memcpy(&ram[address], file + offset, first - address);
+    memcpy(&ram[last], file + offset + (last - address), end - last);
+}
+
+void load_symbols(const uint8_t* file, size_t file_size, const Elf32_Ehdr* header, SymbolTable& table)
+{
+    if (header->e_shoff == 0 || header->e_shentsize != sizeof(Elf32_Shdr) || header->e_shoff + (uint64_t)header->e_shnum * sizeof(Elf32_Shdr) > file_size)
+        return;
+
+    const Elf32_Shdr* sections = (const Elf32_Shdr*)(file + header->e_shoff);
+
+    for (int i = 0; i < header->e_shnum; i++)
+    {
+        const Elf32_Shdr& section = sections[i];
+
+        if (section.sh_type != SHT_SYMTAB || section.sh_link >= header->e_shnum)
+            continue;
+
+        const Elf32_Shdr& strings = sections[section.sh_link];
+
+        if (section.sh_offset + (uint64_t)section.sh_size > file_size || strings.sh_offset + (uint64_t)strings.sh_size > file_size)
+            continue;
+
+        const Elf32_Sym* symbols = (const Elf32_Sym*)(file + section.sh_offset);
+        const char* names = (const char*)(file + strings.sh_offset);
+
+        for (uint32_t j = 0; j < section.sh_size / sizeof(Elf32_Sym); j++)
+        {
+            const Elf32_Sym& symbol = symbols[j];
+            int type = ELF32_ST_TYPE(symbol.st_info);
+
+            if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= strings.sh_size)
+                continue;
+
+            if (type != STT_NOTYPE && type != STT_FUNC && type != STT_OBJECT)
+                continue;
+
+            std::string name(names + symbol.st_name, strnlen(names + symbol.st_name, strings.sh_size - symbol.st_name));
+
+            // mapping symbols and local assembler labels
+            if (name.empty() || name[0] == '$' || name.compare(0, 2, ".L") == 0)
+                continue;
+
+            table.symbols.push_back({ symbol.st_value, symbol.st_size, name });
+        }
+    }
+
+    std::stable_sort(table.symbols.begin(), table.symbols.end(), [](const Symbol& a, const Symbol& b) { return a.address < b.address; });
+}
+
+bool load_elf(const char* path, int fd, const uint8_t* file, size_t file_size, Ram& ram, Program& program)
+{
+    const Elf32_Ehdr* header = (const Elf32_Ehdr*)file;
+
+    if (file_size < sizeof(Elf32_Ehdr) || header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_ident[EI_DATA] != ELFDATA2LSB
+        || header->e_machine != EM_RISCV || header->e_type != ET_EXEC)
+    {
+        fprintf(stderr, "`%s` is not a 32-bit little-endian RISC-V executable\n", path);
+        return false;
+    }
+
+    if (header->e_phentsize != sizeof(Elf32_Phdr) || header->e_phoff + (uint64_t)header->e_phnum * sizeof(Elf32_Phdr) > file_size)
+    {
+        fprintf(stderr, "`%s` has broken program headers\n", path);
+        return false;
+    }
+
+    const Elf32_Phdr* segments = (const Elf32_Phdr*)(file + header->e_phoff);
+
+    for (int i = 0; i < header->e_phnum; i++)
+    {
+        const Elf32_Phdr& segment = segments[i];
+
+        if (segment.p_type != PT_LOAD)
+            continue;
+
+        if (segment.p_filesz > segment.p_memsz || segment.p_offset + (uint64_t)segment.p_filesz > file_size)
+        {
+            fprintf(stderr, "`%s` has a broken segment\n", path);
+            return false;
+        }
+
+        if (segment.p_vaddr + (uint64_t)segment.p_memsz > ram.size())
+        {
+            fprintf(stderr, "Not enough memory for the segment at %08x\n", segment.p_vaddr);
+            return false;
+        }
+
+        // the rest up to p_memsz is BSS, which the cleared RAM already is
+        place(ram, fd, file, segment.p_vaddr, segment.p_offset, segment.p_filesz);
+        program.segments.push_back({ segment.p_vaddr, segment.p_filesz });
+        program.end = std::max(program.end, segment.p_vaddr + segment.p_memsz);
+    }
+
+    program.entry = header->e_entry;
+    load_symbols(file, file_size, header, program.symbols);
+
+    if (const Symbol* stack = program.symbols.find("__stack_top"))
+        program.stack_pointer = stack->address;
+
+    if (const Symbol* global = program.symbols.find("__global_pointer$"))
+        program.global_pointer = global->address;
+
+    return true;
+}
+
+bool load_program(const char* path, Ram& ram, Program& program)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Could not read `%s`\n", path);
+        close(fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    const uint8_t* file = nullptr;
+
+    if (size != 0)
+    {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping == MAP_FAILED)
+        {
+            fprintf(stderr, "Could not map `%s`\n", path);
+            close(fd);
+            return false;
+        }
+
+        file = (const uint8_t*)mapping;
+    }
+
+    ram.clear();
+    program = Program();
+
+    bool loaded = true;
+
+    if (size >= SELFMAG && memcmp(file, ELFMAG, SELFMAG) == 0)
+        loaded = load_elf(path, fd, file, size, ram, program);
+    else if (size > ram.size())
+    {
+        fprintf(stderr, "Not enough memory\n");
+        loaded = false;
+    }
+    else
+    {
+        place(ram, fd, file, 0, 0, size);
+        program.segments.push_back({ 0, (uint32_t)size });
+        program.end = size;
+    }
+
+    if (file != nullptr)
+        munmap((void*)file, size);
+
+    close(fd);
+
+    return loaded;
+}
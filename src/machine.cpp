@@ -0,0 +1,538 @@
+#include <machine.h>
+#include <gdb.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+Machine::Machine(uint64_t memory_size) : memory(memory_size), cpu(memory.data(), memory_size), screen(FB_WIDTH, FB_HEIGHT)
+{
+    cpu.syscalls = &syscalls;
+
+    cpu.bus.map(IO_ADDRESS, PAGE_SIZE,
+        [this](uint32_t offset, uint32_t size, uint32_t& value) { return io_read(offset, size, value); },
+        [this](uint32_t offset, uint32_t size, uint32_t value) { return io_write(offset, size, value); });
+
+    cpu.bus.map(CLINT_ADDRESS, CLINT_SIZE,
+        [this](uint32_t offset, uint32_t size, uint32_t& value) { return clint_read(offset, size, value); },
+        [this](uint32_t offset, uint32_t size, uint32_t value) { return clint_write(offset, size, value); }, true);
+
+    set_screen(FB_WIDTH, FB_HEIGHT);
+}
+
+bool Machine::load(const char* path)
+{
+    screen.mark_all();
+    pages.reset();
+
+    // code only ever ran from pages that were present
+    for (uint32_t page : cpu.bus.present)
+        cpu.invalidate_page(page << PAGE_SHIFT);
+
+    cpu.bus.evict();
+
+    bool loaded = load_program(path, memory, program);
+
+    // the heap starts past BSS, aligned for malloc
+    syscalls.heap = (program.end + 15) & ~15;
+
+    for (const Segment& segment : program.segments)
+    {
+        for (uint64_t address = segment.address & ~(PAGE_SIZE - 1); address < (uint64_t)segment.address + segment.size; address += PAGE_SIZE)
+            cpu.bus.fault_in(address >> PAGE_SHIFT);
+    }
+
+    // written behind the bus
+    for (uint32_t page : cpu.bus.present)
+        cpu.bus.mark_changed(page);
+
+    return loaded;
+}
+
+bool Machine::set_screen(uint32_t width, uint32_t height)
+{
+    if (width == 0 || height == 0 || SCREEN_ADDRESS + (uint64_t)width * height > memory.size())
+    {
+        fprintf(stderr, "A %ux%u screen does not fit in memory\n", width, height);
+        return false;
+    }
+
+    screen = Framebuffer(width, height);
+    screen.attach(cpu.bus, SCREEN_ADDRESS);
+
+    return true;
+}
+
+void Machine::set_keyboard(int8_t vertical, int8_t horizontal)
+{
+    if (vertical == keyboard[0] && horizontal == keyboard[1])
+        return;
+
+    keyboard[0] = vertical;
+    keyboard[1] = horizontal;
+    cpu.raise(MIP_MEIP);
+}
+
+bool Machine::set_memory(uint64_t size)
+{
+    if (SCREEN_ADDRESS + (uint64_t)screen.size() > size)
+    {
+        fprintf(stderr, "The screen does not fit in %llu bytes of memory\n", (unsigned long long)size);
+        return false;
+    }
+
+    memory.resize(size);
+    cpu.resize(memory.data(), size);
+    pages.reset();
+    screen.attach(cpu.bus, SCREEN_ADDRESS);
+
+    return true;
+}
+
+void Machine::reset()
+{
+    cpu.reset();
+    cpu.pc = program.entry;
+    cpu.x[2] = program.stack_pointer != 0 ? program.stack_pointer : STACK_POINTER;
+    cpu.x[3] = program.global_pointer;
+
+    tohost = false;
+    syscalls.reset();
+    screen.mark_all();
+}
+
+SaveState Machine::save()
+{
+    PageChanges changes;
+
+    // only pages stored to since the last save or restore are copied
+    for (uint32_t i : cpu.bus.take_changed())
+    {
+        auto page = std::make_shared<Page>();
+        memcpy(page->data(), &memory[(uint64_t)i << PAGE_SHIFT], PAGE_SIZE);
+
+        if (*page == *zero_page())
+            changes.push_back({ i, zero_page() });
+        else
+            changes.push_back({ i, page });
+    }
+
+    if (pages == nullptr)
+        pages = PageTable().update(changes);
+    else if (!changes.empty())
+        pages = pages->update(changes);
+
+    SaveState state;
+
+    std::copy(cpu.x, cpu.x + 32, state.x);
+    state.pc = cpu.pc;
+    state.halted = cpu.halted && !cpu.yielded && !cpu.paused;
+    state.trapped = cpu.trapped;
+    state.exit_code = cpu.exit_code;
+
+    state.csr = cpu.csr;
+    state.instret = cpu.instret;
+    state.idle = cpu.idle;
+    state.mtimecmp = cpu.mtimecmp;
+    state.waiting = cpu.waiting;
+
+    state.keyboard[0] = keyboard[0];
+    state.keyboard[1] = keyboard[1];
+    state.tohost = tohost;
+    state.brk = syscalls.brk;
+
+    // minstd_rand only exposes its state through a stream
+    std::stringstream stream;
+    stream << random;
+    stream >> state.random;
+
+    state.page_count = memory.size() >> PAGE_SHIFT;
+    state.pages = pages;
+
+    return state;
+}
+
+void Machine::restore(const SaveState& state)
+{
+    if (state.page_count != memory.size() >> PAGE_SHIFT)
+        throw std::runtime_error("The save state is for a different memory size");
+
+    static const PageTable none;
+    const PageTable& from = pages != nullptr ? *pages : none;
+    const PageTable& to = state.pages != nullptr ? *state.pages : none;
+
+    // pages the state does not have are zero, and so is any page that was
+    // never used here since loading
+    auto rewrite = [&](uint32_t i)
+    {
+        const std::shared_ptr<const Page>& page = to.find(i);
+
+        if (page == nullptr && cpu.bus.pages[i] == BUS_ABSENT)
+            return;
+
+        cpu.bus.fault_in(i);
+        memcpy(&memory[(uint64_t)i << PAGE_SHIFT], (page != nullptr ? page : zero_page())->data(), PAGE_SIZE);
+
+        cpu.invalidate_page(i << PAGE_SHIFT);
+        cpu.bus.mark_page(i, DIRTY_ALL);
+    };
+
+    // memory is as the table has it but for the pages stored to since
+    for (uint32_t i : cpu.bus.take_changed())
+        rewrite(i);
+
+    from.differences(to, rewrite);
+
+    pages = state.pages;
+
+    cpu.reset();
+    std::copy(state.x, state.x + 32, cpu.x);
+    cpu.pc = state.pc;
+    cpu.halted = state.halted;
+    cpu.trapped = state.trapped;
+    cpu.exit_code = state.exit_code;
+
+    cpu.csr = state.csr;
+    cpu.instret = state.instret;
+    cpu.idle = state.idle;
+    cpu.mtimecmp = state.mtimecmp;
+    cpu.waiting = state.waiting;
+    cpu.reschedule();
+
+    keyboard[0] = state.keyboard[0];
+    keyboard[1] = state.keyboard[1];
+    random.seed(state.random);
+    tohost = state.tohost;
+    syscalls.brk = state.brk;
+}
+
+bool Machine::io_read(uint32_t offset, uint32_t size, uint32_t& value)
+{
+    value = 0;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        uint8_t byte;
+
+        switch (IO_ADDRESS + offset + i)
+        {
+        case KEYBOARD_ADDRESS:
+        case KEYBOARD_ADDRESS + 1:
+        {
+            byte = keyboard[IO_ADDRESS + offset + i - KEYBOARD_ADDRESS];
+            cpu.lower(MIP_MEIP);
+
+            break;
+        }
+        case RANDOM_ADDRESS:        byte = random();        break;
+        case RANDOM_ADDRESS + 1:
+        case EXIT_ADDRESS:
+        case EXIT_ADDRESS + 1:
+        case EXIT_ADDRESS + 2:
+        case EXIT_ADDRESS + 3:
+        case PRESENT_ADDRESS:
+        case PRESENT_ADDRESS + 1:
+        case PRESENT_ADDRESS + 2:
+        case PRESENT_ADDRESS + 3:   byte = 0;               break;
+
+        default: return false;
+        }
+
+        value |= byte << (8 * i);
+    }
+
+    return true;
+}
+
+bool Machine::io_write(uint32_t offset, uint32_t size, uint32_t value)
+{
+    uint32_t address = IO_ADDRESS + offset;
+
+    // tohost convention: bit 0 marks the write, the rest is the exit code
+    if (address == EXIT_ADDRESS && size == 4)
+    {
+        if (value & 1)
+        {
+            cpu.halted = true;
+            cpu.exit_code = value >> 1;
+            tohost = true;
+        }
+
+        return true;
+    }
+
+    if (address == PRESENT_ADDRESS && size == 4)
+    {
+        frames++;
+
+        if (vsync)
+            cpu.halted = cpu.paused = true;
+
+        return true;
+    }
+
+    if (address < KEYBOARD_ADDRESS || address + size > RANDOM_ADDRESS + 2)
+        return false;
+
+    for (uint32_t i = 0; i < size; i++, address++, value >>= 8)
+    {
+        if (address < RANDOM_ADDRESS)
+            keyboard[address - KEYBOARD_ADDRESS] = value;
+    }
+
+    return true;
+}
+
+// 32-bit registers only, the 64-bit ones are two of them. mtime is guest
+// time, which only running the guest moves, so it can't be written.
+bool Machine::clint_read(uint32_t offset, uint32_t size, uint32_t& value)
+{
+    if (size != 4)
+        return false;
+
+    switch (offset)
+    {
+    case CLINT_MSIP:            value = (cpu.csr.mip & MIP_MSIP) != 0;  break;
+    case CLINT_MTIMECMP:        value = cpu.mtimecmp;                   break;
+    case CLINT_MTIMECMP + 4:    value = cpu.mtimecmp >> 32;             break;
+    case CLINT_MTIME:           value = cpu.time();                     break;
+    case CLINT_MTIME + 4:       value = cpu.time() >> 32;               break;
+
+    default: return false;
+    }
+
+    return true;
+}
+
+bool Machine::clint_write(uint32_t offset, uint32_t size, uint32_t value)
+{
+    if (size != 4)
+        return false;
+
+    switch (offset)
+    {
+    case CLINT_MSIP:
+    {
+        if (value & 1)
+            cpu.raise(MIP_MSIP);
+        else
+            cpu.lower(MIP_MSIP);
+
+        break;
+    }
+    case CLINT_MTIMECMP:        cpu.set_timer((cpu.mtimecmp & ~0xffffffffull) | value);             break;
+    case CLINT_MTIMECMP + 4:    cpu.set_timer((cpu.mtimecmp & 0xffffffff) | (uint64_t)value << 32);   break;
+
+    default: return false;
+    }
+
+    return true;
+}
+
+// gdb has the guest for as long as it stays connected, slices in between
+// checking for an interrupt
+static void serve_gdb(const char* address, Machine& machine, JobResult& result)
+{
+    GdbStub gdb(machine);
+
+    if (!gdb.open(address))
+    {
+        result.reason = "error";
+        result.error = "could not start gdb";
+        return;
+    }
+
+    while (gdb.poll(gdb.running ? 0 : -1))
+    {
+        if (!gdb.running)
+            continue;
+
+        try
+        {
+            uint64_t ran = machine.cpu.run(MACHINE_SLICE);
+
+            // waiting for nothing is as far as the guest gets
+            if (machine.cpu.exited() || machine.cpu.trapped || ran < MACHINE_SLICE)
+                gdb.stopped();
+        }
+        catch (const std::exception& e)
+        {
+            gdb.fault(e);
+        }
+    }
+
+    if (gdb.killed)
+        result.reason = "killed";
+}
+
+JobResult run_job(const Job& job)
+{
+    JobResult result;
+    Machine machine(job.memory_size);
+    machine.syscalls.sandbox = job.sandbox;
+
+    if (!machine.load(job.path.c_str()))
+    {
+        result.reason = "error";
+        result.error = "could not load";
+        return result;
+    }
+
+    CPU& cpu = machine.cpu;
+    TraceWriter trace;
+
+    if (!job.trace.empty())
+    {
+        if (!trace.open(job.trace.c_str()))
+        {
+            result.reason = "error";
+            result.error = "could not open the trace";
+            return result;
+        }
+
+        cpu.trace = &trace;
+    }
+
+    std::unique_ptr<Profiler> profiler;
+
+    if (!job.profile.empty())
+    {
+        profiler = std::make_unique<Profiler>();
+        cpu.profile = profiler.get();
+    }
+
+    cpu.engine = job.engine;
+    machine.reset();
+
+    size_t next_input = 0;
+    uint64_t retired = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        if (job.state)
+            machine.restore(*job.state);
+
+        machine.random.seed(job.seed);
+        retired = cpu.instret;
+
+        if (!job.gdb.empty())
+            serve_gdb(job.gdb.c_str(), machine, result);
+
+        // input and the instruction limit count guest time, which is the
+        // retired instructions for as long as the guest does not wait
+        uint64_t origin = cpu.time();
+
+        while (result.reason == nullptr)
+        {
+            uint64_t now = cpu.time() - origin;
+
+            while (next_input < job.input.size() && job.input[next_input].at <= now)
+            {
+                machine.set_keyboard(job.input[next_input].vertical, job.input[next_input].horizontal);
+                next_input++;
+            }
+
+            uint64_t slice = MACHINE_SLICE;
+
+            if (next_input < job.input.size())
+                slice = std::min(slice, job.input[next_input].at - now);
+
+            if (job.max_instructions != 0)
+                slice = std::min(slice, job.max_instructions - now);
+
+            uint64_t ran = cpu.run(slice);
+            now += ran;
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            // nothing but the next input can wake the guest, so time skips to it
+            if (cpu.waiting && ran < slice && next_input < job.input.size())
+                cpu.idle += slice - ran;
+            else if (cpu.waiting && ran < slice)
+                result.reason = "idle";
+            else if (cpu.exited())
+                result.reason = machine.tohost ? "mmio" : "ecall";
+            else if (job.max_instructions != 0 && now >= job.max_instructions)
+                result.reason = "instruction-limit";
+            else if (job.timeout != 0 && result.seconds >= job.timeout)
+                result.reason = "timeout";
+        }
+    }
+    catch (const std::exception& e)
+    {
+        result.reason = "error";
+        result.error = e.what();
+    }
+
+    result.exit_code = cpu.exit_code;
+    result.instructions = cpu.instret - retired;
+    trace.close();
+
+    if (profiler && !profiler->write(job.profile, cpu))
+    {
+        result.reason = "error";
+        result.error = "could not write the profile";
+    }
+
+    return result;
+}
+
+bool load_input(const char* path, std::vector<InputEvent>& input)
+{
+    std::ifstream file(path);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream stream(line);
+        unsigned long long at;
+        int vertical;
+        int horizontal;
+
+        if (!(stream >> at >> vertical >> horizontal))
+        {
+            fprintf(stderr, "Bad input line `%s`\n", line.c_str());
+            return false;
+        }
+
+        input.push_back({ at, (int8_t)vertical, (int8_t)horizontal });
+    }
+
+    std::stable_sort(input.begin(), input.end(), [](const InputEvent& a, const InputEvent& b) { return a.at < b.at; });
+
+    return true;
+}
+
+bool parse_memory_size(const char* text, uint64_t& size)
+{
+    char* end;
+    size = strtoull(text, &end, 0);
+
+    switch (*end)
+    {
+    case 'K':   size <<= 10;    end++;  break;
+    case 'M':   size <<= 20;    end++;  break;
+    case 'G':   size <<= 30;    end++;  break;
+    }
+
+    if (end == text || *end != 0 || size < MEMORY_MIN || size > MEMORY_MAX || size % PAGE_SIZE != 0)
+    {
+        fprintf(stderr, "Memory has to be whole pages from %u KiB to 4 GiB, not `%s`\n", MEMORY_MIN >> 10, text);
+        return false;
+    }
+
+    return true;
+}
@@ -1,16 +1,8 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
-#include <fstream>
 #include <time.h>
-#include <cpu.h>
-
-#define MEMORY_SIZE         0x100000
-#define SCREEN_ADDRESS      0x10000
-#define KEYBOARD_ADDRESS    0x09000
-#define RANDOM_ADDRESS      0x09002
-#define STACK_POINTER       0x20000
-#define FB_WIDTH            32
-#define FB_HEIGHT           16
+#include <algorithm>
+#include <emulator.h>
 
 #define WHITE       { 255, 255, 255 }
 #define GREY        { 128, 128, 128 }
@@ -19,17 +11,22 @@
 #define PC_COLOR    { 7, 77, 181 }
 #define RA_COLOR    { 217, 43, 43 }
 
-uint8_t memory[MEMORY_SIZE];
-CPU cpu(memory);
+Machine machine;
+Scheduler scheduler(DEFAULT_IPS);
+Emulator emulator(machine, scheduler);
+TraceWriter trace;
+const char* profile_path = nullptr;
+const Snapshot* state;
+uint64_t uploaded = 0;
 
 SDL_Rect screen;
-uint8_t framebuffer[3 * FB_WIDTH * FB_HEIGHT];
-int memory_view = 0;
+SDL_Texture* screen_texture;
+std::vector<uint8_t> screen_chroma;
+uint32_t memory_view = 0;
 
 SDL_Window* win;
 SDL_Renderer* ren;
 bool quit = false;
-bool autostep = false;
 bool fullscreen = true;
 
 TTF_Font* font;
@@ -37,59 +34,162 @@ int font_width;
 int font_height;
 
 SDL_Texture* font_charset;
+int charset_width;
 char charset[] = { " !\"#$%&'()*+,-./0123456789:; = ?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~" };
 
+// the text of a frame, kept from one frame to the next for the capacity
+std::vector<SDL_Vertex> text_vertices;
+std::vector<int> text_indices;
+
+// a row of the memory view, formatted again only once its address, bytes
+// or label change
+struct HexRow
+{
+    bool valid = false;
+    uint32_t address;
+    uint8_t bytes[16];
+    std::string label;
+    std::string text;
+};
+
+std::vector<HexRow> hex_rows;
+
 void generate_charset(SDL_Renderer* ren)
 {
     SDL_Surface* text_surface = TTF_RenderText_Blended(font, charset, WHITE);
     font_charset = SDL_CreateTextureFromSurface(ren, text_surface);
 
     SDL_FreeSurface(text_surface);
-    SDL_QueryTexture(font_charset, nullptr, nullptr, &font_width, &font_height);
+    SDL_QueryTexture(font_charset, nullptr, nullptr, &charset_width, &font_height);
 
-    font_width /= strlen(charset);
+    font_width = charset_width / strlen(charset);
 }
 
-void render_text(SDL_Renderer* ren, int x, int y, std::string str, SDL_Color color)
+// a quad of the charset for each glyph, all drawn at once by flush_text
+void render_text(int x, int y, const char* str, SDL_Color color)
 {
-    SDL_Rect src;
-    src.x = 0;
-    src.y = 0;
-    src.w = font_width;
-    src.h = font_height;
-
-    SDL_Rect dest;
-    dest.x = x;
-    dest.y = y;
-    dest.h = font_height;
-    dest.w = font_width;
+    float left = x;
+    float top = y;
 
-    SDL_SetTextureColorMod(font_charset, color.r, color.g, color.b);
+    // the colours above leave alpha out, which vertices don't ignore
+    color.a = 255;
 
-    for (auto ch : str)
+    for (; *str != 0; str++)
     {
+        char ch = *str;
+
         if (ch == '\n')
         {
-            dest.x = x;
-            dest.y += font_height;
+            left = x;
+            top += font_height;
+            continue;
         }
-        else
+
+        // spaces and anything the charset lacks draw nothing
+        if (ch > ' ' && ch <= '~')
         {
-            src.x = (ch - ' ') * font_width;
-            SDL_RenderCopy(ren, font_charset, &src, &dest);
-            dest.x += font_width;
+            float u0 = (float)((ch - ' ') * font_width) / charset_width;
+            float u1 = (float)((ch - ' ' + 1) * font_width) / charset_width;
+            float right = left + font_width;
+            float bottom = top + font_height;
+            int base = text_vertices.size();
+
+            text_vertices.push_back({ { left, top }, color, { u0, 0 } });
+            text_vertices.push_back({ { right, top }, color, { u1, 0 } });
+            text_vertices.push_back({ { left, bottom }, color, { u0, 1 } });
+            text_vertices.push_back({ { right, bottom }, color, { u1, 1 } });
+
+            for (int corner : { 0, 1, 2, 2, 1, 3 })
+                text_indices.push_back(base + corner);
         }
+
+        left += font_width;
     }
 }
 
+void flush_text()
+{
+    if (text_vertices.empty())
+        return;
+
+    SDL_RenderGeometry(ren, font_charset, text_vertices.data(), text_vertices.size(), text_indices.data(), text_indices.size());
+
+    text_vertices.clear();
+    text_indices.clear();
+}
+
+void usage(char** argv)
+{
+    fprintf(stderr, "use: %s [--ips N | --fast] [--engine interpreter|threaded|jit] [--memory SIZE] [--screen WIDTHxHEIGHT] [--state FILE] [--history N] [--trace FILE] [--profile PREFIX] [--sandbox DIR] [--gdb ADDRESS] file\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
+
 void init_all(int argc, char** argv)
 {
-    if (argc != 2)
+    const char* path = nullptr;
+
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "use: %s file\n", argv[0]);
-        exit(EXIT_FAILURE);
+        if (strcmp(argv[i], "--fast") == 0)
+            scheduler.ips = 0;
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc)
+            scheduler.ips = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            if (!parse_engine(argv[++i], machine.cpu.engine))
+                usage(argv);
+        }
+        else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc)
+        {
+            uint64_t size;
+
+            if (!parse_memory_size(argv[++i], size))
+                usage(argv);
+
+            if (!machine.set_memory(size))
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--screen") == 0 && i + 1 < argc)
+        {
+            uint32_t width;
+            uint32_t height;
+
+            // the chroma planes of the screen texture are subsampled by two
+            if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width % 2 != 0 || height % 2 != 0)
+                usage(argv);
+
+            if (!machine.set_screen(width, height))
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc)
+            emulator.history = History(strtoul(argv[++i], nullptr, 0));
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc)
+            emulator.state_path = argv[++i];
+        else if (strcmp(argv[i], "--sandbox") == 0 && i + 1 < argc)
+            machine.syscalls.sandbox = argv[++i];
+        else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc)
+            emulator.gdb_address = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profile_path = argv[++i];
+            machine.cpu.profile = &emulator.profiler;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            if (!trace.open(argv[++i]))
+                exit(EXIT_FAILURE);
+
+            machine.cpu.trace = &trace;
+        }
+        else if (path == nullptr)
+            path = argv[i];
+        else
+            usage(argv);
     }
 
+    if (path == nullptr)
+        usage(argv);
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
     {
         fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
@@ -128,31 +228,28 @@ void init_all(int argc, char** argv)
 
     generate_charset(ren);
 
-    std::ifstream file(argv[1], std::ios::binary | std::ios::ate);
+    // the luma plane of a YUV texture takes the grey level bytes as they are,
+    // the chroma planes stay neutral
+    SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+    screen_texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, machine.screen.width, machine.screen.height);
 
-    if (!file.is_open())
+    if (screen_texture == nullptr)
     {
-        fprintf(stderr, "Could not open `%s`\n", argv[1]);
+        fprintf(stderr, "SDL_CreateTexture: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
 
-    std::streamsize size = file.tellg();
+    screen_chroma.assign(machine.screen.size() / 4, 128);
 
-    if (size > MEMORY_SIZE)
-    {
-        fprintf(stderr, "Not enough memory");
+    if (!machine.load(path))
         exit(EXIT_FAILURE);
-    }
-
-    file.seekg(0, std::ios::beg);
-    file.read((char*)memory, size);
-    file.close();
 
-    srand(time(nullptr));
+    machine.random.seed(time(nullptr));
 }
 
 void clean_all()
 {
+    SDL_DestroyTexture(screen_texture);
     SDL_DestroyRenderer(ren);
     SDL_DestroyWindow(win);
     TTF_Quit();
@@ -168,40 +265,66 @@ void render_registers(int x, int y)
         SDL_Color i_color = WHITE;
         SDL_Color j_color = WHITE;
 
-        if (i == cpu.dirty)
+        if (i == state->dirty)
             i_color = YELLOW;
         else if (i == 2)
             i_color = SP_COLOR;
         else if (i == 1)
             i_color = RA_COLOR;
 
-        if (j == cpu.dirty)
+        if (j == state->dirty)
             j_color = YELLOW;
         else    if (j == 2)
             j_color = SP_COLOR;
         else if (j == 1)
             j_color = RA_COLOR;
 
-        std::string i_str = fmt("%-4s = %08x", reg_name[i], cpu.x[i]);
-        std::string j_str = fmt("%-4s = %08x", reg_name[j], cpu.x[j]);
+        char i_str[32];
+        char j_str[32];
 
-        render_text(ren, x, y + i * font_height, i_str, i_color);
-        render_text(ren, x + 230, y + i * font_height, j_str, j_color);
+        snprintf(i_str, sizeof(i_str), "%-4s = %08x", reg_name[i], state->x[i]);
+        snprintf(j_str, sizeof(j_str), "%-4s = %08x", reg_name[j], state->x[j]);
+
+        render_text(x, y + i * font_height, i_str, i_color);
+        render_text(x + 230, y + i * font_height, j_str, j_color);
     }
 
-    std::string pc_str = fmt("pc   = %08x", cpu.pc);
-    render_text(ren, x, y + 16 * font_height, pc_str, PC_COLOR);
+    char pc_str[32];
+    snprintf(pc_str, sizeof(pc_str), "pc   = %08x", state->pc);
+    render_text(x, y + 16 * font_height, pc_str, PC_COLOR);
+
+    if (!state->function.empty())
+        render_text(x, y + 17 * font_height, ("<" + state->function + ">").c_str(), GREY);
 }
 
-void render_memory(int x, int y, int offset)
+void render_memory(int x, int y)
 {
     int rows = (800 - x) / font_height;
+    uint32_t offset = state->memory_view;
+    uint32_t pc = state->pc;
+    uint32_t ra = state->x[1];
+
+    // hotter words get a brighter red background
+    for (uint32_t i = 0; state->profiling && i < SNAPSHOT_MEMORY / 4 && i / 4 < rows; i++)
+    {
+        if (state->heat[i] == 0)
+            continue;
 
-    if ((cpu.pc - offset) / 16 < rows)
+        SDL_Rect rect;
+        rect.x = x + font_width * 9.5 + (i % 4) * font_width * 12;
+        rect.y = y + (i / 4) * font_height;
+        rect.w = font_width * 12;
+        rect.h = font_height;
+
+        SDL_SetRenderDrawColor(ren, state->heat[i] / 2 + 32, 0, 0, 255);
+        SDL_RenderFillRect(ren, &rect);
+    }
+
+    if ((pc - offset) / 16 < rows)
     {
         SDL_Rect rect;
-        rect.x = x + font_width * 9.5 + (cpu.pc % 16) * font_width * 3;
-        rect.y = y + ((cpu.pc - offset) / 16) * font_height;
+        rect.x = x + font_width * 9.5 + (pc % 16) * font_width * 3;
+        rect.y = y + ((pc - offset) / 16) * font_height;
         rect.w = font_width * 12;
         rect.h = font_height;
 
@@ -210,188 +333,255 @@ void render_memory(int x, int y, int offset)
         SDL_RenderFillRect(ren, &rect);
     }
 
-    if ((cpu.x[1] - offset) / 16 < rows)
+    if ((ra - offset) / 16 < rows)
     {
         SDL_Rect rect;
-        rect.x = x + font_width * 9.5 + (cpu.x[1] % 16) * font_width * 3;
-        rect.y = y + ((cpu.x[1] - offset) / 16) * font_height;
+        rect.x = x + font_width * 9.5 + (ra % 16) * font_width * 3;
+        rect.y = y + ((ra - offset) / 16) * font_height;
         rect.w = font_width * 12;
         rect.h = font_height;
 
         SDL_Color col = RA_COLOR;
         SDL_SetRenderDrawColor(ren, col.r, col.g, col.b, 255);
 
-        if (cpu.x[1] == cpu.pc)
+        if (ra == pc)
             SDL_RenderDrawRect(ren, &rect);
         else
             SDL_RenderFillRect(ren, &rect);
     }
 
-    std::string memory_str = "";
-    uint8_t* ptr = memory + offset;
+    const char digits[] = "0123456789abcdef";
+
+    hex_rows.resize(std::max<size_t>(hex_rows.size(), rows));
 
-    for (int i = 0; i < rows; i++)
+    for (int row = 0; row < rows && (row + 1) * 16 <= state->memory_length; row++)
     {
-        if (ptr >= memory + MEMORY_SIZE)
-            break;
+        HexRow& cached = hex_rows[row];
+        uint32_t address = offset + row * 16;
+        const uint8_t* bytes = &state->memory[row * 16];
+        const std::string& label = state->memory_labels[row];
 
-        memory_str += fmt("%08x: ", (uint32_t)(ptr - memory));
+        if (!cached.valid || cached.address != address || memcmp(cached.bytes, bytes, 16) != 0 || cached.label != label)
+        {
+            cached.valid = true;
+            cached.address = address;
+            memcpy(cached.bytes, bytes, 16);
+            cached.label = label;
 
-        for (int j = 0; j < 16; j++)
-            memory_str += fmt("%02x ", *ptr++);
+            cached.text = fmt("%08x: ", address);
 
-        memory_str += "\n";
-    }
+            for (int j = 0; j < 16; j++)
+            {
+                cached.text += digits[bytes[j] >> 4];
+                cached.text += digits[bytes[j] & 15];
+                cached.text += ' ';
+            }
+
+            if (!label.empty())
+                cached.text += " " + label.substr(0, 16);
+        }
 
-    render_text(ren, x, y, memory_str, WHITE);
+        render_text(x, y + row * font_height, cached.text.c_str(), WHITE);
+    }
 }
 
 void render_instruction(int x, int y)
 {
-    for (int i = -2; i <= 2; i++)
+    for (int i = 0; i < SNAPSHOT_CODE; i++)
     {
-        int address = cpu.pc + i * sizeof(uint32_t);
-
-        if (address < 0 || address >= MEMORY_SIZE)
-            continue;
-
         SDL_Color col = GREY;
 
-        if (i == 0)
+        if (i == SNAPSHOT_CODE / 2)
             col = WHITE;
 
-        render_text(ren, x, y + (i + 2) * font_height, cpu.disassemble(*((uint32_t*)&memory[address])), col);
+        render_text(x, y + i * font_height, state->code[i], col);
+
+        if (state->profiling && state->code_hits[i] != 0)
+        {
+            SDL_Color heat = { 255, (uint8_t)(255 - state->code_heat[i]), (uint8_t)(255 - state->code_heat[i]) };
+            render_text(x + 300, y + i * font_height, fmt("%llu", (unsigned long long)state->code_hits[i]).c_str(), heat);
+        }
     }
 }
 
 void render_screen(SDL_Rect* screen)
 {
-    for (int i = 0; i < FB_WIDTH * FB_HEIGHT; i++)
+    const Framebuffer& fb = machine.screen;
+    uint32_t first = state->screen_first;
+    uint32_t last = state->screen_last;
+
+    // snapshots the UI skipped may have dirtied other rows
+    if (state->sequence != uploaded + 1)
     {
-        framebuffer[3 * i] = memory[SCREEN_ADDRESS + i];
-        framebuffer[3 * i + 1] = memory[SCREEN_ADDRESS + i];
-        framebuffer[3 * i + 2] = memory[SCREEN_ADDRESS + i];
+        first = 0;
+        last = fb.height - 1;
     }
 
-    SDL_Surface* surface = SDL_CreateRGBSurfaceFrom((void*)framebuffer,
-        FB_WIDTH,
-        FB_HEIGHT,
-        3 * 8,          // bits per pixel = 24
-        FB_WIDTH * 3,   // pitch
-        0x0000FF,       // red mask
-        0x00FF00,       // green mask
-        0xFF0000,       // blue mask
-        0);
+    if (state->sequence != uploaded && first <= last)
+    {
+        // whole chroma rows, which cover two rows each
+        SDL_Rect rows;
+        rows.x = 0;
+        rows.y = first & ~1;
+        rows.w = fb.width;
+        rows.h = (last | 1) + 1 - rows.y;
+
+        SDL_UpdateYUVTexture(screen_texture, &rows, state->screen.data() + rows.y * fb.width, fb.width,
+            screen_chroma.data(), fb.width / 2, screen_chroma.data(), fb.width / 2);
+    }
 
-    SDL_Texture* screen_tex = SDL_CreateTextureFromSurface(ren, surface);
-    SDL_RenderCopy(ren, screen_tex, nullptr, screen);
+    uploaded = state->sequence;
 
-    SDL_DestroyTexture(screen_tex);
-    SDL_FreeSurface(surface);
+    SDL_RenderCopy(ren, screen_texture, nullptr, screen);
 
     SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
     SDL_RenderDrawRect(ren, screen);
 }
 
+// the largest rectangle with the screen's aspect ratio that fits the box
+void fit_screen(int x, int y, int w, int h)
+{
+    double scale = std::min((double)w / machine.screen.width, (double)h / machine.screen.height);
+
+    screen.w = machine.screen.width * scale;
+    screen.h = machine.screen.height * scale;
+    screen.x = x + (w - screen.w) / 2;
+    screen.y = y + (h - screen.h) / 2;
+}
+
+void send(CommandType type, uint8_t axis = 0, int8_t value = 0)
+{
+    emulator.commands.push({ type, axis, value });
+}
+
+void handle_event(const SDL_Event& event)
+{
+    if (event.type == SDL_QUIT)
+    {
+        quit = true;
+        return;
+    }
+
+    if (event.type == SDL_KEYDOWN)
+    {
+        switch (event.key.keysym.sym)
+        {
+        case SDLK_TAB:          fullscreen = !fullscreen;               break;
+        case SDLK_RETURN:       send(COMMAND_STEP);                     break;
+        case SDLK_SPACE:        send(COMMAND_TOGGLE_RUN);               break;
+        case SDLK_b:            send(COMMAND_STEP_BACK);                break;
+        case SDLK_r:            send(COMMAND_TOGGLE_REVERSE);           break;
+        case SDLK_p:            send(COMMAND_PROFILE);                  break;
+        case SDLK_BACKSPACE:    send(COMMAND_RESET);                    break;
+        case SDLK_F5:           send(COMMAND_SAVE);                     break;
+        case SDLK_F9:           send(COMMAND_LOAD);                     break;
+        case SDLK_UP:           send(COMMAND_KEYBOARD, 0, -1);          break;
+        case SDLK_DOWN:         send(COMMAND_KEYBOARD, 0, 1);           break;
+        case SDLK_LEFT:         send(COMMAND_KEYBOARD, 1, -1);          break;
+        case SDLK_RIGHT:        send(COMMAND_KEYBOARD, 1, 1);           break;
+        case SDLK_HOME:         memory_view = 0;                        break;
+        case SDLK_END:          memory_view = machine.memory.size() - 16; break;
+        case SDLK_PAGEUP:
+        {
+            if (memory_view >= 16)
+                memory_view -= 16;
+
+            break;
+        }
+        case SDLK_PAGEDOWN:
+        {
+            if ((uint64_t)memory_view + 16 < machine.memory.size())
+                memory_view += 16;
+
+            break;
+        }
+        }
+    }
+    else if (event.type == SDL_KEYUP)
+    {
+        switch (event.key.keysym.sym)
+        {
+        case SDLK_UP:
+        case SDLK_DOWN:         send(COMMAND_KEYBOARD, 0, 0);           break;
+        case SDLK_LEFT:
+        case SDLK_RIGHT:        send(COMMAND_KEYBOARD, 1, 0);           break;
+        }
+    }
+}
+
 int main(int argc, char** argv)
 {
     init_all(argc, argv);
 
-    cpu.reset();
-    cpu.pc = 0;
-    cpu.x[2] = STACK_POINTER;
+    machine.reset();
+    emulator.start();
 
     SDL_Event event;
+    uint32_t title_time = 0;
+    uint32_t frame_time = SDL_GetTicks();
+
+    // the emulator publishes its first snapshot before running anything
+    while (!emulator.snapshots.acquire())
+        SDL_Delay(1);
+
+    state = &emulator.snapshots.front();
 
     while (!quit)
     {
-        while (SDL_PollEvent(&event))
-        {
-            if (event.type == SDL_QUIT)
-            {
-                quit = true;
-                break;
-            }
+        while (!quit && SDL_PollEvent(&event))
+            handle_event(event);
 
-            if (event.type == SDL_KEYDOWN)
-            {
-                switch (event.key.keysym.sym)
-                {
-                case SDLK_SPACE:    autostep = !autostep;                   break;
-                case SDLK_TAB:      fullscreen = !fullscreen;               break;
-                case SDLK_RETURN:   cpu.step();                             break;
-                case SDLK_UP:       memory[KEYBOARD_ADDRESS] = -1;          break;
-                case SDLK_DOWN:     memory[KEYBOARD_ADDRESS] = 1;           break;
-                case SDLK_LEFT:     memory[KEYBOARD_ADDRESS + 1] = -1;      break;
-                case SDLK_RIGHT:    memory[KEYBOARD_ADDRESS + 1] = 1;       break;
-                case SDLK_HOME:     memory_view = 0;                        break;
-                case SDLK_END:      memory_view = MEMORY_SIZE - 16;         break;
-                case SDLK_PAGEUP:
-                {
-                    if (memory_view - 16 >= 0)
-                        memory_view -= 16;
-
-                    break;
-                }
-                case SDLK_PAGEDOWN:
-                {
-                    if (memory_view + 16 < MEMORY_SIZE)
-                        memory_view += 16;
-
-                    break;
-                }
-                case SDLK_BACKSPACE:
-                {
-                    cpu.reset();
-                    cpu.pc = 0;
-                    cpu.x[2] = STACK_POINTER;
-                }
-                }
-            }
-            else if (event.type == SDL_KEYUP)
-            {
-                switch (event.key.keysym.sym)
-                {
-                case SDLK_UP:
-                case SDLK_DOWN:     memory[KEYBOARD_ADDRESS] = 0;           break;
-                case SDLK_LEFT:
-                case SDLK_RIGHT:    memory[KEYBOARD_ADDRESS + 1] = 0;       break;
-                }
-            }
-        }
+        emulator.memory_view = memory_view;
 
-        memory[RANDOM_ADDRESS] = rand();
+        if (emulator.snapshots.acquire())
+            state = &emulator.snapshots.front();
 
-        if (autostep)
-            cpu.step();
+        if (SDL_GetTicks() - title_time >= 1000)
+        {
+            title_time = SDL_GetTicks();
+            SDL_SetWindowTitle(win, fmt("RISC-V Emulator - %.2f MIPS - %llu steps back", state->mips, (unsigned long long)state->history).c_str());
+        }
 
         SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
         SDL_RenderClear(ren);
 
         if (fullscreen)
-        {
-            screen.w = FB_WIDTH * 32;
-            screen.h = FB_HEIGHT * 32;
-            screen.x = 600 - screen.w / 2;
-            screen.y = 400 - screen.h / 2;
-        }
+            fit_screen(600 - FB_WIDTH * 16, 400 - FB_HEIGHT * 16, FB_WIDTH * 32, FB_HEIGHT * 32);
         else
         {
-            screen.x = 750;
-            screen.y = 16 + (17 + 1 + 5 + 1) * font_height;
-            screen.w = FB_WIDTH * 8;
-            screen.h = FB_HEIGHT * 8;
+            fit_screen(750, 16 + (17 + 1 + 5 + 1) * font_height, FB_WIDTH * 8, FB_HEIGHT * 8);
 
             render_registers(750, 16);
-            render_memory(32, 16, memory_view);
+            render_memory(32, 16);
             render_instruction(750, 16 + (17 + 1) * font_height);
         }
 
         render_screen(&screen);
+        flush_text();
 
         SDL_RenderPresent(ren);
+
+        // the guest runs on its own thread, this only paces the display
+        frame_time += 1000 / FRAME_RATE;
+
+        if ((int32_t)(frame_time - SDL_GetTicks()) <= 0)
+            frame_time = SDL_GetTicks();
+
+        // keys go to the guest as they come, not once a frame
+        int32_t left;
+
+        while (!quit && (left = frame_time - SDL_GetTicks()) > 0)
+        {
+            if (SDL_WaitEventTimeout(&event, left))
+                handle_event(event);
+        }
     }
 
+    emulator.stop();
+    trace.close();
+
+    if (profile_path != nullptr)
+        emulator.profiler.write(profile_path, machine.cpu);
     clean_all();
 
     return 0;
@@ -0,0 +1,85 @@
+#include <pool.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Every worker starts with a contiguous share of the indices and takes work
+// from the back of its own queue. Once that runs dry it steals from the
+// front of the other queues, so long-running guests do not leave the
+// remaining cores idle.
+
+struct WorkQueue
+{
+    std::mutex lock;
+    std::deque<size_t> items;
+};
+
+bool pop(WorkQueue& queue, size_t& item, bool back)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    if (queue.items.empty())
+        return false;
+
+    if (back)
+    {
+        item = queue.items.back();
+        queue.items.pop_back();
+    }
+    else
+    {
+        item = queue.items.front();
+        queue.items.pop_front();
+    }
+
+    return true;
+}
+
+void parallel_for(size_t count, int threads, const std::function<void(size_t)>& task)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if ((size_t)threads > count)
+        threads = count;
+
+    if (threads <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            task(i);
+
+        return;
+    }
+
+    std::vector<WorkQueue> queues(threads);
+
+    for (size_t i = 0; i < count; i++)
+        queues[i * threads / count].items.push_back(i);
+
+    std::vector<std::thread> workers;
+
+    for (int id = 0; id < threads; id++)
+    {
+        workers.emplace_back([&, id]()
+        {
+            size_t item;
+
+            while (true)
+            {
+                bool found = pop(queues[id], item, true);
+
+                for (int i = 1; i < threads && !found; i++)
+                    found = pop(queues[(id + i) % threads], item, false);
+
+                if (!found)
+                    break;
+
+                task(item);
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
@@ -0,0 +1,229 @@
+#include <profiler.h>
+#include <cpu.h>
+#include <disassembler.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+const char* class_name[] = { "lui", "auipc", "jal", "jalr", "branch", "load", "store", "alu-imm", "alu", "muldiv", "system", "other" };
+
+ProfileClass classify(uint32_t inst)
+{
+    inst = expand_compressed(inst);
+
+    switch (inst & OPCODE_MASK)
+    {
+    case OPCODE_LUI:    return CLASS_LUI;
+    case OPCODE_AUIPC:  return CLASS_AUIPC;
+    case OPCODE_JAL:    return CLASS_JAL;
+    case OPCODE_JALR:   return CLASS_JALR;
+    case OPCODE_BRANCH: return CLASS_BRANCH;
+    case OPCODE_LOAD:   return CLASS_LOAD;
+    case OPCODE_STORE:  return CLASS_STORE;
+    case OPCODE_ALUI:   return CLASS_ALU_IMM;
+    case OPCODE_ALU:    return (inst >> 25) == 1 ? CLASS_MULDIV : CLASS_ALU;
+    case OPCODE_SYSTEM: return CLASS_SYSTEM;
+
+    default: return CLASS_OTHER;
+    }
+}
+
+Profiler::Profiler()
+{
+    clear();
+}
+
+void Profiler::clear()
+{
+    pages.clear();
+    last = nullptr;
+    std::fill(classes, classes + CLASS_COUNT, 0);
+    max_hits = 0;
+
+    expected = 0;
+    transfer = true;
+
+    // the root stands for whatever was running when profiling started
+    nodes.assign(1, { 0, 0, 0 });
+    children.clear();
+    stack = 0;
+}
+
+void Profiler::record(uint32_t pc, uint32_t inst, uint32_t next)
+{
+    if (last == nullptr || pc >> PAGE_SHIFT != last_page)
+    {
+        last_page = pc >> PAGE_SHIFT;
+        last = &pages[last_page];
+    }
+
+    uint32_t index = (pc & (PAGE_SIZE - 1)) >> 1;
+
+    if (++last->hits[index] > max_hits)
+        max_hits = last->hits[index];
+
+    // a block starts wherever control did not simply fall through
+    if (transfer || pc != expected)
+        last->blocks[index]++;
+
+    uint32_t size = inst_size(inst);
+
+    inst = expand_compressed(inst);
+
+    ProfileClass type = classify(inst);
+    uint32_t dest = (inst >> 7) & 31;
+    uint32_t src1 = (inst >> 15) & 31;
+
+    classes[type]++;
+    nodes[stack].samples++;
+
+    if (type == CLASS_BRANCH && next != pc + size)
+        last->taken[index]++;
+
+    // calls link a register, returns jump through ra without linking
+    if ((type == CLASS_JAL || type == CLASS_JALR) && dest != 0)
+        call(next);
+    else if (type == CLASS_JALR && dest == 0 && src1 == 1 && stack != 0)
+        stack = nodes[stack].parent;
+
+    transfer = type == CLASS_JAL || type == CLASS_JALR || type == CLASS_BRANCH;
+    expected = pc + size;
+}
+
+void Profiler::call(uint32_t target)
+{
+    uint64_t key = (uint64_t)stack << 32 | target;
+    auto it = children.find(key);
+
+    if (it != children.end())
+    {
+        stack = it->second;
+        return;
+    }
+
+    nodes.push_back({ stack, target, 0 });
+    stack = nodes.size() - 1;
+    children[key] = stack;
+}
+
+uint64_t Profiler::count(uint32_t address) const
+{
+    auto it = pages.find(address >> PAGE_SHIFT);
+
+    if (it == pages.end())
+        return 0;
+
+    return it->second.hits[(address & (PAGE_SIZE - 1)) >> 1];
+}
+
+uint8_t Profiler::heat(uint32_t address) const
+{
+    uint64_t hits = count(address);
+
+    if (hits == 0)
+        return 0;
+
+    return 1 + 254 * std::log((double)hits) / std::log((double)max_hits + 1);
+}
+
+bool Profiler::write(const std::string& prefix, CPU& cpu) const
+{
+    return write_csv((prefix + ".csv").c_str(), cpu) && write_mix((prefix + ".mix.csv").c_str()) && write_folded((prefix + ".folded").c_str());
+}
+
+bool Profiler::write_csv(const char* path, CPU& cpu) const
+{
+    std::ofstream file(path);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    file << "address,instruction,disassembly,hits,block_entries,taken,not_taken\n";
+
+    for (const auto& entry : pages)
+    {
+        const ProfilePage& page = entry.second;
+
+        for (uint32_t i = 0; i < PAGE_SIZE / 2; i++)
+        {
+            if (page.hits[i] == 0)
+                continue;
+
+            uint32_t address = entry.first << PAGE_SHIFT | i * 2;
+            uint32_t inst = *((uint16_t*)&cpu.memory[address]);
+
+            if (inst_size(inst) == 4)
+                inst |= *((uint16_t*)&cpu.memory[address + 2]) << 16;
+
+            bool branch = classify(inst) == CLASS_BRANCH;
+
+            char text[DISASSEMBLY_SIZE];
+            disassemble(inst, text, sizeof(text));
+
+            file << fmt("%08x,%08x,\"%s\",", address, inst, text) << page.hits[i] << "," << page.blocks[i] << ",";
+
+            if (branch)
+                file << page.taken[i] << "," << page.hits[i] - page.taken[i];
+            else
+                file << ",";
+
+            file << "\n";
+        }
+    }
+
+    return true;
+}
+
+bool Profiler::write_mix(const char* path) const
+{
+    std::ofstream file(path);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    uint64_t total = 0;
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+        total += classes[i];
+
+    file << "class,count,share\n";
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+        file << class_name[i] << "," << classes[i] << "," << fmt("%.4f", total ? (double)classes[i] / total : 0.0) << "\n";
+
+    return true;
+}
+
+// one line per call stack, outermost function first, as flamegraph.pl and
+// speedscope read them
+bool Profiler::write_folded(const char* path) const
+{
+    std::ofstream file(path);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].samples == 0)
+            continue;
+
+        std::string line;
+
+        for (uint32_t node = i; node != 0; node = nodes[node].parent)
+            line = fmt(";%08x", nodes[node].function) + line;
+
+        file << "entry" << line << " " << nodes[i].samples << "\n";
+    }
+
+    return true;
+}
@@ -0,0 +1,49 @@
+#include <ram.h>
+#include <bus.h>
+#include <stdexcept>
+#include <sys/mman.h>
+
+// no swap is set aside for the mapping, untouched pages cost nothing
+static uint8_t* reserve(uint64_t size)
+{
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Could not reserve guest memory");
+
+    return (uint8_t*)mapping;
+}
+
+Ram::Ram(uint64_t _size) : base(reserve(_size)), length(_size) {}
+
+Ram::~Ram()
+{
+    munmap(base, length);
+}
+
+void Ram::clear()
+{
+    // replacing the mapping is the only way to drop private file pages
+    if (mmap(base, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        throw std::runtime_error("Could not clear guest memory");
+}
+
+void Ram::resize(uint64_t _size)
+{
+    uint8_t* mapping = reserve(_size);
+
+    munmap(base, length);
+    base = mapping;
+    length = _size;
+}
+
+bool Ram::map_file(uint32_t address, int fd, uint64_t offset, uint32_t size)
+{
+    if (((address | offset | size) & (PAGE_SIZE - 1)) != 0 || (uint64_t)address + size > length)
+        return false;
+
+    if (size == 0)
+        return true;
+
+    return mmap(base + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED;
+}
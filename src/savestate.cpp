@@ -0,0 +1,220 @@
+#include <savestate.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+// on disk, a header and the registers are followed by index and contents
+// of every page that is not all zero
+struct StateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_count;
+    uint32_t stored;
+
+    uint32_t x[32];
+    uint32_t pc;
+    uint32_t exit_code;
+    uint32_t random;
+    uint32_t brk;
+    Csrs csr;
+    uint64_t instret;
+    uint64_t idle;
+    uint64_t mtimecmp;
+    int8_t keyboard[2];
+    uint8_t halted;
+    uint8_t tohost;
+    uint8_t waiting;
+    uint8_t trapped;
+};
+
+const std::shared_ptr<const Page>& zero_page()
+{
+    static const std::shared_ptr<const Page> page = std::make_shared<const Page>(Page{});
+
+    return page;
+}
+
+const std::shared_ptr<const Page>& PageTable::find(uint32_t index) const
+{
+    static const std::shared_ptr<const Page> none;
+    const std::shared_ptr<const PageDirectory>& directory = directories[index >> (PAGE_DIRECTORY_SHIFT + PAGE_LEAF_SHIFT)];
+
+    if (directory == nullptr)
+        return none;
+
+    const std::shared_ptr<const PageLeaf>& leaf = (*directory)[(index >> PAGE_LEAF_SHIFT) & (PAGE_DIRECTORY_SIZE - 1)];
+
+    return leaf != nullptr ? (*leaf)[index & (PAGE_LEAF_SIZE - 1)] : none;
+}
+
+// in order, each directory and leaf a change is in is copied once
+std::shared_ptr<const PageTable> PageTable::update(PageChanges changes) const
+{
+    auto table = std::make_shared<PageTable>(*this);
+    std::shared_ptr<PageDirectory> directory;
+    std::shared_ptr<PageLeaf> leaf;
+    uint32_t directory_at = UINT32_MAX;
+    uint32_t leaf_at = UINT32_MAX;
+
+    std::sort(changes.begin(), changes.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    for (const auto& change : changes)
+    {
+        uint32_t i = change.first >> (PAGE_DIRECTORY_SHIFT + PAGE_LEAF_SHIFT);
+        uint32_t j = (change.first >> PAGE_LEAF_SHIFT) & (PAGE_DIRECTORY_SIZE - 1);
+
+        if (i != directory_at)
+        {
+            directory = directories[i] != nullptr ? std::make_shared<PageDirectory>(*directories[i]) : std::make_shared<PageDirectory>();
+            table->directories[i] = directory;
+            directory_at = i;
+        }
+
+        if (change.first >> PAGE_LEAF_SHIFT != leaf_at)
+        {
+            leaf = (*directory)[j] != nullptr ? std::make_shared<PageLeaf>(*(*directory)[j]) : std::make_shared<PageLeaf>();
+            (*directory)[j] = leaf;
+            leaf_at = change.first >> PAGE_LEAF_SHIFT;
+        }
+
+        (*leaf)[change.first & (PAGE_LEAF_SIZE - 1)] = change.second;
+    }
+
+    return table;
+}
+
+bool is_zero(const Page& page)
+{
+    for (uint8_t byte : page)
+    {
+        if (byte != 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool write_state(const char* path, const SaveState& state)
+{
+    std::ofstream file(path, std::ios::binary);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    StateHeader header = {};
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.page_count = state.page_count;
+
+    std::vector<std::pair<uint32_t, const Page*>> stored;
+
+    if (state.pages != nullptr)
+    {
+        state.pages->each([&](uint32_t index, const std::shared_ptr<const Page>& page)
+        {
+            if (page != zero_page() && !is_zero(*page))
+                stored.push_back({ index, page.get() });
+        });
+    }
+
+    header.stored = stored.size();
+
+    for (int i = 0; i < 32; i++)
+        header.x[i] = state.x[i];
+
+    header.pc = state.pc;
+    header.exit_code = state.exit_code;
+    header.random = state.random;
+    header.brk = state.brk;
+    header.csr = state.csr;
+    header.instret = state.instret;
+    header.idle = state.idle;
+    header.mtimecmp = state.mtimecmp;
+    header.keyboard[0] = state.keyboard[0];
+    header.keyboard[1] = state.keyboard[1];
+    header.halted = state.halted;
+    header.tohost = state.tohost;
+    header.waiting = state.waiting;
+    header.trapped = state.trapped;
+
+    file.write((const char*)&header, sizeof(header));
+
+    for (const auto& entry : stored)
+    {
+        file.write((const char*)&entry.first, sizeof(entry.first));
+        file.write((const char*)entry.second->data(), entry.second->size());
+    }
+
+    if (!file)
+    {
+        fprintf(stderr, "Could not write `%s`\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool read_state(const char* path, SaveState& state)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.is_open())
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    StateHeader header;
+
+    if (!file.read((char*)&header, sizeof(header)) || header.magic != STATE_MAGIC || header.version != STATE_VERSION
+        || header.page_count > BUS_PAGES || header.stored > header.page_count)
+    {
+        fprintf(stderr, "`%s` is not a save state\n", path);
+        return false;
+    }
+
+    for (int i = 0; i < 32; i++)
+        state.x[i] = header.x[i];
+
+    state.pc = header.pc;
+    state.exit_code = header.exit_code;
+    state.random = header.random;
+    state.brk = header.brk;
+    state.csr = header.csr;
+    state.instret = header.instret;
+    state.idle = header.idle;
+    state.mtimecmp = header.mtimecmp;
+    state.keyboard[0] = header.keyboard[0];
+    state.keyboard[1] = header.keyboard[1];
+    state.halted = header.halted;
+    state.tohost = header.tohost;
+    state.waiting = header.waiting;
+    state.trapped = header.trapped;
+
+    state.page_count = header.page_count;
+
+    PageChanges pages;
+
+    for (uint32_t i = 0; i < header.stored; i++)
+    {
+        uint32_t index;
+        auto page = std::make_shared<Page>();
+
+        if (!file.read((char*)&index, sizeof(index)) || index >= header.page_count || !file.read((char*)page->data(), page->size()))
+        {
+            fprintf(stderr, "`%s` is truncated\n", path);
+            state = SaveState();
+            return false;
+        }
+
+        pages.push_back({ index, page });
+    }
+
+    state.pages = PageTable().update(pages);
+
+    return true;
+}
@@ -0,0 +1,79 @@
+#include <scheduler.h>
+#include <thread>
+
+using seconds = std::chrono::duration<double>;
+
+void Scheduler::start()
+{
+    frame_start = clock::now();
+    run_end = frame_start;
+    presented = frame_start;
+    window_start = frame_start;
+
+    owed = 0;
+    window_retired = retired;
+}
+
+void Scheduler::run_frame(CPU& cpu)
+{
+    run_frame([&cpu](uint64_t count) { return cpu.run(count); });
+}
+
+void Scheduler::run_frame(const std::function<uint64_t(uint64_t)>& run)
+{
+    clock::time_point now = clock::now();
+
+    double elapsed = seconds(now - frame_start).count();
+    double render_time = seconds(now - run_end).count();
+
+    frame_start = now;
+
+    if (elapsed > MAX_BACKLOG)
+        elapsed = MAX_BACKLOG;
+
+    if (ips != 0)
+    {
+        // guest time follows wall time, so slow frames get a bigger budget
+        owed += elapsed * ips;
+
+        uint64_t budget = owed;
+        owed -= budget;
+
+        retired += run(budget);
+    }
+    else
+    {
+        // leave room for rendering so frames still come out at FRAME_RATE
+        clock::time_point deadline = now + std::chrono::duration_cast<clock::duration>(seconds(1.0 / FRAME_RATE - render_time));
+
+        uint64_t ran;
+
+        do
+        {
+            ran = run(FAST_SLICE);
+            retired += ran;
+        } while (clock::now() < deadline && ran == FAST_SLICE);
+    }
+
+    run_end = clock::now();
+    update_mips(run_end);
+}
+
+void Scheduler::wait_frame()
+{
+    std::this_thread::sleep_until(presented + std::chrono::duration_cast<clock::duration>(seconds(1.0 / FRAME_RATE)));
+    presented = clock::now();
+}
+
+void Scheduler::update_mips(clock::time_point now)
+{
+    double window = seconds(now - window_start).count();
+
+    if (window < 1.0)
+        return;
+
+    mips = (retired - window_retired) / window / 1e6;
+
+    window_start = now;
+    window_retired = retired;
+}
@@ -0,0 +1,344 @@
+#include <syscalls.h>
+#include <cpu.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the flags a guest may pass through to the host, the same numbers in the
+// RISC-V and x86-64 Linux ABIs
+#define OPEN_FLAGS      (O_ACCMODE | O_APPEND | O_CREAT | O_TRUNC | O_EXCL)
+
+static uint32_t newlib_flags(uint32_t flags)
+{
+    uint32_t host = flags & NEWLIB_O_ACCMODE;
+
+    if (flags & NEWLIB_O_APPEND)
+        host |= O_APPEND;
+
+    if (flags & NEWLIB_O_CREAT)
+        host |= O_CREAT;
+
+    if (flags & NEWLIB_O_TRUNC)
+        host |= O_TRUNC;
+
+    if (flags & NEWLIB_O_EXCL)
+        host |= O_EXCL;
+
+    return host;
+}
+
+// every page of the range is RAM, absent ones are faulted in
+static bool guest_range(CPU& cpu, uint32_t address, uint32_t length)
+{
+    uint64_t end = (uint64_t)address + length;
+
+    if (end > cpu.memory_size)
+        return false;
+
+    for (uint64_t page = address >> PAGE_SHIFT; page << PAGE_SHIFT < end; page++)
+    {
+        if (!cpu.bus.fault_in(page))
+            return false;
+    }
+
+    return true;
+}
+
+// memory written behind the bus, as a store would have
+static void stored(CPU& cpu, uint32_t address, uint32_t length)
+{
+    uint64_t end = (uint64_t)address + length;
+
+    for (uint64_t line = address >> BUS_LINE_SHIFT; line << BUS_LINE_SHIFT < end; line++)
+        cpu.bus.dirty[line] = DIRTY_ALL;
+
+    for (uint64_t page = address >> PAGE_SHIFT; page << PAGE_SHIFT < end; page++)
+    {
+        cpu.bus.mark_changed(page);
+        cpu.invalidate_page(page << PAGE_SHIFT);
+    }
+}
+
+static bool guest_string(CPU& cpu, uint32_t address, std::string& text)
+{
+    text.clear();
+
+    for (uint32_t i = 0; i < SYSCALL_PATH; i++)
+    {
+        uint32_t at = address + i;
+
+        if ((i == 0 || (at & (PAGE_SIZE - 1)) == 0) && !guest_range(cpu, at, 1))
+            return false;
+
+        if (cpu.memory[at] == 0)
+            return true;
+
+        text += cpu.memory[at];
+    }
+
+    return false;
+}
+
+// both timespec layouts rv32 guests use, 32-bit nanoseconds land in the
+// lower half of the 64-bit field
+static int32_t write_time(CPU& cpu, uint32_t address, int64_t seconds, int64_t fraction)
+{
+    if (!guest_range(cpu, address, 16))
+        return -EFAULT;
+
+    memcpy(&cpu.memory[address], &seconds, 8);
+    memcpy(&cpu.memory[address + 8], &fraction, 8);
+    stored(cpu, address, 16);
+
+    return 0;
+}
+
+Syscalls::Syscalls() : files({ 0, 1, 2 }) {}
+
+Syscalls::~Syscalls()
+{
+    reset();
+
+    if (root >= 0)
+        ::close(root);
+}
+
+void Syscalls::reset()
+{
+    for (uint32_t i = 3; i < files.size(); i++)
+    {
+        if (files[i] >= 0)
+            ::close(files[i]);
+    }
+
+    files = { 0, 1, 2 };
+    brk = heap;
+}
+
+void Syscalls::call(CPU& cpu)
+{
+    const uint32_t* a = &cpu.x[10];
+    int32_t result;
+
+    switch (cpu.x[17])
+    {
+    case SYSCALL_READ:              result = read(cpu, a[0], a[1], a[2]);               break;
+    case SYSCALL_WRITE:             result = write(cpu, a[0], a[1], a[2]);              break;
+    case SYSCALL_OPEN:              result = open(cpu, a[0], newlib_flags(a[1]), a[2]); break;
+    case SYSCALL_OPENAT:            result = open(cpu, a[1], a[2] & OPEN_FLAGS, a[3]);  break;
+    case SYSCALL_CLOSE:             result = close(a[0]);                               break;
+    case SYSCALL_LSEEK:             result = lseek(a[0], a[1], a[2]);                   break;
+    case SYSCALL_FSTAT:             result = fstat(cpu, a[0], a[1]);                    break;
+    case SYSCALL_CLOCK_GETTIME:
+    case SYSCALL_CLOCK_GETTIME64:   result = clock_gettime(cpu, a[0], a[1]);            break;
+    case SYSCALL_GETTIMEOFDAY:      result = gettimeofday(cpu, a[0]);                   break;
+    case SYSCALL_BRK:               result = set_brk(cpu, a[0]);                        break;
+    case SYSCALL_EXIT_GROUP:
+    {
+        cpu.halted = true;
+        cpu.exit_code = a[0];
+
+        return;
+    }
+
+    default: result = -ENOSYS; break;
+    }
+
+    cpu.x[10] = result;
+}
+
+int Syscalls::host_file(uint32_t fd) const
+{
+    return fd < files.size() ? files[fd] : -1;
+}
+
+// relative to the sandbox whatever the guest asks for, and resolved by the
+// kernel so that neither .. nor symlinks lead out of it
+int32_t Syscalls::open(CPU& cpu, uint32_t path, uint32_t flags, uint32_t mode)
+{
+    std::string name;
+
+    if (!guest_string(cpu, path, name))
+        return -EFAULT;
+
+    if (sandbox.empty())
+        return -EACCES;
+
+    if (root < 0)
+        root = ::open(sandbox.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    if (root < 0)
+        return -ENOENT;
+
+    size_t start = name.find_first_not_of('/');
+    name = start == std::string::npos ? "." : name.substr(start);
+
+    open_how how = {};
+    how.flags = flags | O_CLOEXEC;
+    how.mode = flags & O_CREAT ? mode & 0777 : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int host = ::syscall(SYS_openat2, root, name.c_str(), &how, sizeof(how));
+
+    if (host < 0)
+        return -errno;
+
+    for (uint32_t fd = 3; fd < SYSCALL_FILES; fd++)
+    {
+        if (fd == files.size())
+            files.push_back(-1);
+
+        if (files[fd] < 0)
+        {
+            files[fd] = host;
+            return fd;
+        }
+    }
+
+    ::close(host);
+
+    return -EMFILE;
+}
+
+int32_t Syscalls::close(uint32_t fd)
+{
+    int host = host_file(fd);
+
+    if (host < 0)
+        return -EBADF;
+
+    // the host's own standard streams stay open
+    if (fd >= 3)
+        ::close(host);
+
+    files[fd] = -1;
+
+    return 0;
+}
+
+int32_t Syscalls::read(CPU& cpu, uint32_t fd, uint32_t address, uint32_t length)
+{
+    int host = host_file(fd);
+
+    if (host < 0)
+        return -EBADF;
+
+    if (!guest_range(cpu, address, length))
+        return -EFAULT;
+
+    ssize_t count = ::read(host, &cpu.memory[address], length);
+
+    if (count < 0)
+        return -errno;
+
+    stored(cpu, address, count);
+
+    return count;
+}
+
+int32_t Syscalls::write(CPU& cpu, uint32_t fd, uint32_t address, uint32_t length)
+{
+    int host = host_file(fd);
+
+    if (host < 0)
+        return -EBADF;
+
+    if (!guest_range(cpu, address, length))
+        return -EFAULT;
+
+    ssize_t count = ::write(host, &cpu.memory[address], length);
+
+    return count < 0 ? -errno : count;
+}
+
+int32_t Syscalls::lseek(uint32_t fd, int32_t offset, uint32_t whence)
+{
+    int host = host_file(fd);
+
+    if (host < 0)
+        return -EBADF;
+
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)
+        return -EINVAL;
+
+    off_t position = ::lseek(host, offset, whence);
+
+    if (position < 0)
+        return -errno;
+
+    return position > INT32_MAX ? -EOVERFLOW : position;
+}
+
+int32_t Syscalls::fstat(CPU& cpu, uint32_t fd, uint32_t address)
+{
+    int host = host_file(fd);
+    struct stat info;
+
+    if (host < 0)
+        return -EBADF;
+
+    if (::fstat(host, &info) != 0)
+        return -errno;
+
+    if (!guest_range(cpu, address, GUEST_STAT_SIZE))
+        return -EFAULT;
+
+    uint32_t mode = info.st_mode;
+    uint32_t links = info.st_nlink;
+    int64_t size = info.st_size;
+    int32_t block = info.st_blksize;
+    uint8_t* guest = &cpu.memory[address];
+
+    memset(guest, 0, GUEST_STAT_SIZE);
+    memcpy(guest + GUEST_STAT_MODE, &mode, 4);
+    memcpy(guest + GUEST_STAT_NLINK, &links, 4);
+    memcpy(guest + GUEST_STAT_SIZE_FIELD, &size, 8);
+    memcpy(guest + GUEST_STAT_BLKSIZE, &block, 4);
+    stored(cpu, address, GUEST_STAT_SIZE);
+
+    return 0;
+}
+
+int32_t Syscalls::clock_gettime(CPU& cpu, uint32_t clock, uint32_t address)
+{
+    clockid_t host;
+
+    switch (clock)
+    {
+    case CLOCK_REALTIME:            host = CLOCK_REALTIME;          break;
+    case CLOCK_MONOTONIC:           host = CLOCK_MONOTONIC;         break;
+
+    // the guest is one thread among the others of the host process
+    case CLOCK_PROCESS_CPUTIME_ID:
+    case CLOCK_THREAD_CPUTIME_ID:   host = CLOCK_THREAD_CPUTIME_ID; break;
+
+    default: return -EINVAL;
+    }
+
+    timespec now;
+    ::clock_gettime(host, &now);
+
+    return write_time(cpu, address, now.tv_sec, now.tv_nsec);
+}
+
+int32_t Syscalls::gettimeofday(CPU& cpu, uint32_t address)
+{
+    timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+
+    return address == 0 ? 0 : write_time(cpu, address, now.tv_sec, now.tv_nsec / 1000);
+}
+
+// brk(0) and anything out of range report the current break, like Linux
+uint32_t Syscalls::set_brk(CPU& cpu, uint32_t address)
+{
+    if (address >= heap && address <= cpu.memory_size)
+        brk = address;
+
+    return brk;
+}
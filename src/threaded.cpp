@@ -0,0 +1,248 @@
+#include <cpu.h>
+
+// Threaded-code engine: every concrete instruction has its own label and
+// each one jumps straight to the next through a computed goto, so there is
+// a single indirect branch per guest instruction. Instructions are shared
+// with the interpreter through CPU::fetch(), which also keeps them in sync
+// with stores into code. Loads and stores that miss plain RAM, or are
+// misaligned, take the handler so the bus can dispatch or fault. Decoded
+// entries are per halfword, so compressed instructions step d by one and
+// the rest by two, and the empty entries past the end of a page send the
+// step off it to refetch.
+
+#define NEXT_SIZE(size)                                     \
+    do                                                      \
+    {                                                       \
+        if (__builtin_expect((size) == 4, 1))               \
+        {                                                   \
+            pc += 4;                                        \
+            d += 2;                                         \
+        }                                                   \
+        else                                                \
+        {                                                   \
+            pc += 2;                                        \
+            d += 1;                                         \
+        }                                                   \
+        if (--count == 0)                                   \
+            goto done;                                      \
+        x[0] = 0;                                           \
+        goto *labels[d->op];                                \
+    } while (0)
+
+#define NEXT()              NEXT_SIZE(d->size)
+
+#define JUMP(target)                                        \
+    do                                                      \
+    {                                                       \
+        pc = (target);                                      \
+        if (--count == 0)                                   \
+            goto done;                                      \
+        goto refetch;                                       \
+    } while (0)
+
+#define BRANCH(cond)                                        \
+    do                                                      \
+    {                                                       \
+        if (cond)                                           \
+            JUMP(pc + d->imm);                              \
+        NEXT();                                             \
+    } while (0)
+
+#define RAM(address, size)  ((((address) & ((size) - 1)) | pages[(address) >> PAGE_SHIFT]) == 0)
+
+#define LOAD(type)                                          \
+    do                                                      \
+    {                                                       \
+        uint32_t address = x[d->src1] + d->imm;             \
+        if (!RAM(address, sizeof(type)))                    \
+            goto op_reference;                              \
+        x[d->dest] = *((type*)&memory[address]);            \
+        NEXT();                                             \
+    } while (0)
+
+uint64_t run_threaded(CPU& cpu, uint64_t count)
+{
+    static void* labels[OP_COUNT] =
+    {
+        &&op_none, &&op_reference,
+        &&op_lui, &&op_auipc, &&op_jal, &&op_jalr,
+        &&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_bltu, &&op_bgeu,
+        &&op_lb, &&op_lh, &&op_lw, &&op_lbu, &&op_lhu,
+        &&op_sb, &&op_sh, &&op_sw,
+        &&op_addi, &&op_slti, &&op_sltiu, &&op_xori, &&op_ori, &&op_andi, &&op_slli, &&op_srli, &&op_srai,
+        &&op_add, &&op_sub, &&op_sll, &&op_slt, &&op_sltu, &&op_xor, &&op_srl, &&op_sra, &&op_or, &&op_and,
+        &&op_mul, &&op_mulh, &&op_mulhsu, &&op_mulhu, &&op_div, &&op_divu, &&op_rem, &&op_remu,
+    };
+
+    if (count == 0 || cpu.halted)
+        return 0;
+
+    uint64_t total = count;
+    uint64_t retired = cpu.instret;
+    uint32_t* x = cpu.x;
+    uint8_t* memory = cpu.memory;
+    const uint8_t* pages = cpu.bus.pages.data();
+    Bus& bus = cpu.bus;
+    uint32_t pc = cpu.pc;
+    const Decoded* d;
+
+refetch:
+
+    if ((pc & 1) != 0 || pages[pc >> PAGE_SHIFT] != BUS_RAM)
+    {
+        cpu.pc = pc;
+        cpu.instret = retired + total - count;
+        cpu.advance();
+        pc = cpu.pc;
+
+        // a breakpoint did not retire
+        count = total - (cpu.instret - retired);
+
+        if (count == 0 || cpu.halted)
+            goto done;
+
+        goto refetch;
+    }
+
+    d = &cpu.fetch(pc);
+    x[0] = 0;
+    goto *labels[d->op];
+
+op_none:
+
+    // entry cleared by a store since the block was entered, or past the page
+    goto refetch;
+
+op_reference:
+{
+    // devices may read the time, and the handler may clear d itself
+    uint32_t size = d->size;
+
+    cpu.pc = pc;
+    cpu.instret = retired + total - count;
+    (cpu.*d->handler)(*d);
+
+    if (cpu.halted)
+    {
+        // a breakpoint stops before its instruction, which did not retire
+        if (!cpu.has_breakpoint(pc))
+            count--;
+
+        pc = cpu.pc;
+        goto done;
+    }
+
+    // devices are reached through here, stay on the fast path afterwards
+    if (cpu.pc == pc + size)
+        NEXT_SIZE(size);
+
+    JUMP(cpu.pc);
+}
+
+op_lui:     x[d->dest] = d->imm;                                        NEXT();
+op_auipc:   x[d->dest] = pc + d->imm;                                   NEXT();
+op_jal:     x[d->dest] = pc + d->size;                                  JUMP(pc + d->imm);
+op_jalr:
+{
+    uint32_t target = (x[d->src1] + d->imm) & ~1u;
+    x[d->dest] = pc + d->size;
+    JUMP(target);
+}
+
+op_beq:     BRANCH(x[d->src1] == x[d->src2]);
+op_bne:     BRANCH(x[d->src1] != x[d->src2]);
+op_blt:     BRANCH((int)x[d->src1] < (int)x[d->src2]);
+op_bge:     BRANCH((int)x[d->src1] >= (int)x[d->src2]);
+op_bltu:    BRANCH(x[d->src1] < x[d->src2]);
+op_bgeu:    BRANCH(x[d->src1] >= x[d->src2]);
+
+op_lb:      LOAD(int8_t);
+op_lh:      LOAD(int16_t);
+op_lw:      LOAD(uint32_t);
+op_lbu:     LOAD(uint8_t);
+op_lhu:     LOAD(uint16_t);
+
+op_sb:
+{
+    uint32_t address = x[d->src1] + d->imm;
+
+    if (!RAM(address, 1))
+        goto op_reference;
+
+    // the store may clear d itself
+    uint32_t size = d->size;
+
+    *((uint8_t*)&memory[address]) = (uint8_t)x[d->src2];
+    bus.mark_store(address);
+    cpu.invalidate(address);
+    NEXT_SIZE(size);
+}
+op_sh:
+{
+    uint32_t address = x[d->src1] + d->imm;
+
+    if (!RAM(address, 2))
+        goto op_reference;
+
+    uint32_t size = d->size;
+
+    *((uint16_t*)&memory[address]) = (uint16_t)x[d->src2];
+    bus.mark_store(address);
+    cpu.invalidate(address);
+    cpu.invalidate(address + 1);
+    NEXT_SIZE(size);
+}
+op_sw:
+{
+    uint32_t address = x[d->src1] + d->imm;
+
+    if (!RAM(address, 4))
+        goto op_reference;
+
+    uint32_t size = d->size;
+
+    *((uint32_t*)&memory[address]) = x[d->src2];
+    bus.mark_store(address);
+    cpu.invalidate(address);
+    cpu.invalidate(address + 3);
+    NEXT_SIZE(size);
+}
+
+op_addi:    x[d->dest] = x[d->src1] + d->imm;                           NEXT();
+op_slti:    x[d->dest] = (int)x[d->src1] < (int)d->imm;                 NEXT();
+op_sltiu:   x[d->dest] = x[d->src1] < d->imm;                           NEXT();
+op_xori:    x[d->dest] = x[d->src1] ^ d->imm;                           NEXT();
+op_ori:     x[d->dest] = x[d->src1] | d->imm;                           NEXT();
+op_andi:    x[d->dest] = x[d->src1] & d->imm;                           NEXT();
+op_slli:    x[d->dest] = x[d->src1] << d->imm;                          NEXT();
+op_srli:    x[d->dest] = x[d->src1] >> d->imm;                          NEXT();
+op_srai:    x[d->dest] = (int)x[d->src1] >> d->imm;                     NEXT();
+
+op_add:     x[d->dest] = x[d->src1] + x[d->src2];                       NEXT();
+op_sub:     x[d->dest] = x[d->src1] - x[d->src2];                       NEXT();
+op_sll:     x[d->dest] = x[d->src1] << (x[d->src2] & 31);               NEXT();
+op_slt:     x[d->dest] = (int)x[d->src1] < (int)x[d->src2];             NEXT();
+op_sltu:    x[d->dest] = x[d->src1] < x[d->src2];                       NEXT();
+op_xor:     x[d->dest] = x[d->src1] ^ x[d->src2];                       NEXT();
+op_srl:     x[d->dest] = x[d->src1] >> (x[d->src2] & 31);               NEXT();
+op_sra:     x[d->dest] = (int)x[d->src1] >> (x[d->src2] & 31);          NEXT();
+op_or:      x[d->dest] = x[d->src1] | x[d->src2];                       NEXT();
+op_and:     x[d->dest] = x[d->src1] & x[d->src2];                       NEXT();
+
+op_mul:     x[d->dest] = x[d->src1] * x[d->src2];                                           NEXT();
+op_mulh:    x[d->dest] = ((int64_t)(int32_t)x[d->src1] * (int32_t)x[d->src2]) >> 32;        NEXT();
+op_mulhsu:  x[d->dest] = ((int64_t)(int32_t)x[d->src1] * (int64_t)x[d->src2]) >> 32;        NEXT();
+op_mulhu:   x[d->dest] = ((uint64_t)x[d->src1] * x[d->src2]) >> 32;                         NEXT();
+op_div:     x[d->dest] = div_signed(x[d->src1], x[d->src2]);                                NEXT();
+op_divu:    x[d->dest] = div_unsigned(x[d->src1], x[d->src2]);                              NEXT();
+op_rem:     x[d->dest] = rem_signed(x[d->src1], x[d->src2]);                                NEXT();
+op_remu:    x[d->dest] = rem_unsigned(x[d->src1], x[d->src2]);                              NEXT();
+
+done:
+
+    cpu.pc = pc;
+    cpu.dirty = -1;
+    cpu.instret = retired + total - count;
+
+    return total - count;
+}
@@ -0,0 +1,315 @@
+#include <trace.h>
+#include <cpu.h>
+
+uint32_t zigzag(uint32_t value)
+{
+    return (value << 1) ^ (uint32_t)((int32_t)value >> 31);
+}
+
+uint32_t unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+void put_varint(std::vector<uint8_t>& out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(value | 0x80);
+        value >>= 7;
+    }
+
+    out.push_back(value);
+}
+
+bool get_varint(FILE* file, uint32_t& value)
+{
+    value = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        int byte = getc(file);
+
+        if (byte == EOF)
+            return false;
+
+        value |= (uint32_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+bool is_store(uint32_t inst)
+{
+    return (inst & 0x7f) == 0b0100011;
+}
+
+uint32_t store_mask(uint32_t inst)
+{
+    uint32_t size = 1 << ((inst >> 12) & 3);
+
+    return size == 4 ? 0xffffffff : (1u << (size * 8)) - 1;
+}
+
+void TraceModel::encode(const TraceRecord& record, std::vector<uint8_t>& out)
+{
+    uint32_t slot = (record.pc >> 1) % TRACE_CACHE;
+    uint8_t flags = record.flags & (TRACE_VALUE | TRACE_MEMORY);
+
+    if (record.pc != pc)
+        flags |= TRACE_JUMP;
+
+    if (cache_pc[slot] != record.pc || cache_inst[slot] != record.inst)
+        flags |= TRACE_NEW;
+
+    uint32_t inst = expand_compressed(record.inst);
+
+    out.push_back(flags);
+
+    if (flags & TRACE_JUMP)
+        put_varint(out, zigzag(record.pc - pc));
+
+    if (flags & TRACE_NEW)
+    {
+        for (uint32_t i = 0; i < inst_size(record.inst) * 8; i += 8)
+            out.push_back(record.inst >> i);
+
+        cache_pc[slot] = record.pc;
+        cache_inst[slot] = record.inst;
+    }
+
+    if (flags & TRACE_VALUE)
+    {
+        uint32_t& reg = x[result_register(inst)];
+
+        put_varint(out, zigzag(record.value - reg));
+        reg = record.value;
+    }
+
+    if (flags & TRACE_MEMORY)
+    {
+        put_varint(out, zigzag(record.address - address));
+        address = record.address;
+
+        if (is_store(inst))
+            put_varint(out, record.data & store_mask(inst));
+    }
+
+    pc = record.pc + inst_size(record.inst);
+}
+
+bool TraceModel::decode(FILE* file, TraceRecord& record)
+{
+    int flags = getc(file);
+
+    if (flags == EOF)
+        return false;
+
+    uint32_t value;
+
+    record = {};
+    record.flags = flags & (TRACE_VALUE | TRACE_MEMORY);
+    record.pc = pc;
+
+    if (flags & TRACE_JUMP)
+    {
+        if (!get_varint(file, value))
+            return false;
+
+        record.pc += unzigzag(value);
+    }
+
+    uint32_t slot = (record.pc >> 1) % TRACE_CACHE;
+
+    if (flags & TRACE_NEW)
+    {
+        uint8_t bytes[4] = {};
+
+        if (fread(bytes, 1, 2, file) != 2)
+            return false;
+
+        if (inst_size(bytes[0]) == 4 && fread(bytes + 2, 1, 2, file) != 2)
+            return false;
+
+        cache_pc[slot] = record.pc;
+        cache_inst[slot] = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    }
+
+    record.inst = cache_inst[slot];
+
+    uint32_t inst = expand_compressed(record.inst);
+
+    if (flags & TRACE_VALUE)
+    {
+        if (!get_varint(file, value))
+            return false;
+
+        record.dest = result_register(inst);
+
+        uint32_t& reg = x[record.dest];
+
+        reg += unzigzag(value);
+        record.value = reg;
+    }
+
+    if (flags & TRACE_MEMORY)
+    {
+        if (!get_varint(file, value))
+            return false;
+
+        address += unzigzag(value);
+        record.address = address;
+
+        // a load's data is the value it wrote
+        if (!is_store(inst))
+            record.data = record.value;
+        else if (!get_varint(file, record.data))
+            return false;
+    }
+
+    pc = record.pc + inst_size(record.inst);
+
+    return true;
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+bool TraceWriter::open(const char* path)
+{
+    file = fopen(path, "wb");
+
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    uint32_t header[2] = { TRACE_MAGIC, TRACE_VERSION };
+    fwrite(header, sizeof(header), 1, file);
+
+    chunks.assign(TRACE_CHUNKS, std::vector<TraceRecord>(TRACE_CHUNK));
+    spare.clear();
+    full.clear();
+    closing = false;
+
+    for (size_t i = 1; i < chunks.size(); i++)
+        spare.push_back(&chunks[i]);
+
+    chunk = &chunks[0];
+    fill = 0;
+
+    thread = std::thread(&TraceWriter::loop, this);
+
+    return true;
+}
+
+void TraceWriter::close()
+{
+    if (file == nullptr)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (fill > 0)
+            full.push_back({ chunk, fill });
+
+        closing = true;
+    }
+
+    changed.notify_all();
+    thread.join();
+
+    fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::submit()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    full.push_back({ chunk, fill });
+    changed.notify_all();
+
+    // the writer is TRACE_CHUNKS chunks behind, let it catch up
+    changed.wait(guard, [this] { return !spare.empty(); });
+
+    chunk = spare.back();
+    spare.pop_back();
+    fill = 0;
+}
+
+void TraceWriter::loop()
+{
+    TraceModel model;
+    std::vector<uint8_t> out;
+
+    while (true)
+    {
+        std::pair<std::vector<TraceRecord>*, uint32_t> next;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            changed.wait(guard, [this] { return !full.empty() || closing; });
+
+            if (full.empty())
+                return;
+
+            next = full.front();
+            full.pop_front();
+        }
+
+        out.clear();
+
+        for (uint32_t i = 0; i < next.second; i++)
+            model.encode((*next.first)[i], out);
+
+        fwrite(out.data(), 1, out.size(), file);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            spare.push_back(next.first);
+        }
+
+        changed.notify_all();
+    }
+}
+
+TraceReader::~TraceReader()
+{
+    if (file != nullptr)
+        fclose(file);
+}
+
+bool TraceReader::open(const char* path)
+{
+    file = fopen(path, "rb");
+
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Could not open `%s`\n", path);
+        return false;
+    }
+
+    uint32_t header[2];
+
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION)
+    {
+        fprintf(stderr, "`%s` is not a trace\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool TraceReader::next(TraceRecord& record)
+{
+    return model.decode(file, record);
+}
@@ -0,0 +1,258 @@
+#include <cpu.h>
+#include <algorithm>
+
+// Machine mode traps, exceptions and interrupts. Handlers never throw: an
+// exception goes to the guest's own handler at mtvec, and only before the
+// guest set one up does it halt the guest for the host to report, which
+// step() and run() do by throwing a Fault once the engine stopped.
+//
+// Nothing here runs per instruction:
+// event is the guest time from which an enabled interrupt is due, run()
+// ends engine slices there and ready() only looks further once it passed.
+// Whatever changes which interrupts are enabled or pending goes through
+// reschedule(), which also stops the engine when that brings one forward.
+
+bool CPU::ready(uint64_t limit)
+{
+    if (yielded || paused)
+        halted = yielded = paused = false;
+
+    if (waiting)
+    {
+        if ((pending() & csr.mie) == 0)
+        {
+            // only the timer can end the wait, so time moves straight to it
+            if ((csr.mie & MIP_MTIP) == 0)
+                return false;
+
+            idle += std::min(mtimecmp - time(), limit);
+
+            if (time() < mtimecmp)
+                return false;
+        }
+
+        // with interrupts disabled the guest goes on after the wfi
+        halted = waiting = false;
+    }
+
+    if (halted)
+        return false;
+
+    if (time() >= event)
+    {
+        interrupt();
+        halted = yielded = false;
+    }
+
+    return true;
+}
+
+void CPU::raise(uint32_t bits)
+{
+    csr.mip |= bits;
+    reschedule();
+}
+
+void CPU::lower(uint32_t bits)
+{
+    csr.mip &= ~bits;
+    reschedule();
+}
+
+void CPU::set_timer(uint64_t compare)
+{
+    mtimecmp = compare;
+    reschedule();
+}
+
+void CPU::reschedule()
+{
+    uint32_t enabled = csr.mip & csr.mie;
+    uint64_t before = event;
+
+    if ((csr.mstatus & MSTATUS_MIE) == 0)
+        event = UINT64_MAX;
+    else if (enabled != 0)
+        event = 0;
+    else if (csr.mie & MIP_MTIP)
+        event = mtimecmp;
+    else
+        event = UINT64_MAX;
+
+    // the engine only stops at the event it started with
+    if (event < before && !halted)
+        halted = yielded = true;
+}
+
+// the highest priority one of those pending and enabled
+void CPU::interrupt()
+{
+    uint32_t enabled = pending() & csr.mie;
+
+    if ((csr.mstatus & MSTATUS_MIE) == 0 || enabled == 0)
+        return reschedule();
+
+    if (enabled & MIP_MEIP)
+        trap(MCAUSE_INTERRUPT | IRQ_EXTERNAL, 0);
+    else if (enabled & MIP_MSIP)
+        trap(MCAUSE_INTERRUPT | IRQ_SOFTWARE, 0);
+    else
+        trap(MCAUSE_INTERRUPT | IRQ_TIMER, 0);
+}
+
+void CPU::exception(uint32_t cause, uint32_t value)
+{
+    if (csr.mtvec != 0)
+        return trap(cause, value);
+
+    halted = true;
+    faulted = true;
+    fault_cause = cause;
+    fault_address = cause == FAULT_ILLEGAL ? pc : value;
+}
+
+void CPU::bus_fault()
+{
+    bus.faulted = false;
+    exception(bus.fault_cause, bus.fault_address);
+}
+
+// pc is still on the instruction, which did not retire after all
+void CPU::throw_fault()
+{
+    halted = false;
+    faulted = false;
+    instret--;
+
+    throw Fault(fault_cause, fault_address);
+}
+
+// interrupts return to pc, the vectored mode sends each to its own slot
+void CPU::trap(uint32_t cause, uint32_t value)
+{
+    csr.mepc = pc;
+    csr.mcause = cause;
+    csr.mtval = value;
+    csr.mstatus = (csr.mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE)) | (csr.mstatus & MSTATUS_MIE ? MSTATUS_MPIE : 0);
+
+    pc = csr.mtvec & ~3;
+
+    if ((cause & MCAUSE_INTERRUPT) && (csr.mtvec & 1))
+        pc += 4 * (cause & ~MCAUSE_INTERRUPT);
+
+    reschedule();
+}
+
+bool csr_allowed(uint32_t number, bool write)
+{
+    switch (number)
+    {
+    case CSR_MSTATUS:
+    case CSR_MISA:
+    case CSR_MIE:
+    case CSR_MTVEC:
+    case CSR_MSCRATCH:
+    case CSR_MEPC:
+    case CSR_MCAUSE:
+    case CSR_MTVAL:
+    case CSR_MIP:
+    case CSR_MCYCLE:
+    case CSR_MINSTRET:
+    case CSR_MCYCLEH:
+    case CSR_MINSTRETH:     return true;
+
+    case CSR_CYCLE:
+    case CSR_TIME:
+    case CSR_INSTRET:
+    case CSR_CYCLEH:
+    case CSR_TIMEH:
+    case CSR_INSTRETH:
+    case CSR_MVENDORID:
+    case CSR_MARCHID:
+    case CSR_MIMPID:
+    case CSR_MHARTID:       return !write;
+
+    default: return false;
+    }
+}
+
+// a cycle per instruction, and none while waiting
+uint32_t CPU::read_csr(uint32_t number)
+{
+    switch (number)
+    {
+    case CSR_MSTATUS:   return csr.mstatus | MSTATUS_MPP;
+    case CSR_MISA:      return MISA;
+    case CSR_MIE:       return csr.mie;
+    case CSR_MTVEC:     return csr.mtvec;
+    case CSR_MSCRATCH:  return csr.mscratch;
+    case CSR_MEPC:      return csr.mepc;
+    case CSR_MCAUSE:    return csr.mcause;
+    case CSR_MTVAL:     return csr.mtval;
+    case CSR_MIP:       return pending();
+
+    case CSR_CYCLE:
+    case CSR_INSTRET:
+    case CSR_MCYCLE:
+    case CSR_MINSTRET:  return instret;
+    case CSR_CYCLEH:
+    case CSR_INSTRETH:
+    case CSR_MCYCLEH:
+    case CSR_MINSTRETH: return instret >> 32;
+    case CSR_TIME:      return time();
+    case CSR_TIMEH:     return time() >> 32;
+
+    default: return 0;
+    }
+}
+
+// the bits mip has are set by the devices, misa is fixed and the counters
+// only count
+void CPU::write_csr(uint32_t number, uint32_t value)
+{
+    switch (number)
+    {
+    case CSR_MSTATUS:
+    {
+        csr.mstatus = value & (MSTATUS_MIE | MSTATUS_MPIE);
+        reschedule();
+
+        break;
+    }
+    case CSR_MIE:
+    {
+        csr.mie = value & (MIP_MSIP | MIP_MTIP | MIP_MEIP);
+        reschedule();
+
+        break;
+    }
+    case CSR_MTVEC:     csr.mtvec = value & ~2;     break;
+    case CSR_MSCRATCH:  csr.mscratch = value;       break;
+    case CSR_MEPC:      csr.mepc = value & ~1;      break;
+    case CSR_MCAUSE:    csr.mcause = value;         break;
+    case CSR_MTVAL:     csr.mtval = value;          break;
+
+    default: break;
+    }
+}
+
+// csrrw, csrrs and csrrc, the immediate forms take src1 as the value, and
+// setting or clearing nothing does not write
+void CPU::access_csr(const Decoded& d)
+{
+    uint32_t number = d.imm & 0xfff;
+    uint32_t operand = d.func3 & 0b100 ? d.src1 : x[d.src1];
+    uint32_t old = read_csr(number);
+
+    switch (d.func3 & 0b011)
+    {
+    case 0b01:  write_csr(number, operand);                             break;
+    case 0b10:  if (d.src1 != 0) write_csr(number, old | operand);      break;
+    case 0b11:  if (d.src1 != 0) write_csr(number, old & ~operand);     break;
+    }
+
+    x[d.dest] = old;
+    dirty = d.dest;
+
+    pc += d.size;
+}
@@ -0,0 +1,774 @@
+#include <cpu.h>
+#include <layout.h>
+#include <syscalls.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// Small guests run to their exit on every engine, each of which has to end
+// with the same exit code. They cover what the engines do on their own
+// rather than through the interpreter, where they have been seen to differ.
+// Some run again stopping at breakpoints and watchpoints, which must not
+// change what they retire.
+
+#define TEST_LIMIT      1000000
+#define TEST_HEAP       0x10000
+#define TEST_FILE       "t"
+#define A0              10
+#define A1              11
+#define A2              12
+#define A7              17
+#define S0              8
+#define RA              1
+#define T0              5
+#define T1              6
+#define T2              7
+#define C_NOP           0x0001
+
+struct Segment
+{
+    uint32_t address;
+    std::vector<uint32_t> words;
+};
+
+// timer is where mtimecmp starts
+struct Test
+{
+    const char* name;
+    std::vector<Segment> segments;
+    uint32_t expected;
+    uint64_t timer = UINT64_MAX;
+};
+
+uint32_t I(int32_t imm, uint8_t src1, uint8_t func3, uint8_t dest, uint8_t opcode)
+{
+    return (imm & 0xfff) << 20 | src1 << 15 | func3 << 12 | dest << 7 | opcode;
+}
+
+uint32_t S(int32_t imm, uint8_t src2, uint8_t src1, uint8_t func3)
+{
+    return ((imm >> 5) & 0x7f) << 25 | src2 << 20 | src1 << 15 | func3 << 12 | (imm & 0x1f) << 7 | OPCODE_STORE;
+}
+
+uint32_t R(uint8_t func7, uint8_t src2, uint8_t src1, uint8_t func3, uint8_t dest)
+{
+    return func7 << 25 | src2 << 20 | src1 << 15 | func3 << 12 | dest << 7 | OPCODE_ALU;
+}
+
+uint32_t J(int32_t imm, uint8_t dest)
+{
+    return ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3ff) << 21 | ((imm >> 11) & 1) << 20
+        | ((imm >> 12) & 0xff) << 12 | dest << 7 | OPCODE_JAL;
+}
+
+uint32_t LI(uint8_t dest, int32_t value) { return I(value, 0, 0b000, dest, OPCODE_ALUI); }
+uint32_t LW(uint8_t dest, int32_t address) { return I(address, 0, 0b010, dest, OPCODE_LOAD); }
+uint32_t SW(uint8_t src, int32_t address) { return S(address, src, 0, 0b010); }
+uint32_t RET() { return I(0, RA, 0b000, 0, OPCODE_JALR); }
+uint32_t MV(uint8_t dest, uint8_t src) { return I(0, src, 0b000, dest, OPCODE_ALUI); }
+uint32_t CALL(int32_t address) { return I(address, 0, 0b000, RA, OPCODE_JALR); }
+uint32_t ECALL() { return OPCODE_SYSTEM; }
+uint32_t EBREAK() { return I(1, 0, 0b000, 0, OPCODE_SYSTEM); }
+uint32_t MRET() { return I(SYSTEM_MRET, 0, 0b000, 0, OPCODE_SYSTEM); }
+uint32_t WFI() { return I(SYSTEM_WFI, 0, 0b000, 0, OPCODE_SYSTEM); }
+uint32_t CSRR(uint8_t dest, uint32_t number) { return I(number, 0, 0b010, dest, OPCODE_SYSTEM); }
+uint32_t CSRW(uint32_t number, uint8_t src) { return I(number, src, 0b001, 0, OPCODE_SYSTEM); }
+uint32_t CSRRS(uint8_t dest, uint32_t number, uint8_t src) { return I(number, src, 0b010, dest, OPCODE_SYSTEM); }
+uint32_t CSRRC(uint8_t dest, uint32_t number, uint8_t src) { return I(number, src, 0b011, dest, OPCODE_SYSTEM); }
+uint32_t CSRRSI(uint8_t dest, uint32_t number, uint8_t bits) { return I(number, bits, 0b110, dest, OPCODE_SYSTEM); }
+uint32_t CSRSI(uint32_t number, uint8_t bits) { return CSRRSI(0, number, bits); }
+uint32_t SLLI(uint8_t dest, uint8_t src, uint8_t shift) { return I(shift, src, 0b001, dest, OPCODE_ALUI); }
+uint32_t ANDI(uint8_t dest, uint8_t src, int32_t value) { return I(value, src, 0b111, dest, OPCODE_ALUI); }
+uint32_t XOR(uint8_t dest, uint8_t src1, uint8_t src2) { return R(0, src2, src1, 0b100, dest); }
+
+// lui and addi, the upper part rounded for the sign of the lower
+std::vector<uint32_t> load(uint8_t dest, uint32_t value)
+{
+    uint32_t upper = (value + 0x800) & 0xfffff000;
+
+    return { upper | dest << 7 | OPCODE_LUI, I(value - upper, dest, 0b000, dest, OPCODE_ALUI) };
+}
+
+// a guest that exits with the result of code, whatever comes before the exit
+Test exits_with(const char* name, std::vector<uint32_t> code, uint32_t expected)
+{
+    code.push_back(LI(A7, SYSCALL_EXIT));
+    code.push_back(ECALL());
+
+    return { name, { { 0x000, code } }, expected };
+}
+
+// instructions of either size back to back as they sit in memory, padded
+// to whole words with c.nop
+std::vector<uint32_t> pack(const std::vector<uint32_t>& code)
+{
+    std::vector<uint16_t> halves;
+
+    for (uint32_t inst : code)
+    {
+        halves.push_back(inst);
+
+        if (inst_size(inst) == 4)
+            halves.push_back(inst >> 16);
+    }
+
+    if (halves.size() % 2 != 0)
+        halves.push_back(C_NOP);
+
+    std::vector<uint32_t> words(halves.size() / 2);
+    memcpy(words.data(), halves.data(), halves.size() * 2);
+
+    return words;
+}
+
+// a system call on whatever is in a0 to a2
+std::vector<uint32_t> SYSCALL(uint32_t number)
+{
+    return { LI(A7, number), ECALL() };
+}
+
+// code put together from pieces
+std::vector<uint32_t> join(const std::vector<std::vector<uint32_t>>& pieces)
+{
+    std::vector<uint32_t> code;
+
+    for (const std::vector<uint32_t>& piece : pieces)
+        code.insert(code.end(), piece.begin(), piece.end());
+
+    return code;
+}
+
+// one RV32M instruction on a and b, whose result it exits with
+Test muldiv(const char* name, uint8_t func3, uint32_t a, uint32_t b, uint32_t expected)
+{
+    std::vector<uint32_t> code = load(T0, a);
+    std::vector<uint32_t> second = load(T1, b);
+
+    code.insert(code.end(), second.begin(), second.end());
+    code.push_back(R(0b0000001, T1, T0, func3, A0));
+
+    return exits_with(name, code, expected);
+}
+
+// A store over an instruction decoded before a flush of the JIT, while its
+// block is no longer translated: the store's own flush drops the blocks,
+// then the next store patches a function that was decoded but is not in
+// any block, and the call after it has to run the new instruction.
+Test self_modifying_after_flush()
+{
+    return
+    {
+        "smc-after-flush",
+        {
+            {
+                0x000,
+                {
+                    LI(A0, 0),
+                    J(0x100 - 0x004, RA),           // call f, decoding it
+                    LW(T1, 0x200),                  // the new first instruction of f
+                    LW(T2, 0x000),
+                    SW(T2, 0x000),                  // rewrite translated code as it is, a flush
+                    SW(T1, 0x100),                  // patch f
+                    J(0x100 - 0x018, RA),           // call f again
+                    LI(A7, SYSCALL_EXIT),
+                    ECALL(),
+                },
+            },
+            { 0x100, { LI(A0, 2), RET() } },
+            { 0x200, { LI(A0, 42) } },
+        },
+        42,
+    };
+}
+
+// jalr clears bit 0 of its target, an odd one is not misaligned
+Test jalr_odd_target()
+{
+    return
+    {
+        "jalr-odd-target",
+        {
+            {
+                0x000,
+                {
+                    LI(A0, 0),
+                    LI(T0, 0x0ff),
+                    I(2, T0, 0b000, RA, OPCODE_JALR),   // jalr ra, 2(t0), to 0x100
+                    LI(A7, SYSCALL_EXIT),
+                    ECALL(),
+                },
+            },
+            { 0x100, { LI(A0, 7), RET() } },
+        },
+        7,
+    };
+}
+
+// every compressed arithmetic form, one after another on the same value
+Test compressed_alu()
+{
+    return exits_with("c-alu", pack(
+    {
+        0x4455,     // c.li s0, 21
+        0x54f5,     // c.li s1, -3
+        0x0411,     // c.addi s0, 4
+        0x040a,     // c.slli s0, 2
+        0x80f1,     // c.srli s1, 28
+        0x6585,     // c.lui a1, 1
+        0x942e,     // c.add s0, a1
+        0x8c05,     // c.sub s0, s1
+        0x5641,     // c.li a2, -16
+        0x8609,     // c.srai a2, 2
+        0x8c31,     // c.xor s0, a2
+        0x46b1,     // c.li a3, 12
+        0x8c55,     // c.or s0, a3
+        0x5761,     // c.li a4, -8
+        0x8c79,     // c.and s0, a4
+        0x985d,     // c.andi s0, -9
+        C_NOP,
+        0x8522,     // c.mv a0, s0
+    }), 0xffffefa0);
+}
+
+// the compressed loads and stores, through sp and through a short register
+Test compressed_memory()
+{
+    return exits_with("c-memory", pack(
+    {
+        0x713d,     // c.addi16sp sp, -32
+        0x44a5,     // c.li s1, 9
+        0xc626,     // c.swsp s1, 12(sp)
+        0x0020,     // c.addi4spn s0, sp, 8
+        0x404c,     // c.lw a1, 4(s0)
+        0x4615,     // c.li a2, 5
+        0xc010,     // c.sw a2, 0(s0)
+        0x46a2,     // c.lwsp a3, 8(sp)
+        0x95b6,     // c.add a1, a3
+        0x6105,     // c.addi16sp sp, 32
+        0x958a,     // c.add a1, sp
+        0x852e,     // c.mv a0, a1
+    }), STACK_POINTER + 14);
+}
+
+// the compressed jumps and branches, with a 32-bit instruction that is not
+// word aligned; c.jalr goes to g, or to g + 1 when odd is set, which has
+// to land on g as well
+Test compressed_jumps(const char* name, bool odd)
+{
+    return
+    {
+        name,
+        {
+            {
+                0x000, pack(
+                {
+                    0x4505,                 // 00: c.li a0, 1
+                    0xa011,                 // 02: c.j 06
+                    0x457d,                 // 04: c.li a0, 31
+                    0x200d,                 // 06: c.jal f
+                    0x4401,                 // 08: c.li s0, 0
+                    0xc011,                 // 0a: c.beqz s0, 0e
+                    0x4579,                 // 0c: c.li a0, 30
+                    0xe011,                 // 0e: c.bnez s0, 12
+                    0x0511,                 // 10: c.addi a0, 4
+                    0x4495,                 // 12: c.li s1, 5
+                    0x050d,                 // 14: c.addi a0, 3
+                    0x14fd,                 // 16: c.addi s1, -1
+                    0xfcf5,                 // 18: c.bnez s1, 14
+                    LI(T0, 0x2e + odd),     // 1a
+                    0x9282,                 // 1e: c.jalr t0
+                    LI(A7, SYSCALL_EXIT),   // 20
+                    ECALL(),                // 24
+                    0x0506,                 // 28: f: c.slli a0, 1
+                    0x0505,                 // 2a: c.addi a0, 1
+                    0x8082,                 // 2c: c.jr ra
+                    0x0521,                 // 2e: g: c.addi a0, 8
+                    0x8082,                 // 30: c.jr ra
+                }),
+            },
+        },
+        30,
+    };
+}
+
+// c.jr clears bit 0 of its target like jalr
+Test compressed_jr_odd_target()
+{
+    return exits_with("c-jr-odd-target", pack(
+    {
+        LI(T0, 0x0b),       // 00
+        0x8282,             // 04: c.jr t0, to 0a
+        0x457d,             // 06: c.li a0, 31
+        0x4579,             // 08: c.li a0, 30
+        0x4525,             // 0a: c.li a0, 9
+    }), 9);
+}
+
+// brk's result has to be in a0 for the very next instruction
+Test syscall_brk()
+{
+    return exits_with("sys-brk", join(
+    {
+        { LI(A0, 0) },
+        SYSCALL(SYSCALL_BRK),
+        { I(0x100, A0, 0b000, A0, OPCODE_ALUI) },
+        SYSCALL(SYSCALL_BRK),
+        { I(1, A0, 0b000, A0, OPCODE_ALUI) },
+    }), TEST_HEAP + 0x101);
+}
+
+// a call the layer does not know fails with -ENOSYS, exit_group exits
+Test syscall_unknown()
+{
+    return { "sys-unknown", { { 0x000, join({ SYSCALL(500), SYSCALL(SYSCALL_EXIT_GROUP) }) } }, (uint32_t)-ENOSYS };
+}
+
+// A file in the sandbox is written from guest memory and read back over a
+// function that already ran, which the next call has to see changed the way
+// it does after a store.
+Test syscall_file()
+{
+    std::vector<uint32_t> code = join(
+    {
+        { CALL(0x100) },
+        { LI(A0, 0x200), LI(A1, NEWLIB_O_CREAT | NEWLIB_O_TRUNC | 2), LI(A2, 0644) },
+        SYSCALL(SYSCALL_OPEN),
+        { MV(S0, A0), LI(A1, 0x300), LI(A2, 4) },
+        SYSCALL(SYSCALL_WRITE),
+        { MV(A0, S0), LI(A1, 0), LI(A2, SEEK_SET) },
+        SYSCALL(SYSCALL_LSEEK),
+        { MV(A0, S0), LI(A1, 0x100), LI(A2, 4) },
+        SYSCALL(SYSCALL_READ),
+        { MV(A0, S0) },
+        SYSCALL(SYSCALL_CLOSE),
+        { CALL(0x100) },
+    });
+
+    Test test = exits_with("sys-file", code, 42);
+
+    test.segments.push_back({ 0x100, { LI(A0, 2), RET() } });
+    test.segments.push_back({ 0x200, { TEST_FILE[0] } });
+    test.segments.push_back({ 0x300, { LI(A0, 42) } });
+
+    return test;
+}
+
+// what the handler of trapping() exits with
+uint32_t report(uint32_t cause, uint32_t epc, uint32_t tval)
+{
+    return cause ^ epc << 8 ^ tval;
+}
+
+// code that traps right after its first two instructions set mtvec to a
+// handler at 0x100, which exits with what mcause, mepc and mtval say
+Test trapping(const char* name, const std::vector<uint32_t>& code, uint32_t expected)
+{
+    std::vector<uint32_t> handler =
+    {
+        CSRR(A0, CSR_MCAUSE),
+        CSRR(T1, CSR_MEPC),
+        SLLI(T1, T1, 8),
+        XOR(A0, A0, T1),
+        CSRR(T1, CSR_MTVAL),
+        XOR(A0, A0, T1),
+    };
+
+    Test test = exits_with(name, handler, expected);
+    test.segments[0].address = 0x100;
+    test.segments.insert(test.segments.begin(), { 0x000, join({ { LI(T0, 0x100), CSRW(CSR_MTVEC, T0) }, code }) });
+
+    return test;
+}
+
+// ebreak traps to a handler that goes back past it with mret, which has to
+// leave mstatus as the trap found it; the result has mcause, mepc and what
+// mstatus has of MIE and MPIE in the handler and after it
+Test trap_and_return()
+{
+    return
+    {
+        "trap-mret",
+        {
+            {
+                0x000,
+                {
+                    LI(T0, 0x100),
+                    CSRW(CSR_MTVEC, T0),
+                    CSRSI(CSR_MSTATUS, MSTATUS_MIE),
+                    EBREAK(),                           // 00c
+                    CSRR(T1, CSR_MSTATUS),
+                    ANDI(T1, T1, MSTATUS_MIE | MSTATUS_MPIE),
+                    SLLI(T1, T1, 24),
+                    XOR(A0, A0, T1),
+                    LI(A7, SYSCALL_EXIT),
+                    ECALL(),
+                },
+            },
+            {
+                0x100,
+                {
+                    CSRR(A0, CSR_MCAUSE),
+                    CSRR(T1, CSR_MEPC),
+                    SLLI(T1, T1, 8),
+                    XOR(A0, A0, T1),
+                    CSRR(T1, CSR_MSTATUS),
+                    ANDI(T1, T1, MSTATUS_MIE | MSTATUS_MPIE),
+                    SLLI(T1, T1, 16),
+                    XOR(A0, A0, T1),
+                    CSRR(T1, CSR_MEPC),
+                    I(4, T1, 0b000, T1, OPCODE_ALUI),
+                    CSRW(CSR_MEPC, T1),
+                    MRET(),
+                },
+            },
+        },
+        FAULT_BREAKPOINT | 0x00c << 8 | MSTATUS_MPIE << 16 | (uint32_t)(MSTATUS_MIE | MSTATUS_MPIE) << 24,
+    };
+}
+
+// the timer interrupts a loop that jumps to itself, in vectored mode, where
+// it goes to its own slot past mtvec; exceptions would exit with 1
+Test timer_interrupt()
+{
+    Test test = trapping("timer-interrupt",
+    {
+        LI(T0, MIP_MTIP),
+        CSRW(CSR_MIE, T0),
+        CSRSI(CSR_MSTATUS, MSTATUS_MIE),
+        J(0, 0),                                    // 014
+    }, report(MCAUSE_INTERRUPT | IRQ_TIMER, 0x014, 0));
+
+    Segment& code = test.segments[0];
+    Segment& handler = test.segments[1];
+
+    code.words[0] = LI(T0, 0x100 | 1);
+    handler.address += 4 * IRQ_TIMER;
+    test.segments.push_back({ 0x100, { LI(A0, 1), LI(A7, SYSCALL_EXIT), ECALL() } });
+    test.timer = 1000;
+
+    return test;
+}
+
+// wfi with interrupts off wakes when the timer is due and goes on, guest
+// time skipped ahead to it for the next instruction
+Test wfi_timer()
+{
+    Test test = exits_with("wfi-timer",
+    {
+        LI(T0, MIP_MTIP),
+        CSRW(CSR_MIE, T0),
+        WFI(),
+        CSRR(A0, CSR_TIME),
+    }, 1000);
+
+    test.timer = 1000;
+
+    return test;
+}
+
+// Reading a read-only CSR is allowed however it is spelled, csrrs and csrrc
+// from x0 and csrrsi with nothing to set included. Anything that traps
+// instead exits through the handler with something else than misa.
+Test csr_reads()
+{
+    return trapping("csr-reads",
+    {
+        CSRR(A0, CSR_MISA),
+        CSRRS(T1, CSR_CYCLE, 0),
+        CSRRC(T1, CSR_INSTRET, 0),
+        CSRRSI(T1, CSR_MHARTID, 0),
+        CSRRS(T1, CSR_TIMEH, 0),
+        LI(A7, SYSCALL_EXIT),
+        ECALL(),
+    }, MISA);
+}
+
+// the counters as the next instruction sees them: instret and cycle count
+// what retired before it, the two setting mtvec included
+Test csr_counters()
+{
+    return trapping("csr-counters",
+    {
+        LI(T1, 0),
+        LI(T1, 0),
+        LI(T1, 0),
+        CSRR(A0, CSR_INSTRET),
+        CSRR(T1, CSR_CYCLE),
+        SLLI(T1, T1, 8),
+        XOR(A0, A0, T1),
+        CSRR(T1, CSR_INSTRETH),
+        XOR(A0, A0, T1),
+        LI(A7, SYSCALL_EXIT),
+        ECALL(),
+    }, 5 ^ 6 << 8);
+}
+
+// writable CSRs keep only the bits they have: mepc drops bit 0, mstatus
+// keeps MIE and MPIE and always reads MPP as machine mode
+Test csr_warl()
+{
+    return trapping("csr-warl",
+    {
+        LI(T0, -1),
+        CSRW(CSR_MEPC, T0),
+        CSRW(CSR_MSTATUS, T0),
+        CSRR(A0, CSR_MEPC),
+        CSRR(T1, CSR_MSTATUS),
+        XOR(A0, A0, T1),
+        LI(A7, SYSCALL_EXIT),
+        ECALL(),
+    }, 0xfffffffe ^ (MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP));
+}
+
+std::vector<Test> tests()
+{
+    return
+    {
+        self_modifying_after_flush(),
+        jalr_odd_target(),
+
+        // dividing by zero and INT_MIN / -1 do not trap
+        muldiv("div-by-zero",       0b100, 7, 0, 0xffffffff),
+        muldiv("divu-by-zero",      0b101, 7, 0, 0xffffffff),
+        muldiv("rem-by-zero",       0b110, 0xfffffff9, 0, 0xfffffff9),
+        muldiv("remu-by-zero",      0b111, 7, 0, 7),
+        muldiv("div-overflow",      0b100, 0x80000000, 0xffffffff, 0x80000000),
+        muldiv("rem-overflow",      0b110, 0x80000000, 0xffffffff, 0),
+        muldiv("divu-int-min",      0b101, 0x80000000, 0xffffffff, 0),
+        muldiv("div-negative",      0b100, 0xfffffff9, 2, 0xfffffffd),
+        muldiv("rem-negative",      0b110, 0xfffffff9, 2, 0xffffffff),
+        exits_with("div-by-x0", { LI(T0, 5), R(0b0000001, 0, T0, 0b100, A0) }, 0xffffffff),
+
+        // the upper halves, with a signed and an unsigned operand for mulhsu
+        muldiv("mulh-int-min",      0b001, 0x80000000, 0x80000000, 0x40000000),
+        muldiv("mulh-mixed",        0b001, 0xfffffffe, 3, 0xffffffff),
+        muldiv("mulhsu-negative",   0b010, 0xfffffffe, 3, 0xffffffff),
+        muldiv("mulhsu-big",        0b010, 3, 0xffffffff, 2),
+        muldiv("mulhsu-both",       0b010, 0x80000000, 0xffffffff, 0x80000000),
+        muldiv("mulhu-max",         0b011, 0xffffffff, 0xffffffff, 0xfffffffe),
+        muldiv("mul-low",           0b000, 0x80000001, 0xffffffff, 0x7fffffff),
+
+        compressed_alu(),
+        compressed_memory(),
+        compressed_jumps("c-jumps", false),
+        compressed_jumps("c-jalr-odd-target", true),
+        compressed_jr_odd_target(),
+
+        syscall_brk(),
+        syscall_unknown(),
+        syscall_file(),
+
+        trap_and_return(),
+        trapping("trap-illegal", { 0xffffffff }, report(FAULT_ILLEGAL, 0x008, 0xffffffff)),
+        trapping("trap-load-misaligned", { LW(T1, 0x201) }, report(FAULT_LOAD_MISALIGNED, 0x008, 0x201)),
+        trapping("trap-store-misaligned", { SW(T1, 0x202) }, report(FAULT_STORE_MISALIGNED, 0x008, 0x202)),
+        trapping("trap-load-access", { LI(T0, -256), I(0, T0, 0b010, T1, OPCODE_LOAD) }, report(FAULT_LOAD_ACCESS, 0x00c, 0xffffff00)),
+        trapping("trap-fetch-access", { LI(T0, -256), I(0, T0, 0b000, RA, OPCODE_JALR) }, report(FAULT_FETCH_ACCESS, 0xffffff00, 0xffffff00)),
+        timer_interrupt(),
+        wfi_timer(),
+
+        // writing a read-only CSR or touching one that does not exist is illegal
+        trapping("csr-write-counter", { CSRW(CSR_CYCLE, T0) }, report(FAULT_ILLEGAL, 0x008, CSRW(CSR_CYCLE, T0))),
+        trapping("csr-set-hartid", { CSRRS(T1, CSR_MHARTID, T0) }, report(FAULT_ILLEGAL, 0x008, CSRRS(T1, CSR_MHARTID, T0))),
+        trapping("csr-seti-time", { CSRRSI(T1, CSR_TIME, 1) }, report(FAULT_ILLEGAL, 0x008, CSRRSI(T1, CSR_TIME, 1))),
+        trapping("csr-unknown", { CSRR(T1, 0x7c0) }, report(FAULT_ILLEGAL, 0x008, CSRR(T1, 0x7c0))),
+        csr_reads(),
+        csr_counters(),
+        csr_warl(),
+    };
+}
+
+// where guests open their files
+std::string sandbox;
+
+// a test's segments in memory and a CPU about to run them, with system
+// calls on the sandbox
+struct Guest
+{
+    std::vector<uint8_t> memory;
+    Syscalls syscalls;
+    CPU cpu;
+
+    Guest(const Test& test, Engine engine);
+};
+
+Guest::Guest(const Test& test, Engine engine) : memory(MEMORY_SIZE), cpu(memory.data(), MEMORY_SIZE)
+{
+    for (const Segment& segment : test.segments)
+        memcpy(&memory[segment.address], segment.words.data(), segment.words.size() * 4);
+
+    cpu.engine = engine;
+    cpu.reset();
+    cpu.pc = 0;
+    cpu.x[2] = STACK_POINTER;
+    cpu.syscalls = &syscalls;
+
+    syscalls.sandbox = sandbox;
+    syscalls.heap = TEST_HEAP;
+    syscalls.brk = TEST_HEAP;
+
+    if (test.timer != UINT64_MAX)
+        cpu.set_timer(test.timer);
+}
+
+// empty once the guest exited, or else why it did not
+std::string run(Guest& guest)
+{
+    try
+    {
+        guest.cpu.run(TEST_LIMIT);
+    }
+    catch (const Fault& fault)
+    {
+        return fault.what();
+    }
+
+    return guest.cpu.exited() ? "" : "did not exit";
+}
+
+// A guest stopped at a breakpoint, or after a store to a watched word, and
+// sent on the way a debugger does. The instruction under a breakpoint has
+// not run when it stops, a watched store has, and in the end the guest has
+// to have retired what it does without stopping.
+struct Stop
+{
+    const char* name;
+    Test test;
+    uint32_t address;
+    bool watch;
+    uint64_t retired;
+    uint32_t stops;
+};
+
+std::vector<Stop> stops()
+{
+    return
+    {
+        { "breakpoint-loop",    compressed_jumps("c-jumps", false), 0x014, false, 11, 5 },
+        { "breakpoint-target",  jalr_odd_target(), 0x100, false, 3, 1 },
+        { "watch-store",        compressed_memory(), STACK_POINTER - 24, true, 7, 1 },
+    };
+}
+
+// empty if the guest stopped and retired what it should have, or else how
+// it did not
+std::string run(const Stop& stop, Engine engine)
+{
+    Guest plain(stop.test, engine);
+    Guest guest(stop.test, engine);
+    CPU& cpu = guest.cpu;
+    uint32_t stops = 0;
+
+    std::string error = run(plain);
+
+    if (!error.empty())
+        return error;
+
+    if (stop.watch)
+    {
+        cpu.bus.watch(stop.address, 4, WATCH_WRITE);
+        cpu.bus.on_watch = [&cpu](const Watchpoint&, uint32_t)
+        {
+            cpu.halted = true;
+            cpu.trapped = true;
+        };
+    }
+    else
+        cpu.set_breakpoint(stop.address, true);
+
+    try
+    {
+        cpu.run(TEST_LIMIT);
+
+        while (cpu.trapped)
+        {
+            if (stops++ == 0 && cpu.instret != stop.retired)
+                return fmt("stopped after %llu instructions, expected %llu", (unsigned long long)cpu.instret, (unsigned long long)stop.retired);
+
+            cpu.halted = false;
+            cpu.trapped = false;
+
+            // step over the breakpoint with it taken out
+            if (!stop.watch)
+            {
+                cpu.set_breakpoint(stop.address, false);
+                cpu.step();
+                cpu.set_breakpoint(stop.address, true);
+            }
+
+            cpu.run(TEST_LIMIT);
+        }
+    }
+    catch (const Fault& fault)
+    {
+        return fault.what();
+    }
+
+    if (!cpu.exited())
+        return "did not exit";
+
+    if (stops != stop.stops)
+        return fmt("stopped %u times, expected %u", stops, stop.stops);
+
+    if (cpu.instret != plain.cpu.instret)
+        return fmt("retired %llu instructions, expected %llu", (unsigned long long)cpu.instret, (unsigned long long)plain.cpu.instret);
+
+    return "";
+}
+
+int main()
+{
+    int failed = 0;
+    char directory[] = "/tmp/riscv-test-XXXXXX";
+
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror(directory);
+        return 1;
+    }
+
+    sandbox = directory;
+
+    for (const Test& test : tests())
+    {
+        for (Engine engine : { ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT })
+        {
+            Guest guest(test, engine);
+            std::string error = run(guest);
+
+            if (!error.empty())
+            {
+                failed++;
+                printf("%-20s %-12s %s\n", test.name, engine_name[engine], error.c_str());
+            }
+            else if (guest.cpu.exit_code != test.expected)
+            {
+                failed++;
+                printf("%-20s %-12s exit code %u, expected %u\n", test.name, engine_name[engine], guest.cpu.exit_code, test.expected);
+            }
+            else
+                printf("%-20s %-12s ok\n", test.name, engine_name[engine]);
+        }
+    }
+
+    for (const Stop& stop : stops())
+    {
+        for (Engine engine : { ENGINE_INTERPRETER, ENGINE_THREADED, ENGINE_JIT })
+        {
+            std::string error = run(stop, engine);
+
+            if (!error.empty())
+            {
+                failed++;
+                printf("%-20s %-12s %s\n", stop.name, engine_name[engine], error.c_str());
+            }
+            else
+                printf("%-20s %-12s ok\n", stop.name, engine_name[engine]);
+        }
+    }
+
+    unlink((sandbox + "/" TEST_FILE).c_str());
+    rmdir(directory);
+
+    return failed != 0;
+}
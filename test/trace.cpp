@@ -0,0 +1,120 @@
+#include <cpu.h>
+#include <layout.h>
+#include <syscalls.h>
+#include <trace.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// A guest is traced to a file and read back. Setting each record's value
+// in its register has to rebuild the registers the guest ended with, which
+// only works if both ends of the encoding agree on where every value went,
+// a0 for ecall included.
+
+#define TEST_LIMIT      1000000
+#define TEST_HEAP       0x10000
+#define A0              10
+#define A1              11
+#define A7              17
+
+uint32_t I(int32_t imm, uint8_t src1, uint8_t func3, uint8_t dest, uint8_t opcode)
+{
+    return (imm & 0xfff) << 20 | src1 << 15 | func3 << 12 | dest << 7 | opcode;
+}
+
+uint32_t LI(uint8_t dest, int32_t value) { return I(value, 0, 0b000, dest, OPCODE_ALUI); }
+uint32_t ADDI(uint8_t dest, uint8_t src, int32_t value) { return I(value, src, 0b000, dest, OPCODE_ALUI); }
+uint32_t ECALL() { return OPCODE_SYSTEM; }
+
+int main()
+{
+    // two brk calls, so the second value is encoded against the first
+    std::vector<uint32_t> words =
+    {
+        LI(A7, SYSCALL_BRK),
+        LI(A0, 0),
+        ECALL(),                            // a0 = the heap
+        ADDI(A0, A0, 0x100),
+        ECALL(),                            // a0 = the heap + 0x100
+        ADDI(A1, A0, 1),
+        LI(A7, SYSCALL_EXIT),
+        LI(A0, 0),
+        ECALL(),
+    };
+
+    std::vector<uint8_t> memory(MEMORY_SIZE);
+    memcpy(memory.data(), words.data(), words.size() * 4);
+
+    Syscalls syscalls;
+    syscalls.heap = TEST_HEAP;
+    syscalls.brk = TEST_HEAP;
+
+    CPU cpu(memory.data(), MEMORY_SIZE);
+    cpu.reset();
+    cpu.pc = 0;
+    cpu.x[2] = STACK_POINTER;
+    cpu.syscalls = &syscalls;
+
+    char path[] = "/tmp/riscv-trace-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    close(fd);
+
+    TraceWriter writer;
+
+    if (!writer.open(path))
+        return 1;
+
+    cpu.trace = &writer;
+    cpu.run(TEST_LIMIT);
+    cpu.trace = nullptr;
+    writer.close();
+
+    TraceReader reader;
+    TraceRecord record;
+    uint32_t x[32] = {};
+    uint32_t count = 0;
+
+    x[2] = STACK_POINTER;
+
+    if (!reader.open(path))
+        return 1;
+
+    while (reader.next(record))
+    {
+        count++;
+
+        if (record.flags & TRACE_VALUE)
+            x[record.dest] = record.value;
+    }
+
+    unlink(path);
+
+    int failed = 0;
+
+    if (!cpu.exited() || count != words.size())
+    {
+        failed++;
+        printf("%-20s %u records, expected %zu\n", "ecall", count, words.size());
+    }
+
+    for (int i = 0; i < 32; i++)
+    {
+        if (x[i] != cpu.x[i])
+        {
+            failed++;
+            printf("%-20s x%d = %08x, expected %08x\n", "ecall", i, x[i], cpu.x[i]);
+        }
+    }
+
+    if (failed == 0)
+        printf("%-20s ok\n", "ecall");
+
+    return failed != 0;
+}
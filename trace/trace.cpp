@@ -0,0 +1,69 @@
+#include <cpu.h>
+#include <disassembler.h>
+#include <trace.h>
+#include <string.h>
+
+void usage(char** argv)
+{
+    fprintf(stderr, "use: %s [--limit N] [--summary] file\n", argv[0]);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = nullptr;
+    uint64_t limit = 0;
+    bool summary = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+            limit = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--summary") == 0)
+            summary = true;
+        else if (argv[i][0] == '-' || path != nullptr)
+            usage(argv);
+        else
+            path = argv[i];
+    }
+
+    if (path == nullptr)
+        usage(argv);
+
+    TraceReader reader;
+
+    if (!reader.open(path))
+        return EXIT_FAILURE;
+
+    TraceRecord record;
+    uint64_t count = 0;
+    uint64_t accesses = 0;
+
+    while ((limit == 0 || count < limit) && reader.next(record))
+    {
+        count++;
+        accesses += (record.flags & TRACE_MEMORY) != 0;
+
+        if (summary)
+            continue;
+
+        char text[DISASSEMBLY_SIZE];
+        disassemble(record.inst, text, sizeof(text));
+
+        const char* encoding = inst_size(record.inst) == 2 ? "%08x:     %04x  %-24s" : "%08x: %08x  %-24s";
+        std::string line = fmt(encoding, record.pc, record.inst, text);
+
+        if (record.flags & TRACE_VALUE)
+            line += fmt("  %s = %08x", reg_name[record.dest], record.value);
+
+        if (record.flags & TRACE_MEMORY)
+            line += fmt("  [%08x] = %08x", record.address, record.data);
+
+        puts(line.c_str());
+    }
+
+    if (summary)
+        printf("instructions=%llu memory=%llu\n", (unsigned long long)count, (unsigned long long)accesses);
+
+    return EXIT_SUCCESS;
+}